@@ -1,3 +1,4 @@
+#include <math.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -13,6 +14,13 @@
 #include "ruby/st.h"
 #include "ruby_memprofiler_pprof.h"
 
+// The postponed job that drains the sample log might still be queued when its collector is freed; so it's passed
+// one of these, which is left behind for the job to free in that case, rather than the collector itself.
+struct collector_drain_job {
+  struct collector_cdata *cd;
+  bool queued;
+};
+
 struct collector_cdata {
   // Global variables we need to keep a hold of
   VALUE cCollector;
@@ -22,9 +30,15 @@ struct collector_cdata {
   // Ruby Tracepoint objects for our hooks
   VALUE newobj_trace;
   VALUE freeobj_trace;
-
-  // How often (as a fraction of UINT32_MAX) we should sample allocations
-  uint32_t u32_sample_rate;
+  VALUE gc_exit_trace;
+
+  // How often (as a fraction between 0 and 1) we should sample allocations
+  double sample_rate;
+  // Precomputed log(1 - sample_rate), used to draw the number of allocations to skip before taking
+  // the next sample. See collector_draw_allocations_to_skip.
+  double log_sample_skip_probability;
+  // Number of allocations that the newobj hook should ignore before it takes the next sample.
+  size_t allocations_until_next_sample;
   // This flag is used to make sure we detach our tracepoints as we're getting GC'd.
   bool is_tracing;
   // If we're flushing, this contains the thread that's doing the flushing. This is used
@@ -32,27 +46,56 @@ struct collector_cdata {
   VALUE flush_thread;
   // Whether or not to use pretty backtraces (true) or fast ones (false)
   bool pretty_backtraces;
+  // How the newobj hook captures backtraces.
+  struct mpp_capture_opts capture_opts;
+  // Frozen Arrays of the filename & method prefixes capture_opts.elider was compiled from.
+  VALUE elide_files;
+  VALUE elide_methods;
+  // The serialisation context, which keeps its string, function & location dictionaries between flushes. Whilst a
+  // flush is using it, it's in flush_serctx instead (and serctx is NULL). Its string table points into Ruby strings
+  // which our frames might stop referring to, so we keep them alive ourselves.
+  struct mpp_pprof_serctx *serctx;
+  struct mpp_pprof_serctx *flush_serctx;
 
   // ======== Heap samples ========
   // A hash-table keying live VALUEs to their struct mpp_sample. This is _not_ cleared
   // when #flush is called; instead, elements are deleted when they are free'd. This is
   // used for building heap profiles.
-  st_table *heap_samples;
-  // Number of elements currently in the heap profile hash
+  struct mpp_value_table *heap_samples;
+  // Bitmap of which heap slots hold an object that's in heap_samples; this lets the freeobj hook skip the hash
+  // lookup for the vast majority of objects, which were never sampled.
+  struct mpp_heap_bitmap *sampled_objects;
+  // Sampled allocations & frees recorded by the hooks which haven't been applied to heap_samples yet. The
+  // sampled_objects bitmap is kept up-to-date eagerly, but heap_samples (and the stack table) are only updated when
+  // this is drained: from a postponed job, queued whenever a GC finishes or the log is filling up, and at the start of
+  // #flush.
+  struct mpp_sample_log *sample_log;
+  // Number of samples dropped since sample_log was last drained, for want of entries in it; it's grown to fit them
+  // (up to max_heap_samples entries) once it has been.
+  size_t sample_log_overflow;
+  // Handle for the postponed job that drains sample_log; see collector_request_drain.
+  struct collector_drain_job *drain_job;
+  // Number of elements currently in the heap profile hash, plus inserts pending in sample_log
   size_t heap_samples_count;
   // How big the sample table can grow
   size_t max_heap_samples;
   // This number goes up by one every time #flush is called, and is used to keep _new_ samples from winding up in a
   // profile we're in the process of flushing.
   unsigned int current_flush_epoch;
+  // Interned backtraces referred to by the heap samples. This also keeps track of which VALUEs need to be marked
+  // to keep those backtraces alive.
+  struct mpp_stack_table *stacks;
+  // Where the struct mpp_sample's in heap_samples are allocated from.
+  struct mpp_slab *sample_slab;
 
-  // ======== Sample drop counters ========
+  // ======== Sample counters ========
   // Number of samples dropped for want of space in the heap allocation table.
   size_t dropped_samples_heap_bufsize;
-
-  // Table of (VALUE) -> (refcount) which is used to make sure we only mark the parts of our samples once, since many of
-  // the samples will hold references to the same iseq's etc.
-  st_table *mark_table;
+  // Number of samples dropped because the sample log was full, and the postponed job to drain it hadn't run yet.
+  size_t dropped_samples_log_full;
+  // Number of samples whose backtrace fingerprint matched a stack we'd already interned, so that no frames had to be
+  // captured at all.
+  size_t samples_found_by_fingerprint;
 
   // Debugging counters
   int64_t last_gc_mark_ns;
@@ -62,20 +105,32 @@ static struct collector_cdata *collector_cdata_get(VALUE self);
 static VALUE collector_alloc(VALUE klass);
 static VALUE collector_initialize(int argc, VALUE *argv, VALUE self);
 static void collector_cdata_gc_mark(void *ptr);
-static int collector_gc_mark_each_table_entry(st_data_t key, st_data_t value, st_data_t ctxarg);
 static void collector_gc_free(void *ptr);
 static void collector_gc_free_heap_samples(struct collector_cdata *cd);
 static int collector_gc_free_each_heap_sample(st_data_t key, st_data_t value, st_data_t ctxarg);
 static size_t collector_gc_memsize(const void *ptr);
-static int collector_gc_memsize_each_heap_sample(st_data_t key, st_data_t value, st_data_t arg);
 #ifdef HAVE_RB_GC_MARK_MOVABLE
 static void collector_cdata_gc_compact(void *ptr);
-static int collector_compact_each_table_entry(st_data_t key, st_data_t value, st_data_t ctxarg);
-static int collector_compact_each_heap_sample(st_data_t key, st_data_t value, st_data_t ctxarg);
+static VALUE collector_compact_heap_sample_key(VALUE key, st_data_t *value, void *ctx);
+static void collector_compact_merge_heap_samples(st_data_t *existing_value, st_data_t value, void *ctx);
+static int collector_compact_each_sampled_object(st_data_t key, st_data_t value, st_data_t ctxarg);
 #endif
+static void collector_release_sample(struct collector_cdata *cd, struct mpp_sample *sample);
+static void collector_measure_sample(struct collector_cdata *cd, struct mpp_sample *sample);
+static void collector_remove_sample(struct collector_cdata *cd, VALUE freed_obj);
+static void collector_drain_sample_log(struct collector_cdata *cd);
+static void collector_grow_sample_log(struct collector_cdata *cd);
+static void collector_request_drain(struct collector_cdata *cd);
+static void collector_drain_job_run(void *data);
 static void collector_mark_sample_value_as_freed(struct collector_cdata *cd, VALUE freed_obj);
+static size_t collector_draw_allocations_to_skip(struct collector_cdata *cd);
 static void collector_tphook_newobj(VALUE tpval, void *data);
+static void collector_take_sample(struct collector_cdata *cd, VALUE newobj);
+static bool collector_record_sample(struct collector_cdata *cd, VALUE newobj);
+static void collector_capture_sample(struct collector_cdata *cd, VALUE newobj, uint64_t fingerprint,
+                                     const struct mpp_stack_fingerprint_check *fingerprint_check);
 static void collector_tphook_freeobj(VALUE tpval, void *data);
+static void collector_tphook_gc_exit(VALUE tpval, void *data);
 static VALUE collector_start(VALUE self);
 static VALUE collector_stop(VALUE self);
 static VALUE collector_is_running(VALUE self);
@@ -83,8 +138,10 @@ static VALUE collector_flush(int argc, VALUE *argv, VALUE self);
 struct flush_protected_ctx {
   struct collector_cdata *cd;
   struct mpp_pprof_serctx *serctx;
+  VALUE *sample_keys;
   bool yield_gvl;
   bool proactively_yield_gvl;
+  bool counts_only;
 };
 static VALUE flush_protected(VALUE ctxarg);
 struct flush_each_sample_ctx {
@@ -101,7 +158,8 @@ struct flush_each_sample_ctx {
   int64_t gvl_check_yield_count;
   unsigned int flush_epoch;
 };
-int flush_each_sample(st_data_t key, st_data_t value, st_data_t ctxarg);
+static int flush_each_sample(VALUE key, struct flush_each_sample_ctx *ctx);
+static int flush_each_stack_counts(struct mpp_stack *stack, st_data_t ctxarg);
 struct flush_nogvl_ctx {
   struct collector_cdata *cd;
   struct mpp_pprof_serctx *serctx;
@@ -121,10 +179,21 @@ static VALUE collector_get_max_heap_samples(VALUE self);
 static VALUE collector_set_max_heap_samples(VALUE self, VALUE newval);
 static VALUE collector_get_pretty_backtraces(VALUE self);
 static VALUE collector_set_pretty_backtraces(VALUE self, VALUE newval);
+static VALUE collector_get_capture_backend(VALUE self);
+static VALUE collector_set_capture_backend(VALUE self, VALUE newval);
+static VALUE collector_get_max_stack_depth(VALUE self);
+static VALUE collector_set_max_stack_depth(VALUE self, VALUE newval);
+static VALUE collector_get_fold_recursion(VALUE self);
+static VALUE collector_set_fold_recursion(VALUE self, VALUE newval);
+static VALUE collector_get_elide_files(VALUE self);
+static VALUE collector_set_elide_files(VALUE self, VALUE newval);
+static VALUE collector_get_elide_methods(VALUE self);
+static VALUE collector_set_elide_methods(VALUE self, VALUE newval);
+static VALUE collector_elide_prefixes_from(VALUE list, const char *name);
+static void collector_compile_elider(struct collector_cdata *cd);
 static VALUE collector_get_last_mark_nsecs(VALUE self);
 static VALUE collector_get_mark_table_size(VALUE self);
-static void mark_table_refcount_inc(st_table *mark_table, VALUE key);
-static void mark_table_refcount_dec(st_table *mark_table, VALUE key);
+static VALUE collector_mark_table_complete_p(VALUE self);
 
 static const rb_data_type_t collector_cdata_type = {"collector_cdata",
                                                     {
@@ -153,6 +222,16 @@ void mpp_setup_collector_class() {
   rb_define_method(cCollector, "max_heap_samples=", collector_set_max_heap_samples, 1);
   rb_define_method(cCollector, "pretty_backtraces", collector_get_pretty_backtraces, 0);
   rb_define_method(cCollector, "pretty_backtraces=", collector_set_pretty_backtraces, 1);
+  rb_define_method(cCollector, "capture_backend", collector_get_capture_backend, 0);
+  rb_define_method(cCollector, "capture_backend=", collector_set_capture_backend, 1);
+  rb_define_method(cCollector, "max_stack_depth", collector_get_max_stack_depth, 0);
+  rb_define_method(cCollector, "max_stack_depth=", collector_set_max_stack_depth, 1);
+  rb_define_method(cCollector, "fold_recursion", collector_get_fold_recursion, 0);
+  rb_define_method(cCollector, "fold_recursion=", collector_set_fold_recursion, 1);
+  rb_define_method(cCollector, "elide_files", collector_get_elide_files, 0);
+  rb_define_method(cCollector, "elide_files=", collector_set_elide_files, 1);
+  rb_define_method(cCollector, "elide_methods", collector_get_elide_methods, 0);
+  rb_define_method(cCollector, "elide_methods=", collector_set_elide_methods, 1);
   rb_define_method(cCollector, "running?", collector_is_running, 0);
   rb_define_method(cCollector, "start!", collector_start, 0);
   rb_define_method(cCollector, "stop!", collector_stop, 0);
@@ -161,6 +240,7 @@ void mpp_setup_collector_class() {
   rb_define_method(cCollector, "live_heap_samples_count", collector_live_heap_samples_count, 0);
   rb_define_method(cCollector, "last_mark_nsecs", collector_get_last_mark_nsecs, 0);
   rb_define_method(cCollector, "mark_table_size", collector_get_mark_table_size, 0);
+  rb_define_method(cCollector, "mark_table_complete?", collector_mark_table_complete_p, 0);
 }
 
 static struct collector_cdata *collector_cdata_get(VALUE self) {
@@ -175,16 +255,38 @@ static VALUE collector_alloc(VALUE klass) {
 
   cd->newobj_trace = Qnil;
   cd->freeobj_trace = Qnil;
+  cd->gc_exit_trace = Qnil;
   cd->flush_thread = Qnil;
+  cd->serctx = NULL;
+  cd->flush_serctx = NULL;
 
-  cd->u32_sample_rate = 0;
+  cd->sample_rate = 0;
+  cd->log_sample_skip_probability = 0;
+  cd->allocations_until_next_sample = SIZE_MAX;
   cd->is_tracing = false;
+  cd->capture_opts.backend = MPP_CAPTURE_BACKEND_BACKTRACIE;
+  cd->capture_opts.max_depth = 0;
+  cd->capture_opts.fold_recursion = false;
+  cd->capture_opts.elider = NULL;
+  cd->capture_opts.profile_frames = mpp_profile_frames_buffer_new();
+  cd->capture_opts.capture_cache = mpp_capture_cache_new();
+  cd->elide_files = rb_obj_freeze(rb_ary_new());
+  cd->elide_methods = rb_obj_freeze(rb_ary_new());
   cd->heap_samples = NULL;
+  cd->sampled_objects = NULL;
+  cd->sample_log = NULL;
+  cd->sample_log_overflow = 0;
+  cd->drain_job = mpp_xmalloc(sizeof(struct collector_drain_job));
+  cd->drain_job->cd = cd;
+  cd->drain_job->queued = false;
   cd->heap_samples_count = 0;
   cd->max_heap_samples = 0;
   cd->dropped_samples_heap_bufsize = 0;
+  cd->dropped_samples_log_full = 0;
+  cd->samples_found_by_fingerprint = 0;
   cd->current_flush_epoch = 0;
-  cd->mark_table = NULL;
+  cd->stacks = NULL;
+  cd->sample_slab = NULL;
   cd->last_gc_mark_ns = 0;
   return v;
 }
@@ -200,12 +302,18 @@ static VALUE collector_initialize(int argc, VALUE *argv, VALUE self) {
   // Argument parsing
   VALUE kwargs_hash = Qnil;
   rb_scan_args_kw(RB_SCAN_ARGS_LAST_HASH_KEYWORDS, argc, argv, "00:", &kwargs_hash);
-  VALUE kwarg_values[3];
-  ID kwarg_ids[3];
+  VALUE kwarg_values[9];
+  ID kwarg_ids[9];
   kwarg_ids[0] = rb_intern("sample_rate");
   kwarg_ids[1] = rb_intern("max_heap_samples");
   kwarg_ids[2] = rb_intern("pretty_backtraces");
-  rb_get_kwargs(kwargs_hash, kwarg_ids, 0, 3, kwarg_values);
+  kwarg_ids[3] = rb_intern("huge_pages");
+  kwarg_ids[4] = rb_intern("capture_backend");
+  kwarg_ids[5] = rb_intern("max_stack_depth");
+  kwarg_ids[6] = rb_intern("fold_recursion");
+  kwarg_ids[7] = rb_intern("elide_files");
+  kwarg_ids[8] = rb_intern("elide_methods");
+  rb_get_kwargs(kwargs_hash, kwarg_ids, 0, 9, kwarg_values);
 
   // Default values...
   if (kwarg_values[0] == Qundef)
@@ -214,15 +322,37 @@ static VALUE collector_initialize(int argc, VALUE *argv, VALUE self) {
     kwarg_values[1] = LONG2NUM(50000);
   if (kwarg_values[2] == Qundef)
     kwarg_values[2] = Qtrue;
+  if (kwarg_values[3] == Qundef)
+    kwarg_values[3] = Qfalse;
+  if (kwarg_values[4] == Qundef)
+    kwarg_values[4] = ID2SYM(rb_intern("backtracie"));
+  if (kwarg_values[5] == Qundef)
+    kwarg_values[5] = Qnil;
+  if (kwarg_values[6] == Qundef)
+    kwarg_values[6] = Qfalse;
+  if (kwarg_values[7] == Qundef)
+    kwarg_values[7] = rb_ary_new();
+  if (kwarg_values[8] == Qundef)
+    kwarg_values[8] = rb_ary_new();
 
   rb_funcall(self, rb_intern("sample_rate="), 1, kwarg_values[0]);
   rb_funcall(self, rb_intern("max_heap_samples="), 1, kwarg_values[1]);
   rb_funcall(self, rb_intern("pretty_backtraces="), 1, kwarg_values[2]);
-
-  cd->heap_samples = st_init_numtable();
+  rb_funcall(self, rb_intern("capture_backend="), 1, kwarg_values[4]);
+  rb_funcall(self, rb_intern("max_stack_depth="), 1, kwarg_values[5]);
+  rb_funcall(self, rb_intern("fold_recursion="), 1, kwarg_values[6]);
+  rb_funcall(self, rb_intern("elide_files="), 1, kwarg_values[7]);
+  rb_funcall(self, rb_intern("elide_methods="), 1, kwarg_values[8]);
+
+  cd->heap_samples = mpp_value_table_new(cd->max_heap_samples);
+  cd->sampled_objects = mpp_heap_bitmap_new();
+  cd->sample_log = mpp_sample_log_new(MPP_SAMPLE_LOG_ENTRIES);
   cd->heap_samples_count = 0;
 
-  cd->mark_table = st_init_numtable();
+  // Huge pages can only be chosen up-front, since it's a property of the memory the slabs have already mapped.
+  bool huge_pages = RTEST(kwarg_values[3]);
+  cd->stacks = mpp_stack_table_new(huge_pages);
+  cd->sample_slab = mpp_slab_new(sizeof(struct mpp_sample), huge_pages);
 
   return Qnil;
 }
@@ -233,21 +363,36 @@ static void collector_cdata_gc_mark(void *ptr) {
   struct collector_cdata *cd = (struct collector_cdata *)ptr;
   rb_gc_mark_movable(cd->newobj_trace);
   rb_gc_mark_movable(cd->freeobj_trace);
+  rb_gc_mark_movable(cd->gc_exit_trace);
   rb_gc_mark_movable(cd->mMemprofilerPprof);
   rb_gc_mark_movable(cd->cCollector);
   rb_gc_mark_movable(cd->cProfileData);
   rb_gc_mark_movable(cd->flush_thread);
-  st_foreach(cd->mark_table, collector_gc_mark_each_table_entry, 0);
+  rb_gc_mark_movable(cd->elide_files);
+  rb_gc_mark_movable(cd->elide_methods);
+  if (cd->stacks) {
+    mpp_stack_table_mark(cd->stacks);
+  }
+  if (cd->sample_log) {
+    mpp_sample_log_mark(cd->sample_log);
+  }
+  if (cd->serctx) {
+    mpp_pprof_serctx_mark(cd->serctx);
+  }
+  if (cd->flush_serctx) {
+    mpp_pprof_serctx_mark(cd->flush_serctx);
+  }
+  if (cd->capture_opts.elider) {
+    mpp_frame_elider_mark(cd->capture_opts.elider);
+  }
+  if (cd->capture_opts.capture_cache) {
+    mpp_capture_cache_mark(cd->capture_opts.capture_cache);
+  }
 
   struct timespec t2 = mpp_gettime_monotonic();
   cd->last_gc_mark_ns = mpp_time_delta_nsec(t1, t2);
 }
 
-static int collector_gc_mark_each_table_entry(st_data_t key, st_data_t value, st_data_t ctxarg) {
-  rb_gc_mark_movable((VALUE)key);
-  return ST_CONTINUE;
-}
-
 static void collector_gc_free(void *ptr) {
   struct collector_cdata *cd = (struct collector_cdata *)ptr;
   if (cd->is_tracing) {
@@ -257,23 +402,70 @@ static void collector_gc_free(void *ptr) {
     if (cd->freeobj_trace) {
       rb_tracepoint_disable(cd->freeobj_trace);
     }
+    if (cd->gc_exit_trace) {
+      rb_tracepoint_disable(cd->gc_exit_trace);
+    }
   }
 
   collector_gc_free_heap_samples(cd);
+  if (cd->sampled_objects) {
+    mpp_heap_bitmap_destroy(cd->sampled_objects);
+  }
+  if (cd->sample_log) {
+    mpp_sample_log_destroy(cd->sample_log);
+  }
+  if (cd->drain_job->queued) {
+    cd->drain_job->cd = NULL;
+  } else {
+    mpp_free(cd->drain_job);
+  }
+  if (cd->stacks) {
+    mpp_stack_table_destroy(cd->stacks);
+  }
+  if (cd->serctx) {
+    mpp_pprof_serctx_destroy(cd->serctx);
+  }
+  if (cd->sample_slab) {
+    mpp_slab_destroy(cd->sample_slab);
+  }
+  if (cd->capture_opts.elider) {
+    mpp_frame_elider_destroy(cd->capture_opts.elider);
+  }
+  if (cd->capture_opts.profile_frames) {
+    mpp_profile_frames_buffer_destroy(cd->capture_opts.profile_frames);
+  }
+  if (cd->capture_opts.capture_cache) {
+    mpp_capture_cache_destroy(cd->capture_opts.capture_cache);
+  }
   ruby_xfree(ptr);
 }
 
 static void collector_gc_free_heap_samples(struct collector_cdata *cd) {
   if (cd->heap_samples) {
-    st_foreach(cd->heap_samples, collector_gc_free_each_heap_sample, (st_data_t)cd);
-    st_free_table(cd->heap_samples);
+    mpp_value_table_foreach(cd->heap_samples, collector_gc_free_each_heap_sample, (st_data_t)cd);
+    mpp_value_table_destroy(cd->heap_samples);
   }
   cd->heap_samples = NULL;
+  if (cd->sampled_objects) {
+    mpp_heap_bitmap_clear_all(cd->sampled_objects);
+  }
+  // Nothing in the log has been interned yet, so it can just be dropped, apart from the references to stacks that
+  // inserts found by fingerprint are holding.
+  if (cd->sample_log) {
+    for (size_t i = 0; i < cd->sample_log->entries_count; i++) {
+      struct mpp_sample_log_entry *entry = &cd->sample_log->entries[i];
+      if (entry->is_insert && entry->fingerprint == MPP_SAMPLE_LOG_INTERNED) {
+        mpp_stack_table_release(cd->stacks, entry->stack_id);
+      }
+    }
+    mpp_sample_log_clear(cd->sample_log);
+  }
 }
 
 static int collector_gc_free_each_heap_sample(st_data_t key, st_data_t value, st_data_t ctxarg) {
+  struct collector_cdata *cd = (struct collector_cdata *)ctxarg;
   struct mpp_sample *sample = (struct mpp_sample *)value;
-  mpp_sample_free(sample);
+  collector_release_sample(cd, sample);
   return ST_DELETE;
 }
 
@@ -281,132 +473,268 @@ static size_t collector_gc_memsize(const void *ptr) {
   struct collector_cdata *cd = (struct collector_cdata *)ptr;
   size_t sz = sizeof(*cd);
   if (cd->heap_samples) {
-    st_foreach(cd->heap_samples, collector_gc_memsize_each_heap_sample, (st_data_t)&sz);
-    sz += st_memsize(cd->heap_samples);
+    sz += mpp_value_table_memsize(cd->heap_samples);
+  }
+  if (cd->sample_slab) {
+    sz += mpp_slab_memsize(cd->sample_slab);
+  }
+  if (cd->sampled_objects) {
+    sz += mpp_heap_bitmap_memsize(cd->sampled_objects);
+  }
+  if (cd->sample_log) {
+    sz += mpp_sample_log_memsize(cd->sample_log);
+  }
+  if (cd->serctx) {
+    sz += mpp_pprof_serctx_memsize(cd->serctx);
+  }
+  if (cd->stacks) {
+    sz += mpp_stack_table_memsize(cd->stacks);
+  }
+  if (cd->capture_opts.elider) {
+    sz += mpp_frame_elider_memsize(cd->capture_opts.elider);
+  }
+  if (cd->capture_opts.profile_frames) {
+    sz += mpp_profile_frames_buffer_memsize(cd->capture_opts.profile_frames);
+  }
+  if (cd->capture_opts.capture_cache) {
+    sz += mpp_capture_cache_memsize(cd->capture_opts.capture_cache);
   }
 
   return sz;
 }
 
-static int collector_gc_memsize_each_heap_sample(st_data_t key, st_data_t value, st_data_t arg) {
-  size_t *acc_ptr = (size_t *)arg;
-  struct mpp_sample *sample = (struct mpp_sample *)value;
-  *acc_ptr += mpp_sample_memsize(sample);
-  return ST_CONTINUE;
-}
-
 #ifdef HAVE_RB_GC_MARK_MOVABLE
 // Support VALUES we're tracking being moved away in Ruby 2.7+ with GC.compact
 static void collector_cdata_gc_compact(void *ptr) {
   struct collector_cdata *cd = (struct collector_cdata *)ptr;
   cd->newobj_trace = rb_gc_location(cd->newobj_trace);
   cd->freeobj_trace = rb_gc_location(cd->freeobj_trace);
+  cd->gc_exit_trace = rb_gc_location(cd->gc_exit_trace);
   cd->mMemprofilerPprof = rb_gc_location(cd->mMemprofilerPprof);
   cd->cCollector = rb_gc_location(cd->cCollector);
   cd->cProfileData = rb_gc_location(cd->cProfileData);
   cd->flush_thread = rb_gc_location(cd->flush_thread);
+  cd->elide_files = rb_gc_location(cd->elide_files);
+  cd->elide_methods = rb_gc_location(cd->elide_methods);
+
+  // Apply everything in the sample log first, so that the sample map only refers to live objects (and so they can
+  // all safely be passed to rb_gc_location). The frames in the log were pinned, so they can be interned as-is and
+  // then updated along with the rest of the stack table.
+  collector_drain_sample_log(cd);
 
   // Keep track of allocated objects we sampled that might move.
-  st_foreach(cd->heap_samples, collector_compact_each_heap_sample, (st_data_t)cd);
-  st_foreach(cd->mark_table, collector_compact_each_table_entry, (st_data_t)cd);
+  mpp_value_table_rekey(cd->heap_samples, collector_compact_heap_sample_key, collector_compact_merge_heap_samples, cd);
+  // Objects can move into slots other sampled objects just moved out of, so it's simplest to rebuild the bitmap of
+  // sampled objects from scratch rather than fix it up as we go.
+  mpp_heap_bitmap_clear_all(cd->sampled_objects);
+  mpp_value_table_foreach(cd->heap_samples, collector_compact_each_sampled_object, (st_data_t)cd);
+  // And the VALUEs our backtraces refer to. The objects backtrace fingerprints are made from are pinned, so those
+  // are all still good.
+  mpp_stack_table_compact(cd->stacks);
+  // So are the ones in each thread's last control frames, but the threads themselves might have moved.
+  mpp_capture_cache_forget_threads(cd->capture_opts.capture_cache);
 }
 
-static int mark_table_refcount_update(st_data_t *key, st_data_t *value, st_data_t ctxarg, int existing) {
-  if (existing) {
-    *value += ((int)ctxarg);
-  } else {
-    *value = ((int)ctxarg);
-  }
-  return *value == 0 ? ST_DELETE : ST_CONTINUE;
+static VALUE collector_compact_heap_sample_key(VALUE key, st_data_t *value, void *ctx) {
+  struct mpp_sample *sample = (struct mpp_sample *)*value;
+  // Handle compaction of our weak reference to the heap sample.
+  sample->allocated_value_weak = rb_gc_location(sample->allocated_value_weak);
+  return sample->allocated_value_weak;
+}
+
+static void collector_compact_merge_heap_samples(st_data_t *existing_value, st_data_t value, void *ctx) {
+  // Two samples can't really refer to the same live object; if they somehow do, keep the first.
+  struct collector_cdata *cd = (struct collector_cdata *)ctx;
+  collector_release_sample(cd, (struct mpp_sample *)value);
+  cd->heap_samples_count--;
 }
 
-static int collector_compact_each_table_entry(st_data_t key, st_data_t value, st_data_t ctxarg) {
+static int collector_compact_each_sampled_object(st_data_t key, st_data_t value, st_data_t ctxarg) {
   struct collector_cdata *cd = (struct collector_cdata *)ctxarg;
-  VALUE key_value = (VALUE)key;
-  VALUE new_value = rb_gc_location(key_value);
-  if (new_value == key_value) {
-    return ST_CONTINUE;
-  } else {
-    // Insert a new netry for the moved value, or add this items refcount to the existing entry.
-    st_update(cd->mark_table, new_value, mark_table_refcount_update, value);
-    return ST_DELETE;
+  mpp_heap_bitmap_set(cd->sampled_objects, (VALUE)key);
+  return ST_CONTINUE;
+}
+
+#endif
+
+// Frees a sample that has been removed from the heap sample map, along with its reference to its stack.
+static void collector_release_sample(struct collector_cdata *cd, struct mpp_sample *sample) {
+  struct mpp_stack *stack = mpp_stack_table_get(cd->stacks, sample->stack_id);
+  stack->live_objects--;
+  stack->live_bytes -= sample->allocated_value_objsize;
+  mpp_stack_table_release(cd->stacks, sample->stack_id);
+  mpp_sample_free(cd->sample_slab, sample);
+}
+
+// Measures the size of the sample's object (again), keeping its stack's running total of live bytes in step for the
+// benefit of counts-only flushes.
+static void collector_measure_sample(struct collector_cdata *cd, struct mpp_sample *sample) {
+  struct mpp_stack *stack = mpp_stack_table_get(cd->stacks, sample->stack_id);
+  stack->live_bytes -= sample->allocated_value_objsize;
+  sample->allocated_value_objsize = mpp_rb_obj_memsize_of(sample->allocated_value_weak);
+  stack->live_bytes += sample->allocated_value_objsize;
+}
+
+// Removes the sample for freed_obj from the sample map, if there is one.
+static void collector_remove_sample(struct collector_cdata *cd, VALUE freed_obj) {
+  struct mpp_sample *sample;
+  if (mpp_value_table_delete(cd->heap_samples, freed_obj, (st_data_t *)&sample)) {
+    // We deleted it out of live objects; free the sample
+    collector_release_sample(cd, sample);
+    cd->heap_samples_count--;
   }
 }
 
-static int collector_compact_each_heap_sample(st_data_t key, st_data_t value, st_data_t ctxarg) {
-  struct collector_cdata *cd = (struct collector_cdata *)ctxarg;
-  struct mpp_sample *sample = (struct mpp_sample *)value;
+// Applies everything recorded in the sample log to the sample map & stack table, in order.
+static void collector_drain_sample_log(struct collector_cdata *cd) {
+  struct mpp_sample_log *log = cd->sample_log;
+  if (log->entries_count == 0) {
+    return;
+  }
+  // Interning stacks and inserting into the sample map allocate memory. As in the hooks, we can't let that trigger a
+  // GC, since this might be running inside the GC itself (when compacting), and besides, frees of sampled objects in
+  // the middle of this would append to the log we're iterating over.
+  VALUE gc_was_already_disabled = mpp_rb_gc_disable_no_rest();
 
-  for (size_t i = 0; i < sample->frames_count; i++) {
-    minimal_location_t *frame = &sample->frames[i];
-    if (frame->method_name_contents == BACKTRACIE_METHOD_NAME_CONTENTS_BASE_LABEL) {
-      frame->method_name.base_label = rb_gc_location(frame->method_name.base_label);
+  for (size_t i = 0; i < log->entries_count; i++) {
+    struct mpp_sample_log_entry *entry = &log->entries[i];
+    if (!entry->is_insert) {
+      collector_remove_sample(cd, entry->obj);
+      continue;
+    }
+    if (entry->cancelled) {
+      if (entry->fingerprint == MPP_SAMPLE_LOG_INTERNED) {
+        mpp_stack_table_release(cd->stacks, entry->stack_id);
+      }
+      continue;
     }
-    switch (frame->method_qualifier_contents) {
-    case BACKTRACIE_METHOD_QUALIFIER_CONTENTS_SELF:
-      frame->method_qualifier.self = rb_gc_location(frame->method_qualifier.self);
-      break;
-    case BACKTRACIE_METHOD_QUALIFIER_CONTENTS_SELF_CLASS:
-      frame->method_qualifier.self_class = rb_gc_location(frame->method_qualifier.self_class);
-      break;
-    case BACKTRACIE_METHOD_QUALIFIER_CONTENTS_CME_CLASS:
-      frame->method_qualifier.cme_defined_class = rb_gc_location(frame->method_qualifier.cme_defined_class);
-      break;
+    uint32_t stack_id = entry->stack_id;
+    if (entry->fingerprint != MPP_SAMPLE_LOG_INTERNED) {
+      stack_id = mpp_stack_table_intern(cd->stacks, entry->thread, &log->frames[entry->frames_start],
+                                        entry->frames_count);
+      if (entry->fingerprint != MPP_SAMPLE_LOG_UNFINGERPRINTED) {
+        mpp_stack_table_remember_fingerprint(cd->stacks, entry->fingerprint, &entry->fingerprint_check,
+                                             &log->deps[entry->deps_start], entry->deps_count,
+                                             entry->fingerprint_generation, stack_id);
+      }
+    }
+    struct mpp_sample *sample = mpp_sample_new(cd->sample_slab, entry->obj, stack_id);
+    sample->flush_epoch = entry->flush_epoch;
+    bool already_existed = mpp_value_table_insert(cd->heap_samples, entry->obj, (st_data_t)sample);
+    MPP_ASSERT_MSG(!already_existed, "sample log inserted an object that was already in the sample map");
+    mpp_stack_table_get(cd->stacks, stack_id)->live_objects++;
+  }
+  // Now that everything freed in the meantime is out of the sample map, measure the new samples' objects, so that
+  // counts-only flushes have sizes for them. The newobj hook would be too soon, since the objects haven't even been
+  // filled in then.
+  for (size_t i = 0; i < log->entries_count; i++) {
+    struct mpp_sample_log_entry *entry = &log->entries[i];
+    st_data_t value;
+    if (entry->is_insert && !entry->cancelled && mpp_value_table_lookup(cd->heap_samples, entry->obj, &value)) {
+      struct mpp_sample *sample = (struct mpp_sample *)value;
+      if (mpp_is_value_still_validish(sample->allocated_value_weak)) {
+        collector_measure_sample(cd, sample);
+      }
     }
-    frame->filename = rb_gc_location(frame->filename);
+  }
+  mpp_sample_log_clear(log);
+  if (cd->sample_log_overflow > 0) {
+    collector_grow_sample_log(cd);
   }
 
-  // Handle compaction of our weak reference to the heap sample.
-  if (rb_gc_location(sample->allocated_value_weak) == sample->allocated_value_weak) {
-    return ST_CONTINUE;
-  } else {
-    sample->allocated_value_weak = rb_gc_location(sample->allocated_value_weak);
-    st_insert(cd->heap_samples, sample->allocated_value_weak, (st_data_t)sample);
-    return ST_DELETE;
+  if (!RTEST(gc_was_already_disabled)) {
+    rb_gc_enable();
   }
 }
 
-#endif
+// Grows the (just-drained) sample log, by doubling it until it could have held the samples it had to drop as well, so
+// that the same burst of allocations won't lose any next time. It's never grown past max_heap_samples entries though:
+// no more inserts than that can be pending at once anyway, since they count towards heap_samples_count.
+static void collector_grow_sample_log(struct collector_cdata *cd) {
+  struct mpp_sample_log *log = cd->sample_log;
+  size_t entries_capa = log->entries_capa;
+  while (entries_capa < log->entries_capa + cd->sample_log_overflow) {
+    entries_capa *= 2;
+  }
+  if (entries_capa > cd->max_heap_samples) {
+    entries_capa = cd->max_heap_samples;
+  }
+  mpp_sample_log_grow(log, entries_capa);
+  cd->sample_log_overflow = 0;
+}
 
 static void collector_mark_sample_value_as_freed(struct collector_cdata *cd, VALUE freed_obj) {
-  struct mpp_sample *sample;
-  if (st_delete(cd->heap_samples, (st_data_t *)&freed_obj, (st_data_t *)&sample)) {
-    for (size_t i = 0; i < sample->frames_count; i++) {
-      minimal_location_t *frame = &sample->frames[i];
-      if (frame->method_name_contents == BACKTRACIE_METHOD_NAME_CONTENTS_BASE_LABEL) {
-        mark_table_refcount_dec(cd->mark_table, frame->method_name.base_label);
-      }
-      switch (frame->method_qualifier_contents) {
-      case BACKTRACIE_METHOD_QUALIFIER_CONTENTS_SELF:
-        mark_table_refcount_dec(cd->mark_table, frame->method_qualifier.self);
-        break;
-      case BACKTRACIE_METHOD_QUALIFIER_CONTENTS_SELF_CLASS:
-        mark_table_refcount_dec(cd->mark_table, frame->method_qualifier.self_class);
-        break;
-      case BACKTRACIE_METHOD_QUALIFIER_CONTENTS_CME_CLASS:
-        mark_table_refcount_dec(cd->mark_table, frame->method_qualifier.cme_defined_class);
-        break;
-      }
-      mark_table_refcount_dec(cd->mark_table, frame->filename);
+  // Almost none of the objects that come through here were sampled; one bit test is enough to rule those out
+  // without going near the hash table.
+  if (!mpp_heap_bitmap_test(cd->sampled_objects, freed_obj)) {
+    return;
+  }
+  mpp_heap_bitmap_clear(cd->sampled_objects, freed_obj);
+  // Removing it from the sample map itself is deferred until the log is drained.
+  if (mpp_sample_log_push_remove(cd->sample_log, freed_obj)) {
+    if (mpp_sample_log_wants_drain(cd->sample_log)) {
+      collector_request_drain(cd);
     }
-
-    // We deleted it out of live objects; free the sample
-    mpp_sample_free(sample);
+    return;
+  }
+  // The log is full. A free can't just be dropped like a new sample can, so it has to be applied straight away; that
+  // never allocates memory, so it's safe even here. If the object's insert is still in the log, cancelling it there
+  // is enough; otherwise, its sample is in the sample map already.
+  if (mpp_sample_log_cancel_insert(cd->sample_log, freed_obj)) {
     cd->heap_samples_count--;
+  } else {
+    collector_remove_sample(cd, freed_obj);
   }
 }
 
-static void mark_table_refcount_inc(st_table *mark_table, VALUE key) {
-  if (key == Qnil || key == Qundef || key == 0) {
+// The hooks never drain the sample log themselves: the freeobj hook runs in the middle of sweeping, and interning
+// stacks & growing the sample map there would mean allocating memory mid-GC. Instead, they ask for it to be drained
+// from a postponed job, which Ruby runs at its next safe point. If the log fills up before then, new samples are
+// dropped (see collector_take_sample).
+static void collector_request_drain(struct collector_cdata *cd) {
+  struct collector_drain_job *job = cd->drain_job;
+  if (job->queued) {
     return;
   }
-  st_update(mark_table, key, mark_table_refcount_update, 1);
+  // This only fails if Ruby's postponed job buffer is full, in which case the next sample or GC will try again.
+  // rb_postponed_job_register_one isn't used, because it only lets one collector at a time have a job queued.
+  if (rb_postponed_job_register(0, collector_drain_job_run, job)) {
+    job->queued = true;
+  }
 }
-static void mark_table_refcount_dec(st_table *mark_table, VALUE key) {
-  if (key == Qnil || key == Qundef || key == 0) {
+
+static void collector_drain_job_run(void *data) {
+  struct collector_drain_job *job = (struct collector_drain_job *)data;
+  job->queued = false;
+  if (!job->cd) {
+    // The collector was freed whilst this was queued.
+    mpp_free(job);
     return;
   }
-  st_update(mark_table, key, mark_table_refcount_update, (st_data_t)-1);
+  collector_drain_sample_log(job->cd);
+}
+
+// Rather than rolling the dice on every single allocation to decide whether or not to sample it, we instead
+// draw the number of allocations to skip until the next sample is taken. If each allocation is independently
+// sampled with probability p, the number of unsampled allocations between two samples follows a geometric
+// distribution, P(skip = k) = (1 - p)^k * p; this can be drawn by inverting its CDF with a single uniform
+// random number. The resulting samples are statistically identical to the per-allocation coin flip, but the
+// random number generator is only consulted once per sample, and the common unsampled path in the newobj hook
+// becomes a simple decrement-and-compare.
+static size_t collector_draw_allocations_to_skip(struct collector_cdata *cd) {
+  if (cd->sample_rate >= 1.0) {
+    return 0;
+  }
+  if (cd->sample_rate <= 0.0) {
+    return SIZE_MAX;
+  }
+  // Uniform in the open interval (0, 1); we must not take the log of zero.
+  double u = ((double)mpp_rand() + 1.0) / ((double)UINT32_MAX + 2.0);
+  double skip = floor(log(u) / cd->log_sample_skip_probability);
+  if (skip >= (double)SIZE_MAX) {
+    return SIZE_MAX;
+  }
+  return (size_t)skip;
 }
 
 static void collector_tphook_newobj(VALUE tpval, void *data) {
@@ -419,14 +747,11 @@ static void collector_tphook_newobj(VALUE tpval, void *data) {
   //   2) No Ruby objects are freed in this method,
   // We achieve 1 by, well, not creating any Ruby objects. 2 would happen if the GC runs; one
   // of the things that _can_ trigger the GC to run, unfortunately, is ruby_xmalloc() and
-  // friends (used internally by backtracie, and by st_hash, and also by this gem's malloc
-  // wrapper). So, we need to disable the GC, and re-enable it at the end of our hook.
-  // The normal "disable the GC" function, rb_gc_disable(), doesn't quite do it, because _that_
-  // calls rb_gc_rest() to finish off any in-progress collection! If we called that, we'd free
-  // objects, and miss removing them from our sample map. So, instead, we twiddle the dont_gc
-  // flag on the objspace directly with this compat wrapper.
-  VALUE gc_was_already_disabled = mpp_rb_gc_disable_no_rest();
-
+  // friends (used internally by backtracie, and by st_hash, and also by this gem's malloc wrapper).
+  //
+  // Nothing on the path for an allocation we don't sample allocates memory, so that path doesn't need
+  // to worry about this. Taking a sample might, though, so we disable the GC around that (see
+  // collector_take_sample).
   rb_trace_arg_t *tparg;
   VALUE newobj;
   struct collector_cdata *cd = (struct collector_cdata *)data;
@@ -445,21 +770,23 @@ static void collector_tphook_newobj(VALUE tpval, void *data) {
   collector_mark_sample_value_as_freed(cd, newobj);
 #endif
   // Skip the rest of this method if we're not sampling.
-  if (mpp_rand() > cd->u32_sample_rate) {
-    goto out;
+  if (cd->allocations_until_next_sample > 0) {
+    cd->allocations_until_next_sample--;
+    return;
   }
+  cd->allocations_until_next_sample = collector_draw_allocations_to_skip(cd);
   // Don't profile allocations that were caused by the flusher; these allocations are
   //     1) numerous,
   //     2) probably not of interest,
   //     3) guaranteed not to actually make it into a heap usage profile anyway, since
   //        they get freed at the end of the flushing routine.
   if (rb_thread_current() == cd->flush_thread) {
-    goto out;
+    return;
   }
   // Make sure there's enough space in our buffer
   if (cd->heap_samples_count >= cd->max_heap_samples) {
     cd->dropped_samples_heap_bufsize++;
-    goto out;
+    return;
   }
 
 #ifndef HAVE_WORKING_RB_GC_FORCE_RECYCLE
@@ -470,53 +797,105 @@ static void collector_tphook_newobj(VALUE tpval, void *data) {
   newobj = rb_tracearg_object(tparg);
 #endif
 
-  // OK, now it's time to add to our sample buffer.
-  struct mpp_sample *sample = mpp_sample_capture(newobj);
-  sample->flush_epoch = cd->current_flush_epoch;
-  // insert into live sample map
-  int alread_existed = st_insert(cd->heap_samples, newobj, (st_data_t)sample);
-  MPP_ASSERT_MSG(alread_existed == 0, "st_insert did an update in the newobj hook");
-  cd->heap_samples_count++;
-
-  // Add them to the list of things we will GC mark
-  for (size_t i = 0; i < sample->frames_count; i++) {
-    minimal_location_t *frame = &sample->frames[i];
-    if (frame->method_name_contents == BACKTRACIE_METHOD_NAME_CONTENTS_BASE_LABEL) {
-      mark_table_refcount_inc(cd->mark_table, frame->method_name.base_label);
-    }
-    switch (frame->method_qualifier_contents) {
-    case BACKTRACIE_METHOD_QUALIFIER_CONTENTS_SELF:
-      mark_table_refcount_inc(cd->mark_table, frame->method_qualifier.self);
-      break;
-    case BACKTRACIE_METHOD_QUALIFIER_CONTENTS_SELF_CLASS:
-      mark_table_refcount_inc(cd->mark_table, frame->method_qualifier.self_class);
-      break;
-    case BACKTRACIE_METHOD_QUALIFIER_CONTENTS_CME_CLASS:
-      mark_table_refcount_inc(cd->mark_table, frame->method_qualifier.cme_defined_class);
-      break;
+  collector_take_sample(cd, newobj);
+}
+
+static void collector_take_sample(struct collector_cdata *cd, VALUE newobj) {
+  // Capturing the backtrace can allocate memory, and thus trigger the GC. So, we need to disable the GC, and
+  // re-enable it at the end.
+  // The normal "disable the GC" function, rb_gc_disable(), doesn't quite do it, because _that_
+  // calls rb_gc_rest() to finish off any in-progress collection! If we called that, we'd free
+  // objects, and miss removing them from our sample map. So, instead, we twiddle the dont_gc
+  // flag on the objspace directly with this compat wrapper.
+  VALUE gc_was_already_disabled = mpp_rb_gc_disable_no_rest();
+
+  if (collector_record_sample(cd, newobj)) {
+    mpp_heap_bitmap_set(cd->sampled_objects, newobj);
+    cd->heap_samples_count++;
+    if (mpp_sample_log_wants_drain(cd->sample_log)) {
+      collector_request_drain(cd);
     }
-    mark_table_refcount_inc(cd->mark_table, frame->filename);
+  } else {
+    cd->dropped_samples_log_full++;
+    cd->sample_log_overflow++;
+    collector_request_drain(cd);
   }
-out:
+
   if (!RTEST(gc_was_already_disabled)) {
     rb_gc_enable();
   }
 }
 
-static void collector_tphook_freeobj(VALUE tpval, void *data) {
-  // See discussion about disabling GC in newobj tracepoint, it all applies here too.
-  VALUE gc_was_already_disabled = mpp_rb_gc_disable_no_rest();
+// Records a sample of newobj in the sample log, and returns true; or returns false if there was no room in the log.
+static bool collector_record_sample(struct collector_cdata *cd, VALUE newobj) {
+  if (cd->sample_log->entries_count == cd->sample_log->entries_capa) {
+    return false;
+  }
+  // Most samples come from a handful of hot allocation sites, so first see if this backtrace's fingerprint matches
+  // one we've already interned; if so, the sample can just refer to that stack without capturing any frames. The
+  // fingerprint covers the whole stack though, and capturing just the allocation site only has to look at the
+  // innermost few frames, so that's cheaper done directly.
+  if (cd->capture_opts.backend == MPP_CAPTURE_BACKEND_ALLOCATION_SITE) {
+    collector_capture_sample(cd, newobj, MPP_SAMPLE_LOG_UNFINGERPRINTED, NULL);
+    return true;
+  }
+  struct mpp_stack_fingerprint_check fingerprint_check;
+  uint64_t fingerprint = mpp_sample_fingerprint(&cd->capture_opts, &fingerprint_check);
+  uint32_t stack_id;
+  if (mpp_stack_table_lookup_fingerprint(cd->stacks, fingerprint, &fingerprint_check, &stack_id)) {
+    // There's an entry free, so this can't fail.
+    mpp_sample_log_push_interned_insert(cd->sample_log, newobj, stack_id, cd->current_flush_epoch);
+    cd->samples_found_by_fingerprint++;
+    return true;
+  }
+  collector_capture_sample(cd, newobj, fingerprint, &fingerprint_check);
+  return true;
+}
+
+// Captures the backtrace for a sample whose fingerprint didn't match any known stack (or which wasn't fingerprinted;
+// see MPP_SAMPLE_LOG_UNFINGERPRINTED) into the sample log, which must have an entry free.
+static void collector_capture_sample(struct collector_cdata *cd, VALUE newobj, uint64_t fingerprint,
+                                     const struct mpp_stack_fingerprint_check *fingerprint_check) {
+  // The backtrace just gets copied into the sample log for now; interning it and inserting the sample into the
+  // sample map happen when the log is drained, outside of the hook. The log marks the backtrace's VALUEs in the
+  // meantime.
+  size_t frames_capa = mpp_sample_frames_capa(&cd->capture_opts);
+  minimal_location_t *frames = NULL;
+  if (frames_capa <= MPP_SAMPLE_LOG_FRAMES) {
+    frames = mpp_sample_log_reserve_frames(cd->sample_log, frames_capa);
+  }
+  if (!frames) {
+    // This backtrace is too deep to fit in the log at all, or the log's frames buffer is used up, so it's interned
+    // straight away (which is safe here, since the GC is disabled), and the log just records which stack it was. It
+    // still has to go through the log, in case there's a free of an earlier object at the same address in there that
+    // needs applying first.
+    uint32_t stack_id = mpp_sample_capture_stack(cd->stacks, &cd->capture_opts);
+    mpp_sample_log_push_interned_insert(cd->sample_log, newobj, stack_id, cd->current_flush_epoch);
+    return;
+  }
+  size_t frames_count = mpp_sample_capture_frames(&cd->capture_opts, frames, frames_capa);
+  mpp_sample_log_push_insert(cd->sample_log, newobj, rb_thread_current(), frames_count, fingerprint,
+                             fingerprint_check, cd->stacks->fingerprints_generation, cd->current_flush_epoch);
+}
 
+static void collector_tphook_freeobj(VALUE tpval, void *data) {
   struct collector_cdata *cd = (struct collector_cdata *)data;
 
   // Definitely do _NOT_ try and run any Ruby code in here. Any allocation will crash
   // the process.
+  // Unlike the newobj hook, there's no need to disable the GC here; recording a free in the sample log (or, if it's
+  // full, applying it straight away) never allocates any memory, so nothing in here can trigger a GC.
   rb_trace_arg_t *tparg = rb_tracearg_from_tracepoint(tpval);
   VALUE freed_obj = rb_tracearg_object(tparg);
   collector_mark_sample_value_as_freed(cd, freed_obj);
+}
 
-  if (!RTEST(gc_was_already_disabled)) {
-    rb_gc_enable();
+static void collector_tphook_gc_exit(VALUE tpval, void *data) {
+  // Every free that happened during this GC step has just been recorded, so it's a good time to apply the sample log
+  // in a batch; not from in here, which is still inside the GC, but as soon as Ruby gets to a safe point.
+  struct collector_cdata *cd = (struct collector_cdata *)data;
+  if (cd->sample_log->entries_count > 0) {
+    collector_request_drain(cd);
   }
 }
 
@@ -528,10 +907,13 @@ static VALUE collector_start(VALUE self) {
   // Don't needlessly double-initialize everything
   if (cd->heap_samples_count > 0) {
     collector_gc_free_heap_samples(cd);
-    cd->heap_samples = st_init_numtable();
+    cd->heap_samples = mpp_value_table_new(cd->max_heap_samples);
     cd->heap_samples_count = 0;
   }
   cd->dropped_samples_heap_bufsize = 0;
+  cd->dropped_samples_log_full = 0;
+  cd->samples_found_by_fingerprint = 0;
+  cd->capture_opts.capture_cache->frames_captured = 0;
 
   if (cd->newobj_trace == Qnil) {
     cd->newobj_trace = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_NEWOBJ, collector_tphook_newobj, cd);
@@ -539,9 +921,13 @@ static VALUE collector_start(VALUE self) {
   if (cd->freeobj_trace == Qnil) {
     cd->freeobj_trace = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_FREEOBJ, collector_tphook_freeobj, cd);
   }
+  if (cd->gc_exit_trace == Qnil) {
+    cd->gc_exit_trace = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_EXIT, collector_tphook_gc_exit, cd);
+  }
 
   rb_tracepoint_enable(cd->newobj_trace);
   rb_tracepoint_enable(cd->freeobj_trace);
+  rb_tracepoint_enable(cd->gc_exit_trace);
 
   cd->is_tracing = true;
   return Qnil;
@@ -553,7 +939,13 @@ static VALUE collector_stop(VALUE self) {
     return Qnil;
   rb_tracepoint_disable(cd->newobj_trace);
   rb_tracepoint_disable(cd->freeobj_trace);
+  rb_tracepoint_disable(cd->gc_exit_trace);
   cd->is_tracing = false;
+  collector_drain_sample_log(cd);
+  // Nothing's going to be looked up by fingerprint (or captured) until we're started again, so there's no reason to
+  // keep the code the cached fingerprints and control frames were made from alive in the meantime.
+  mpp_stack_table_forget_fingerprints(cd->stacks);
+  mpp_capture_cache_forget_threads(cd->capture_opts.capture_cache);
   // Don't clear any of our buffers - it's OK to access the profiling info after calling stop!
   return Qnil;
 }
@@ -569,14 +961,16 @@ static VALUE collector_flush(int argc, VALUE *argv, VALUE self) {
   // kwarg handling
   VALUE kwargs_hash = Qnil;
   rb_scan_args_kw(RB_SCAN_ARGS_LAST_HASH_KEYWORDS, argc, argv, "00:", &kwargs_hash);
-  VALUE kwarg_values[2];
-  ID kwarg_ids[2];
+  VALUE kwarg_values[3];
+  ID kwarg_ids[3];
   kwarg_ids[0] = rb_intern("yield_gvl");
   kwarg_ids[1] = rb_intern("proactively_yield_gvl");
-  rb_get_kwargs(kwargs_hash, kwarg_ids, 0, 2, kwarg_values);
+  kwarg_ids[2] = rb_intern("counts_only");
+  rb_get_kwargs(kwargs_hash, kwarg_ids, 0, 3, kwarg_values);
 
   bool yield_gvl = false;
   bool proactively_yield_gvl = false;
+  bool counts_only = false;
 
   if (kwarg_values[0] != Qundef) {
     yield_gvl = RTEST(kwarg_values[0]);
@@ -584,17 +978,33 @@ static VALUE collector_flush(int argc, VALUE *argv, VALUE self) {
   if (kwarg_values[1] != Qundef) {
     proactively_yield_gvl = RTEST(kwarg_values[1]);
   }
+  if (kwarg_values[2] != Qundef) {
+    counts_only = RTEST(kwarg_values[2]);
+  }
 
   struct flush_protected_ctx ctx;
   ctx.cd = cd;
   ctx.proactively_yield_gvl = proactively_yield_gvl;
   ctx.yield_gvl = yield_gvl;
+  ctx.counts_only = counts_only;
   ctx.serctx = NULL;
+  ctx.sample_keys = NULL;
   int jump_tag = 0;
   VALUE retval = rb_protect(flush_protected, (VALUE)&ctx, &jump_tag);
 
-  if (ctx.serctx)
-    mpp_pprof_serctx_destroy(ctx.serctx);
+  cd->flush_serctx = NULL;
+  if (ctx.serctx) {
+    mpp_pprof_serctx_finish(ctx.serctx);
+    // Keep it for the next flush, unless another flush has put its own back first (or the names it's interned are
+    // the wrong kind now).
+    if (!cd->serctx && ctx.serctx->pretty_backtraces == cd->pretty_backtraces) {
+      cd->serctx = ctx.serctx;
+    } else {
+      mpp_pprof_serctx_destroy(ctx.serctx);
+    }
+  }
+  if (ctx.sample_keys)
+    mpp_free(ctx.sample_keys);
   cd->flush_thread = Qnil;
 
   // Now return-or-raise back to ruby.
@@ -604,10 +1014,9 @@ static VALUE collector_flush(int argc, VALUE *argv, VALUE self) {
   return retval;
 }
 
-int flush_each_sample(st_data_t key, st_data_t value, st_data_t ctxarg) {
-  struct flush_each_sample_ctx *ctx = (struct flush_each_sample_ctx *)ctxarg;
+static int flush_each_sample(VALUE key, struct flush_each_sample_ctx *ctx) {
   struct collector_cdata *cd = ctx->cd;
-  struct mpp_sample *sample = (struct mpp_sample *)value;
+  st_data_t value;
   int ret;
 
   if (ctx->proactively_yield_gvl && (ctx->i % 25 == 0)) {
@@ -618,10 +1027,19 @@ int flush_each_sample(st_data_t key, st_data_t value, st_data_t ctxarg) {
       rb_thread_schedule();
       struct timespec t2 = mpp_gettime_monotonic();
       ctx->nogvl_duration += mpp_time_delta_nsec(t1, t2);
+      // Pick up whatever other threads allocated & freed in the meantime.
+      collector_drain_sample_log(cd);
     }
   }
   ctx->i++;
 
+  // Whilst we didn't hold the GVL, the freeobj hook might have run and released this very sample, so look it up
+  // fresh rather than trusting anything from before the yield.
+  if (!mpp_value_table_lookup(cd->heap_samples, key, &value)) {
+    return ST_CONTINUE;
+  }
+  struct mpp_sample *sample = (struct mpp_sample *)value;
+
   if (sample->flush_epoch > ctx->flush_epoch) {
     // This is a new sample captured since we started calling #flush; skip it.
     return ST_CONTINUE;
@@ -632,12 +1050,15 @@ int flush_each_sample(st_data_t key, st_data_t value, st_data_t ctxarg) {
   VALUE gc_was_already_disabled = mpp_rb_gc_disable_no_rest();
 
   if (!mpp_is_value_still_validish(sample->allocated_value_weak)) {
-    mpp_sample_free(sample);
+    mpp_heap_bitmap_clear(cd->sampled_objects, key);
+    mpp_value_table_delete(cd->heap_samples, key, NULL);
+    collector_release_sample(cd, sample);
     cd->heap_samples_count--;
-    ret = ST_DELETE;
+    ret = ST_CONTINUE;
   } else {
-    sample->allocated_value_objsize = mpp_rb_obj_memsize_of(sample->allocated_value_weak);
-    ctx->r = mpp_pprof_serctx_add_sample(ctx->serctx, sample, ctx->errbuf, ctx->sizeof_errbuf);
+    collector_measure_sample(cd, sample);
+    ctx->r = mpp_pprof_serctx_add_sample(ctx->serctx, cd->stacks, sample->stack_id, 1,
+                                         sample->allocated_value_objsize, ctx->errbuf, ctx->sizeof_errbuf);
     if (ctx->r == -1) {
       ret = ST_STOP;
     } else {
@@ -653,6 +1074,21 @@ int flush_each_sample(st_data_t key, st_data_t value, st_data_t ctxarg) {
   return ret;
 }
 
+// A counts-only flush emits each stack's running totals as they stand, rather than visiting its samples.
+static int flush_each_stack_counts(struct mpp_stack *stack, st_data_t ctxarg) {
+  struct flush_each_sample_ctx *ctx = (struct flush_each_sample_ctx *)ctxarg;
+  if (stack->live_objects == 0) {
+    return ST_CONTINUE;
+  }
+  ctx->r = mpp_pprof_serctx_add_sample(ctx->serctx, ctx->cd->stacks, stack->id, stack->live_objects,
+                                       stack->live_bytes, ctx->errbuf, ctx->sizeof_errbuf);
+  if (ctx->r == -1) {
+    return ST_STOP;
+  }
+  ctx->actual_sample_count += stack->live_objects;
+  return ST_CONTINUE;
+}
+
 static VALUE flush_protected(VALUE ctxarg) {
   struct timespec t_start = mpp_gettime_monotonic();
 
@@ -664,14 +1100,27 @@ static VALUE flush_protected(VALUE ctxarg) {
 
   size_t dropped_samples_bufsize = cd->dropped_samples_heap_bufsize;
   cd->dropped_samples_heap_bufsize = 0;
-
-  // Begin setting up pprof serialisation.
+  size_t dropped_samples_log_full = cd->dropped_samples_log_full;
+  cd->dropped_samples_log_full = 0;
+  size_t samples_found_by_fingerprint = cd->samples_found_by_fingerprint;
+  cd->samples_found_by_fingerprint = 0;
+  size_t frames_captured = cd->capture_opts.capture_cache->frames_captured;
+  cd->capture_opts.capture_cache->frames_captured = 0;
+
+  // Begin setting up pprof serialisation, with the context the last flush left behind if there is one.
   char errbuf[256];
-  ctx->serctx = mpp_pprof_serctx_new(errbuf, sizeof(errbuf));
-  if (!ctx->serctx) {
-    rb_raise(rb_eRuntimeError, "ruby_memprofiler_pprof: setting up serialisation: %s", errbuf);
+  if (cd->serctx) {
+    ctx->serctx = cd->serctx;
+    cd->serctx = NULL;
+  } else {
+    ctx->serctx = mpp_pprof_serctx_new(cd->pretty_backtraces, errbuf, sizeof(errbuf));
+    if (!ctx->serctx) {
+      rb_raise(rb_eRuntimeError, "ruby_memprofiler_pprof: setting up serialisation: %s", errbuf);
+    }
   }
   struct mpp_pprof_serctx *serctx = ctx->serctx;
+  cd->flush_serctx = serctx;
+  mpp_pprof_serctx_begin(serctx);
   struct flush_each_sample_ctx sample_ctx;
   sample_ctx.r = 0;
   sample_ctx.i = 0;
@@ -685,7 +1134,39 @@ static VALUE flush_protected(VALUE ctxarg) {
   sample_ctx.gvl_yield_count = 0;
   sample_ctx.gvl_check_yield_count = 0;
   sample_ctx.flush_epoch = flush_epoch;
-  st_foreach(cd->heap_samples, flush_each_sample, (st_data_t)&sample_ctx);
+  // Bring the sample map up to date first.
+  collector_drain_sample_log(cd);
+  if (ctx->counts_only) {
+    // This only has to look at each distinct stack once, so it doesn't bother yielding the GVL. The GC is disabled
+    // so that the freeobj hook can't release samples (and so free stacks) whilst we're iterating over them.
+    VALUE gc_was_already_disabled = mpp_rb_gc_disable_no_rest();
+    mpp_stack_table_foreach(cd->stacks, flush_each_stack_counts, (st_data_t)&sample_ctx);
+    if (!RTEST(gc_was_already_disabled)) {
+      rb_gc_enable();
+    }
+  } else {
+    // Iterate over a snapshot of the keys rather than the table itself; yielding the GVL lets other threads insert
+    // into (and so grow and migrate) the table under us.
+    size_t sample_keys_count = mpp_value_table_count(cd->heap_samples);
+    ctx->sample_keys = mpp_xmalloc(sizeof(VALUE) * (sample_keys_count ? sample_keys_count : 1));
+    sample_keys_count = mpp_value_table_keys(cd->heap_samples, ctx->sample_keys, sample_keys_count);
+    for (size_t i = 0; i < sample_keys_count; i++) {
+      if (flush_each_sample(ctx->sample_keys[i], &sample_ctx) == ST_STOP) {
+        break;
+      }
+    }
+  }
+  // Flushing is already a walk over everything we hold, so it's a good time to drop VALUEs that only frames which
+  // have since been freed were keeping in the mark table. Threads which have exited would otherwise keep their last
+  // stack and control frames alive forever (as would the elider's cached answers for code that's since been
+  // unloaded), so let go of those first. The fingerprint cache is kept: it's a fixed number of slots, so whatever it
+  // keeps alive is bounded, and hot stacks stay found by fingerprint from one flush to the next.
+  mpp_stack_table_forget_threads(cd->stacks);
+  mpp_capture_cache_forget_threads(cd->capture_opts.capture_cache);
+  if (cd->capture_opts.elider) {
+    mpp_frame_elider_forget(cd->capture_opts.elider);
+  }
+  mpp_stack_table_rebuild_mark_table(cd->stacks);
   if (sample_ctx.r == -1) {
     rb_raise(rb_eRuntimeError, "ruby_memprofiler_pprof: failed preparing samples for serialisation: %s",
              sample_ctx.errbuf);
@@ -717,6 +1198,9 @@ static VALUE flush_protected(VALUE ctxarg) {
   rb_funcall(profile_data, rb_intern("pprof_data="), 1, pprof_data);
   rb_funcall(profile_data, rb_intern("heap_samples_count="), 1, SIZET2NUM(sample_ctx.actual_sample_count));
   rb_funcall(profile_data, rb_intern("dropped_samples_heap_bufsize="), 1, SIZET2NUM(dropped_samples_bufsize));
+  rb_funcall(profile_data, rb_intern("dropped_samples_log_full="), 1, SIZET2NUM(dropped_samples_log_full));
+  rb_funcall(profile_data, rb_intern("samples_found_by_fingerprint="), 1, SIZET2NUM(samples_found_by_fingerprint));
+  rb_funcall(profile_data, rb_intern("frames_captured="), 1, SIZET2NUM(frames_captured));
   rb_funcall(profile_data, rb_intern("flush_duration_nsecs="), 1, INT2NUM(mpp_time_delta_nsec(t_start, t_end)));
   rb_funcall(profile_data, rb_intern("pprof_serialization_nsecs="), 1,
              INT2NUM(mpp_time_delta_nsec(t_serialize_start, t_end)));
@@ -760,13 +1244,22 @@ static VALUE collector_live_heap_samples_count(VALUE self) {
 
 static VALUE collector_get_sample_rate(VALUE self) {
   struct collector_cdata *cd = collector_cdata_get(self);
-  return DBL2NUM(((double)cd->u32_sample_rate) / UINT32_MAX);
+  return DBL2NUM(cd->sample_rate);
 }
 
 static VALUE collector_set_sample_rate(VALUE self, VALUE newval) {
   struct collector_cdata *cd = collector_cdata_get(self);
-  // Convert the double sample rate (between 0 and 1) to a value between 0 and UINT32_MAX
-  cd->u32_sample_rate = UINT32_MAX * NUM2DBL(newval);
+  double sample_rate = NUM2DBL(newval);
+  if (sample_rate < 0.0) {
+    sample_rate = 0.0;
+  } else if (sample_rate > 1.0) {
+    sample_rate = 1.0;
+  }
+  cd->sample_rate = sample_rate;
+  // log1p keeps precision for the very small sample rates we expect to see in production.
+  cd->log_sample_skip_probability = log1p(-sample_rate);
+  // Re-draw the skip count, so that the new rate takes effect immediately rather than after the next sample.
+  cd->allocations_until_next_sample = collector_draw_allocations_to_skip(cd);
   return newval;
 }
 
@@ -778,6 +1271,9 @@ static VALUE collector_get_max_heap_samples(VALUE self) {
 static VALUE collector_set_max_heap_samples(VALUE self, VALUE newval) {
   struct collector_cdata *cd = collector_cdata_get(self);
   cd->max_heap_samples = NUM2SIZET(newval);
+  if (cd->heap_samples) {
+    mpp_value_table_reserve(cd->heap_samples, cd->max_heap_samples);
+  }
   return newval;
 }
 
@@ -789,9 +1285,141 @@ static VALUE collector_get_pretty_backtraces(VALUE self) {
 static VALUE collector_set_pretty_backtraces(VALUE self, VALUE newval) {
   struct collector_cdata *cd = collector_cdata_get(self);
   cd->pretty_backtraces = RTEST(newval);
+  // The function names the serialisation context has interned are the other kind now.
+  if (cd->serctx && cd->serctx->pretty_backtraces != cd->pretty_backtraces) {
+    mpp_pprof_serctx_destroy(cd->serctx);
+    cd->serctx = NULL;
+  }
+  return newval;
+}
+
+static VALUE collector_get_capture_backend(VALUE self) {
+  struct collector_cdata *cd = collector_cdata_get(self);
+  switch (cd->capture_opts.backend) {
+  case MPP_CAPTURE_BACKEND_PROFILE_FRAMES:
+    return ID2SYM(rb_intern("profile_frames"));
+  case MPP_CAPTURE_BACKEND_ALLOCATION_SITE:
+    return ID2SYM(rb_intern("allocation_site"));
+  case MPP_CAPTURE_BACKEND_BACKTRACIE:
+  default:
+    return ID2SYM(rb_intern("backtracie"));
+  }
+}
+
+static VALUE collector_set_capture_backend(VALUE self, VALUE newval) {
+  struct collector_cdata *cd = collector_cdata_get(self);
+  ID backend = rb_sym2id(newval);
+  if (backend == rb_intern("backtracie")) {
+    cd->capture_opts.backend = MPP_CAPTURE_BACKEND_BACKTRACIE;
+  } else if (backend == rb_intern("profile_frames")) {
+    cd->capture_opts.backend = MPP_CAPTURE_BACKEND_PROFILE_FRAMES;
+  } else if (backend == rb_intern("allocation_site")) {
+    cd->capture_opts.backend = MPP_CAPTURE_BACKEND_ALLOCATION_SITE;
+  } else {
+    rb_raise(rb_eArgError, "ruby_memprofiler_pprof: unknown capture_backend %" PRIsVALUE, newval);
+  }
+  // The backends capture different frames for the same backtrace, so stacks found by fingerprint are no good now.
+  if (cd->stacks) {
+    mpp_stack_table_invalidate_fingerprints(cd->stacks);
+  }
+  return newval;
+}
+
+static VALUE collector_get_max_stack_depth(VALUE self) {
+  struct collector_cdata *cd = collector_cdata_get(self);
+  return cd->capture_opts.max_depth ? SIZET2NUM(cd->capture_opts.max_depth) : Qnil;
+}
+
+static VALUE collector_set_max_stack_depth(VALUE self, VALUE newval) {
+  struct collector_cdata *cd = collector_cdata_get(self);
+  size_t max_stack_depth = 0;
+  if (newval != Qnil) {
+    if (NUM2LONG(newval) < 1) {
+      rb_raise(rb_eArgError, "ruby_memprofiler_pprof: max_stack_depth must be at least 1 (or nil for no limit)");
+    }
+    max_stack_depth = NUM2SIZET(newval);
+  }
+  cd->capture_opts.max_depth = max_stack_depth;
+  // Stacks found by fingerprint were captured with the old limit.
+  if (cd->stacks) {
+    mpp_stack_table_invalidate_fingerprints(cd->stacks);
+  }
   return newval;
 }
 
+static VALUE collector_get_fold_recursion(VALUE self) {
+  struct collector_cdata *cd = collector_cdata_get(self);
+  return cd->capture_opts.fold_recursion ? Qtrue : Qfalse;
+}
+
+static VALUE collector_set_fold_recursion(VALUE self, VALUE newval) {
+  struct collector_cdata *cd = collector_cdata_get(self);
+  cd->capture_opts.fold_recursion = RTEST(newval);
+  // Stacks found by fingerprint were captured with the old setting.
+  if (cd->stacks) {
+    mpp_stack_table_invalidate_fingerprints(cd->stacks);
+  }
+  return newval;
+}
+
+static VALUE collector_get_elide_files(VALUE self) {
+  struct collector_cdata *cd = collector_cdata_get(self);
+  return cd->elide_files;
+}
+
+static VALUE collector_set_elide_files(VALUE self, VALUE newval) {
+  struct collector_cdata *cd = collector_cdata_get(self);
+  cd->elide_files = collector_elide_prefixes_from(newval, "elide_files");
+  collector_compile_elider(cd);
+  return newval;
+}
+
+static VALUE collector_get_elide_methods(VALUE self) {
+  struct collector_cdata *cd = collector_cdata_get(self);
+  return cd->elide_methods;
+}
+
+static VALUE collector_set_elide_methods(VALUE self, VALUE newval) {
+  struct collector_cdata *cd = collector_cdata_get(self);
+  cd->elide_methods = collector_elide_prefixes_from(newval, "elide_methods");
+  collector_compile_elider(cd);
+  return newval;
+}
+
+// Checks that list is an Array of Strings (nil counts as an empty one), and returns a frozen copy of it.
+static VALUE collector_elide_prefixes_from(VALUE list, const char *name) {
+  VALUE prefixes = rb_ary_new();
+  if (list != Qnil) {
+    if (!RB_TYPE_P(list, T_ARRAY)) {
+      rb_raise(rb_eTypeError, "ruby_memprofiler_pprof: %s must be an Array of Strings", name);
+    }
+    for (long i = 0; i < RARRAY_LEN(list); i++) {
+      VALUE prefix = RARRAY_AREF(list, i);
+      if (!RB_TYPE_P(prefix, T_STRING)) {
+        rb_raise(rb_eTypeError, "ruby_memprofiler_pprof: %s must be an Array of Strings", name);
+      }
+      rb_ary_push(prefixes, rb_str_new_frozen(prefix));
+    }
+  }
+  return rb_obj_freeze(prefixes);
+}
+
+// Replaces the elider with one for the current elide_files & elide_methods (or none, if they're both empty).
+static void collector_compile_elider(struct collector_cdata *cd) {
+  struct mpp_frame_elider *old_elider = cd->capture_opts.elider;
+  cd->capture_opts.elider = NULL;
+  if (RARRAY_LEN(cd->elide_files) > 0 || RARRAY_LEN(cd->elide_methods) > 0) {
+    cd->capture_opts.elider = mpp_frame_elider_new(cd->elide_files, cd->elide_methods);
+  }
+  if (old_elider) {
+    mpp_frame_elider_destroy(old_elider);
+  }
+  // Stacks found by fingerprint were captured with the old rules.
+  if (cd->stacks) {
+    mpp_stack_table_invalidate_fingerprints(cd->stacks);
+  }
+}
+
 static VALUE collector_get_last_mark_nsecs(VALUE self) {
   struct collector_cdata *cd = collector_cdata_get(self);
   return INT2NUM(cd->last_gc_mark_ns);
@@ -799,5 +1427,10 @@ static VALUE collector_get_last_mark_nsecs(VALUE self) {
 
 static VALUE collector_get_mark_table_size(VALUE self) {
   struct collector_cdata *cd = collector_cdata_get(self);
-  return UINT2NUM(cd->mark_table->num_entries);
+  return SIZET2NUM(mpp_stack_table_mark_table_size(cd->stacks));
+}
+
+static VALUE collector_mark_table_complete_p(VALUE self) {
+  struct collector_cdata *cd = collector_cdata_get(self);
+  return mpp_stack_table_mark_table_is_complete(cd->stacks) ? Qtrue : Qfalse;
 }
@@ -8,45 +8,91 @@
 
 #include "ruby_memprofiler_pprof.h"
 
-#if defined(HAVE_ARC4RANDOM)
-uint32_t mpp_rand() { return arc4random(); }
-void mpp_rand_init() {}
-#elif defined(HAVE_MRAND48_R) && defined(HAVE_GETENTROPY)
-// Why? Why does glibc make it so darn difficult to just get random numbers in a way
-// that isn't racy across different threads and doesn't depend on global state?
+#if defined(HAVE_GETENTROPY)
 #include <sys/random.h>
+#endif
 
-static pthread_mutex_t mpp_rand_lock;
-static struct drand48_data mpp_rand_buffer;
+// We use our own xoshiro256** generator (https://prng.di.unimi.it/), with one instance of its state per thread.
+// That means drawing a random number takes no locks and does no atomic read-modify-write operations; the
+// platform generators we used to use either took a global mutex (mrand48_r on glibc) or do similar things
+// internally (arc4random). The per-thread state is seeded lazily, the first time a thread asks for a number.
+struct mpp_rand_state {
+  uint64_t s[4];
+  // The value of mpp_rand_generation when this state was seeded.
+  uint64_t generation;
+};
+static __thread struct mpp_rand_state mpp_rand_thread_state;
+// Bumped whenever every thread's RNG state needs re-seeding; that is, in the child after a fork (so that parent
+// and child don't produce the same sequence). Starts at 1 so that the zero-initialized per-thread state is
+// seen as stale.
+static uint64_t mpp_rand_generation = 1;
+// If RUBY_MEMPROFILER_PPROF_RNG_SEED is set, each thread is seeded deterministically from this seed and the order
+// in which threads first asked for a random number, which makes sampling reproducible in benchmarks.
+static bool mpp_rand_has_fixed_seed = false;
+static uint64_t mpp_rand_fixed_seed;
+static uint64_t mpp_rand_fixed_seed_counter;
+
+static inline uint64_t mpp_rand_rotl(const uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+// splitmix64, as recommended by the xoshiro authors for expanding a 64-bit seed into the full state.
+static uint64_t mpp_rand_splitmix64(uint64_t *x) {
+  uint64_t z = (*x += 0x9e3779b97f4a7c15);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+static void mpp_rand_seed_thread_state(struct mpp_rand_state *st, uint64_t generation) {
+  uint64_t seed;
+  if (mpp_rand_has_fixed_seed) {
+    // Mixing in the generation means a forked child still diverges from its parent, reproducibly.
+    seed = mpp_rand_fixed_seed + __atomic_fetch_add(&mpp_rand_fixed_seed_counter, 1, __ATOMIC_RELAXED);
+    seed ^= generation * 0xd1342543de82ef95;
+  } else {
+#if defined(HAVE_GETENTROPY)
+    if (getentropy(&seed, sizeof(seed)) == -1) {
+      MPP_ASSERT_FAIL("getentropy failed seeding RNG");
+    }
+#else
+    arc4random_buf(&seed, sizeof(seed));
+#endif
+  }
+  for (int i = 0; i < 4; i++) {
+    st->s[i] = mpp_rand_splitmix64(&seed);
+  }
+  st->generation = generation;
+}
 
 uint32_t mpp_rand() {
-  pthread_mutex_lock(&mpp_rand_lock);
-  long int result;
-  int ret = mrand48_r(&mpp_rand_buffer, &result);
-  if (ret < 0) {
-    rb_bug("mrand48_r returned -1?");
-  }
-  pthread_mutex_unlock(&mpp_rand_lock);
-  return (uint32_t)result;
-}
-
-void mpp_rand_init() {
-  pthread_mutex_init(&mpp_rand_lock, NULL);
-  memset(&mpp_rand_buffer, 0, sizeof(struct drand48_data));
-  unsigned short int seedbuf[3];
-  int ret;
-  ret = getentropy(seedbuf, sizeof(seedbuf));
-  if (ret == -1) {
-    rb_bug("getentropy returned -1?");
+  struct mpp_rand_state *st = &mpp_rand_thread_state;
+  uint64_t generation = __atomic_load_n(&mpp_rand_generation, __ATOMIC_RELAXED);
+  if (st->generation != generation) {
+    mpp_rand_seed_thread_state(st, generation);
   }
-  ret = seed48_r(seedbuf, &mpp_rand_buffer);
-  if (ret < 0) {
-    rb_bug("seed48_r returned -1?");
+
+  uint64_t *s = st->s;
+  const uint64_t result = mpp_rand_rotl(s[1] * 5, 7) * 9;
+  const uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = mpp_rand_rotl(s[3], 45);
+  // The high bits of xoshiro256** output are the best quality ones.
+  return (uint32_t)(result >> 32);
+}
+
+static void mpp_rand_atfork_child(void) { __atomic_add_fetch(&mpp_rand_generation, 1, __ATOMIC_RELAXED); }
+
+void mpp_rand_init(void) {
+  const char *fixed_seed = getenv("RUBY_MEMPROFILER_PPROF_RNG_SEED");
+  if (fixed_seed && *fixed_seed) {
+    mpp_rand_has_fixed_seed = true;
+    mpp_rand_fixed_seed = strtoull(fixed_seed, NULL, 10);
   }
+  mpp_pthread_atfork(NULL, NULL, mpp_rand_atfork_child);
 }
-#else
-#error "No suitable RNG implementation"
-#endif
 
 struct timespec mpp_gettime_monotonic() {
   struct timespec tv;
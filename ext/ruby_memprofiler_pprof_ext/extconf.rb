@@ -7,12 +7,11 @@ have_func("rb_gc_mark_movable", ["ruby.h"])
 # Handle Ractors
 have_func("rb_ext_ractor_safe", ["ruby.h"])
 
-# Find a random number generator API that doesn't have global state.
-has_arc4random = have_func("arc4random", ["stdlib.h"])
-has_mrand48_r = have_func("mrand48_r", ["stdlib.h"])
+# We bring our own random number generator, but need a source of entropy to seed it.
 has_getentropy = have_func("getentropy", ["sys/random.h"])
-if !has_arc4random && !(has_mrand48_r && has_getentropy)
-  abort "Need either arc4random (BSD) or mrand48_r/getentropy (GNU)"
+has_arc4random_buf = have_func("arc4random_buf", ["stdlib.h"])
+if !has_getentropy && !has_arc4random_buf
+  abort "Need either getentropy or arc4random_buf to seed the RNG"
 end
 
 # Need zlib
@@ -110,6 +109,12 @@ if have_macro("GET_RACTOR", [RUBY_MJIT_HEADER], &STRIP_RUBY_INCLUDE)
   $defs << "-DHAVE_GET_RACTOR"
 end
 
+# MemprofilerPprof::TestHooks (test_hooks.c) exposes internal data structures to the test suite; it's only built when
+# asked for with --enable-test-hooks, which `rake test` does, so installed copies of the gem never have it.
+if enable_config("test-hooks", false)
+  $defs << "-DMPP_TEST_HOOKS"
+end
+
 # Set our cflags up _only after_ we have run all the existence checks above; otherwise
 # stuff like -Werror can break the test programs.
 append_cflags([
@@ -0,0 +1,175 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include <ruby.h>
+
+#include "ruby_memprofiler_pprof.h"
+
+// The frame elider drops frames from captured backtraces according to two lists of prefixes: one matched against
+// the frame's filename, and one against its method label (the iseq's base label, or the method entry's name for C
+// functions). Rules like these are only ever checked against a few thousand distinct filenames and labels, but
+// they'd be checked against every frame of every sampled backtrace; so the answer for each filename & label is
+// worked out once, and cached against the identity of the String (or ID) holding it.
+//
+// Holding on to a String's address means holding on to the String too, or else another one could turn up there
+// later and get the wrong answer; the cached Strings are marked (and pinned, so their addresses don't change under
+// GC.compact) until the caches are next cleared, which happens every flush. IDs are never reused, so the method ID
+// cache doesn't need that.
+
+struct frame_elider_prefixes {
+  char **prefixes;
+  size_t *lens;
+  size_t count;
+};
+
+struct mpp_frame_elider {
+  struct frame_elider_prefixes file_prefixes;
+  struct frame_elider_prefixes method_prefixes;
+  // Filename String -> whether it matches file_prefixes.
+  struct mpp_value_table *file_matches;
+  // Base label String -> whether it matches method_prefixes.
+  struct mpp_value_table *label_matches;
+  // Method ID -> whether its name matches method_prefixes.
+  struct mpp_value_table *method_id_matches;
+};
+
+// Copies the Strings in the (already validated) array ary.
+static void frame_elider_prefixes_init(struct frame_elider_prefixes *p, VALUE ary) {
+  p->count = RARRAY_LEN(ary);
+  p->prefixes = mpp_xmalloc(sizeof(char *) * (p->count ? p->count : 1));
+  p->lens = mpp_xmalloc(sizeof(size_t) * (p->count ? p->count : 1));
+  for (size_t i = 0; i < p->count; i++) {
+    VALUE str = RARRAY_AREF(ary, i);
+    p->lens[i] = RSTRING_LEN(str);
+    p->prefixes[i] = mpp_xmalloc(p->lens[i] ? p->lens[i] : 1);
+    memcpy(p->prefixes[i], RSTRING_PTR(str), p->lens[i]);
+  }
+}
+
+static void frame_elider_prefixes_destroy(struct frame_elider_prefixes *p) {
+  for (size_t i = 0; i < p->count; i++) {
+    mpp_free(p->prefixes[i]);
+  }
+  mpp_free(p->prefixes);
+  mpp_free(p->lens);
+}
+
+static size_t frame_elider_prefixes_memsize(struct frame_elider_prefixes *p) {
+  size_t sz = (sizeof(char *) + sizeof(size_t)) * p->count;
+  for (size_t i = 0; i < p->count; i++) {
+    sz += p->lens[i];
+  }
+  return sz;
+}
+
+static bool frame_elider_prefixes_match(struct frame_elider_prefixes *p, VALUE str) {
+  if (!RB_TYPE_P(str, T_STRING)) {
+    return false;
+  }
+  const char *ptr = RSTRING_PTR(str);
+  size_t len = RSTRING_LEN(str);
+  for (size_t i = 0; i < p->count; i++) {
+    if (p->lens[i] <= len && memcmp(ptr, p->prefixes[i], p->lens[i]) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+struct mpp_frame_elider *mpp_frame_elider_new(VALUE file_prefixes, VALUE method_prefixes) {
+  struct mpp_frame_elider *elider = mpp_xmalloc(sizeof(struct mpp_frame_elider));
+  frame_elider_prefixes_init(&elider->file_prefixes, file_prefixes);
+  frame_elider_prefixes_init(&elider->method_prefixes, method_prefixes);
+  elider->file_matches = mpp_value_table_new(0);
+  elider->label_matches = mpp_value_table_new(0);
+  elider->method_id_matches = mpp_value_table_new(0);
+  return elider;
+}
+
+void mpp_frame_elider_destroy(struct mpp_frame_elider *elider) {
+  frame_elider_prefixes_destroy(&elider->file_prefixes);
+  frame_elider_prefixes_destroy(&elider->method_prefixes);
+  mpp_value_table_destroy(elider->file_matches);
+  mpp_value_table_destroy(elider->label_matches);
+  mpp_value_table_destroy(elider->method_id_matches);
+  mpp_free(elider);
+}
+
+size_t mpp_frame_elider_memsize(struct mpp_frame_elider *elider) {
+  size_t sz = sizeof(struct mpp_frame_elider);
+  sz += frame_elider_prefixes_memsize(&elider->file_prefixes);
+  sz += frame_elider_prefixes_memsize(&elider->method_prefixes);
+  sz += mpp_value_table_memsize(elider->file_matches);
+  sz += mpp_value_table_memsize(elider->label_matches);
+  sz += mpp_value_table_memsize(elider->method_id_matches);
+  return sz;
+}
+
+static int frame_elider_mark_each_key(st_data_t key, st_data_t value, st_data_t ctxarg) {
+  rb_gc_mark((VALUE)key);
+  return ST_CONTINUE;
+}
+
+void mpp_frame_elider_mark(struct mpp_frame_elider *elider) {
+  mpp_value_table_foreach(elider->file_matches, frame_elider_mark_each_key, 0);
+  mpp_value_table_foreach(elider->label_matches, frame_elider_mark_each_key, 0);
+}
+
+void mpp_frame_elider_forget(struct mpp_frame_elider *elider) {
+  mpp_value_table_clear(elider->file_matches);
+  mpp_value_table_clear(elider->label_matches);
+}
+
+// Looks up whether str matches prefixes in cache, working it out (and caching it) if it's not there yet. Only
+// Strings get cached; anything else (e.g. a Qnil filename) never matches.
+static bool frame_elider_cached_match(struct mpp_value_table *cache, struct frame_elider_prefixes *prefixes,
+                                      VALUE str) {
+  if (prefixes->count == 0 || !RB_TYPE_P(str, T_STRING)) {
+    return false;
+  }
+  st_data_t matches;
+  if (!mpp_value_table_lookup(cache, str, &matches)) {
+    matches = frame_elider_prefixes_match(prefixes, str);
+    mpp_value_table_insert(cache, str, matches);
+  }
+  return matches;
+}
+
+static bool frame_elider_method_id_match(struct mpp_frame_elider *elider, ID method_id) {
+  if (elider->method_prefixes.count == 0 || method_id == 0) {
+    return false;
+  }
+  st_data_t matches;
+  if (!mpp_value_table_lookup(elider->method_id_matches, (VALUE)method_id, &matches)) {
+    matches = frame_elider_prefixes_match(&elider->method_prefixes, rb_id2str(method_id));
+    mpp_value_table_insert(elider->method_id_matches, (VALUE)method_id, matches);
+  }
+  return matches;
+}
+
+static bool frame_elider_wants_elided(struct mpp_frame_elider *elider, minimal_location_t *loc) {
+  if (mpp_location_is_synthetic(loc)) {
+    return false;
+  }
+  if (frame_elider_cached_match(elider->file_matches, &elider->file_prefixes, loc->filename)) {
+    return true;
+  }
+  if (loc->method_name_contents == BACKTRACIE_METHOD_NAME_CONTENTS_BASE_LABEL) {
+    return frame_elider_cached_match(elider->label_matches, &elider->method_prefixes, loc->method_name.base_label);
+  }
+  return frame_elider_method_id_match(elider, loc->method_name.cme_method_id);
+}
+
+size_t mpp_frame_elider_filter(struct mpp_frame_elider *elider, minimal_location_t *frames, size_t frames_count) {
+  size_t out = 0;
+  for (size_t i = 0; i < frames_count; i++) {
+    if (frame_elider_wants_elided(elider, &frames[i])) {
+      continue;
+    }
+    if (out != i) {
+      frames[out] = frames[i];
+    }
+    out++;
+  }
+  return out;
+}
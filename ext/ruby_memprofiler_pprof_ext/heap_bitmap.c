@@ -0,0 +1,152 @@
+#include "ruby_private.h"
+
+#include "ruby_memprofiler_pprof.h"
+
+// Ruby heap pages are aligned to HEAP_PAGE_ALIGN, so the page an object lives on can be identified by its address
+// shifted right by HEAP_PAGE_ALIGN_LOG, and its slot within that page by the remaining low bits (this is what
+// NUM_IN_PAGE in gc.c does). Page numbers index into a three-level radix tree, much like a CPU page table; each leaf
+// holds a bitmap, one bit per RVALUE-sized slot, for a run of consecutive pages. Levels are only allocated when a bit
+// inside them is first set.
+//
+// Testing a bit for an object is three dependent loads and a bit test, with no hashing; crucially, for the
+// overwhelmingly common case of an object on a page we've never sampled anything on, it's one or two loads of a NULL.
+
+// Addresses above this can't be represented in the tree (no common platform hands out user-space addresses this high).
+#define HEAP_BITMAP_ADDRESS_BITS 48
+#define HEAP_BITMAP_PAGE_NUMBER_BITS (HEAP_BITMAP_ADDRESS_BITS - HEAP_PAGE_ALIGN_LOG)
+#define HEAP_BITMAP_LEAF_BITS 11
+#define HEAP_BITMAP_MID_BITS 11
+#define HEAP_BITMAP_ROOT_BITS (HEAP_BITMAP_PAGE_NUMBER_BITS - HEAP_BITMAP_LEAF_BITS - HEAP_BITMAP_MID_BITS)
+#define HEAP_BITMAP_SLOT_INDEX(obj) (((uintptr_t)(obj)&HEAP_PAGE_ALIGN_MASK) / sizeof(RVALUE))
+
+struct heap_bitmap_leaf {
+  bits_t pages[1 << HEAP_BITMAP_LEAF_BITS][HEAP_PAGE_BITMAP_LIMIT];
+};
+
+struct heap_bitmap_mid {
+  struct heap_bitmap_leaf *leaves[1 << HEAP_BITMAP_MID_BITS];
+};
+
+struct mpp_heap_bitmap {
+  struct heap_bitmap_mid *root[1 << HEAP_BITMAP_ROOT_BITS];
+  size_t mids_count;
+  size_t leaves_count;
+};
+
+struct heap_bitmap_index {
+  uintptr_t root_ix;
+  uintptr_t mid_ix;
+  uintptr_t leaf_ix;
+  uintptr_t word_ix;
+  bits_t bit;
+};
+
+// Works out where the bit for obj lives; returns false if obj is out of range for the tree.
+static bool heap_bitmap_index_for(VALUE obj, struct heap_bitmap_index *ix) {
+  uintptr_t page_number = (uintptr_t)obj >> HEAP_PAGE_ALIGN_LOG;
+  if (page_number >> HEAP_BITMAP_PAGE_NUMBER_BITS) {
+    return false;
+  }
+  ix->leaf_ix = page_number & ((1 << HEAP_BITMAP_LEAF_BITS) - 1);
+  ix->mid_ix = (page_number >> HEAP_BITMAP_LEAF_BITS) & ((1 << HEAP_BITMAP_MID_BITS) - 1);
+  ix->root_ix = page_number >> (HEAP_BITMAP_LEAF_BITS + HEAP_BITMAP_MID_BITS);
+  uintptr_t slot = HEAP_BITMAP_SLOT_INDEX(obj);
+  ix->word_ix = slot / BITS_BITLENGTH;
+  ix->bit = ((bits_t)1) << (slot % BITS_BITLENGTH);
+  return true;
+}
+
+static bits_t *heap_bitmap_word(struct mpp_heap_bitmap *bm, struct heap_bitmap_index *ix, bool create) {
+  struct heap_bitmap_mid *mid = bm->root[ix->root_ix];
+  if (!mid) {
+    if (!create) {
+      return NULL;
+    }
+    mid = mpp_xmalloc(sizeof(struct heap_bitmap_mid));
+    memset(mid, 0, sizeof(struct heap_bitmap_mid));
+    bm->root[ix->root_ix] = mid;
+    bm->mids_count++;
+  }
+  struct heap_bitmap_leaf *leaf = mid->leaves[ix->mid_ix];
+  if (!leaf) {
+    if (!create) {
+      return NULL;
+    }
+    leaf = mpp_xmalloc(sizeof(struct heap_bitmap_leaf));
+    memset(leaf, 0, sizeof(struct heap_bitmap_leaf));
+    mid->leaves[ix->mid_ix] = leaf;
+    bm->leaves_count++;
+  }
+  return &leaf->pages[ix->leaf_ix][ix->word_ix];
+}
+
+struct mpp_heap_bitmap *mpp_heap_bitmap_new(void) {
+  struct mpp_heap_bitmap *bm = mpp_xmalloc(sizeof(struct mpp_heap_bitmap));
+  memset(bm, 0, sizeof(struct mpp_heap_bitmap));
+  return bm;
+}
+
+void mpp_heap_bitmap_destroy(struct mpp_heap_bitmap *bm) {
+  for (size_t i = 0; i < (1 << HEAP_BITMAP_ROOT_BITS); i++) {
+    struct heap_bitmap_mid *mid = bm->root[i];
+    if (!mid) {
+      continue;
+    }
+    for (size_t j = 0; j < (1 << HEAP_BITMAP_MID_BITS); j++) {
+      if (mid->leaves[j]) {
+        mpp_free(mid->leaves[j]);
+      }
+    }
+    mpp_free(mid);
+  }
+  mpp_free(bm);
+}
+
+size_t mpp_heap_bitmap_memsize(struct mpp_heap_bitmap *bm) {
+  return sizeof(struct mpp_heap_bitmap) + bm->mids_count * sizeof(struct heap_bitmap_mid) +
+         bm->leaves_count * sizeof(struct heap_bitmap_leaf);
+}
+
+bool mpp_heap_bitmap_test(struct mpp_heap_bitmap *bm, VALUE obj) {
+  struct heap_bitmap_index ix;
+  if (!heap_bitmap_index_for(obj, &ix)) {
+    // We can't track objects at this address, so we don't know; the caller will need to check properly.
+    return true;
+  }
+  bits_t *word = heap_bitmap_word(bm, &ix, false);
+  return word && (*word & ix.bit);
+}
+
+void mpp_heap_bitmap_set(struct mpp_heap_bitmap *bm, VALUE obj) {
+  struct heap_bitmap_index ix;
+  if (!heap_bitmap_index_for(obj, &ix)) {
+    return;
+  }
+  *heap_bitmap_word(bm, &ix, true) |= ix.bit;
+}
+
+void mpp_heap_bitmap_clear(struct mpp_heap_bitmap *bm, VALUE obj) {
+  struct heap_bitmap_index ix;
+  if (!heap_bitmap_index_for(obj, &ix)) {
+    return;
+  }
+  bits_t *word = heap_bitmap_word(bm, &ix, false);
+  if (word) {
+    *word &= ~ix.bit;
+  }
+}
+
+void mpp_heap_bitmap_clear_all(struct mpp_heap_bitmap *bm) {
+  // Keep the levels we've allocated, since the heap will most likely re-use the same pages.
+  for (size_t i = 0; i < (1 << HEAP_BITMAP_ROOT_BITS); i++) {
+    struct heap_bitmap_mid *mid = bm->root[i];
+    if (!mid) {
+      continue;
+    }
+    for (size_t j = 0; j < (1 << HEAP_BITMAP_MID_BITS); j++) {
+      if (mid->leaves[j]) {
+        memset(mid->leaves[j], 0, sizeof(struct heap_bitmap_leaf));
+      }
+    }
+  }
+}
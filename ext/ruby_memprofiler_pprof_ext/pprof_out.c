@@ -29,115 +29,227 @@ static void *mpp_pprof_upb_arena_malloc(upb_alloc *alloc, void *ptr, size_t olds
   }
 }
 
-// Methods for a hash of (function ID, line number) -> (location)
-// Needed because we have to intern a given function:line to a consistent location ID as per
-// the protobuf spec.
-// Key is a uint64_t[2].
-static int intpair_st_hash_compare(st_data_t arg1, st_data_t arg2) {
-  uint64_t *k1 = (uint64_t *)arg1;
-  uint64_t *k2 = (uint64_t *)arg2;
-
-  if (k1[0] != k2[0]) {
-    return k1[0] < k2[0];
-  } else {
-    return k1[1] < k2[1];
-  }
-}
-
 // I copied this magic number out of st.c from Ruby.
 #define FNV1_32A_INIT 0x811c9dc5
 
-static st_index_t intpair_st_hash_hash(st_data_t arg) {
-  uint64_t *k = (uint64_t *)arg;
-  return st_hash(k, 2 * sizeof(uint64_t), FNV1_32A_INIT);
+// An entry in the string table. Its contents are either a copy it owns (stored inline, after the entry), or point
+// straight into a Ruby String (value), which is kept marked (and pinned) for as long as the entry exists.
+struct mpp_pprof_string {
+  // Its contents, and its key in the serialization context's string table. This must come first.
+  struct mpp_string_table_entry key;
+  // Qundef if the entry owns a copy of its contents.
+  VALUE value;
+  // The string's ID in the serialization context, which it keeps from one flush to the next.
+  uint32_t index;
+  // The last flush that used this string.
+  unsigned int generation;
+  // Its index in the string table of the last profile it was added to, and which flush that was.
+  uint32_t profile_index;
+  unsigned int profile_generation;
+  char contents[];
+};
+
+// A function, i.e. a (function name, file name) pair of string IDs.
+struct pprof_function {
+  uint32_t name;
+  uint32_t file_name;
+  // The last flush that used this function; it's been added to that flush's profile already (0 if it's never been
+  // added to one).
+  unsigned int generation;
+  bool live;
+};
+
+// A location, which is a single frame location; unlike a function, it's told apart from other locations by the
+// frame's own minimal_location_t (line number included), so that looking one up needs no rendering or interning.
+struct pprof_location {
+  minimal_location_t frame_location;
+  uint32_t function_id;
+  int line_number;
+  // As for functions.
+  unsigned int generation;
+  bool live;
+};
+
+// A vector of fixed-size records (functions or locations), indexed by their pprof IDs. IDs start at 1, since pprof
+// reserves 0, and the IDs of pruned records are re-used; every profile is self-contained, so a re-used ID only ever
+// refers to one thing in any one profile. Records move when the vector grows, so they're referred to by ID, rather
+// than by pointer, anywhere they're kept.
+struct mpp_pprof_records {
+  char *items;
+  size_t record_size;
+  uint32_t next_id;
+  uint32_t capa;
+  uint32_t *free_ids;
+  uint32_t free_ids_count;
+};
+
+static struct mpp_pprof_records *records_new(size_t record_size) {
+  struct mpp_pprof_records *r = mpp_xmalloc(sizeof(struct mpp_pprof_records));
+  r->items = NULL;
+  r->record_size = record_size;
+  r->next_id = 1;
+  r->capa = 0;
+  r->free_ids = NULL;
+  r->free_ids_count = 0;
+  return r;
 }
 
-static const struct st_hash_type intpair_st_hash_type = {
-    .compare = intpair_st_hash_compare,
-    .hash = intpair_st_hash_hash,
+static void records_destroy(struct mpp_pprof_records *r) {
+  mpp_free(r->items);
+  mpp_free(r->free_ids);
+  mpp_free(r);
+}
+
+static size_t records_memsize(struct mpp_pprof_records *r) {
+  return sizeof(struct mpp_pprof_records) + (size_t)r->capa * (r->record_size + sizeof(uint32_t));
+}
+
+static inline void *records_get(struct mpp_pprof_records *r, uint32_t id) {
+  return r->items + (size_t)id * r->record_size;
+}
+
+// Returns the ID of a free record, whose contents are up to the caller to fill in.
+static uint32_t records_add(struct mpp_pprof_records *r) {
+  if (r->free_ids_count > 0) {
+    return r->free_ids[--r->free_ids_count];
+  }
+  if (r->next_id >= r->capa) {
+    MPP_ASSERT_MSG(r->capa < UINT32_MAX / 2, "too many IDs in use");
+    uint32_t new_capa = r->capa ? r->capa * 2 : 256;
+    r->items = mpp_realloc(r->items, (size_t)new_capa * r->record_size);
+    // There can never be more free IDs than records.
+    r->free_ids = mpp_realloc(r->free_ids, (size_t)new_capa * sizeof(uint32_t));
+    r->capa = new_capa;
+  }
+  return r->next_id++;
+}
+
+static void records_remove(struct mpp_pprof_records *r, uint32_t id) { r->free_ids[r->free_ids_count++] = id; }
+
+// The location index is the one lookup done for every frame of every sample: it maps a frame's minimal_location_t
+// straight to its location (and so, via the location, to its function), which is everything a frame needs. It's an
+// open-addressing table of (hash, location ID) buckets, whose keys are the locations' own frame_locations, hashed with
+// the same hash as the string table. Pruned locations aren't deleted from it one by one; it's rebuilt from the
+// locations that are left instead.
+#define LOCATION_INDEX_MIN_CAPA 256
+
+struct location_index_bucket {
+  // 0 if the bucket is empty.
+  uint64_t hash;
+  uint32_t location_id;
 };
 
-// Methods for a hash of (string, len) -> (string tab index)
-struct str_st_hash_key {
-  const char *str;
-  size_t str_len;
+struct mpp_pprof_location_index {
+  struct location_index_bucket *buckets;
+  size_t capa;
+  size_t count;
 };
 
-static int str_st_hash_compare(st_data_t arg1, st_data_t arg2) {
-  struct str_st_hash_key *k1 = (struct str_st_hash_key *)arg1;
-  struct str_st_hash_key *k2 = (struct str_st_hash_key *)arg2;
+static inline uint64_t location_hash(const minimal_location_t *loc) {
+  return mpp_string_hash((const char *)loc, sizeof(minimal_location_t));
+}
 
-  size_t smaller_len = (k1->str_len > k2->str_len) ? k2->str_len : k1->str_len;
-  int cmp = memcmp(k1->str, k2->str, smaller_len);
+static void location_index_init(struct mpp_pprof_location_index *index, size_t capa) {
+  index->capa = capa;
+  index->buckets = mpp_xmalloc(capa * sizeof(struct location_index_bucket));
+  memset(index->buckets, 0, capa * sizeof(struct location_index_bucket));
+  index->count = 0;
+}
 
-  if (cmp != 0 || k1->str_len == k2->str_len) {
-    // Either: one of the first smaller_len bytes were different, or
-    // they were the same, AND the lenghts are the same, which make them the same string.
-    return cmp;
+static void location_index_add(struct mpp_pprof_location_index *index, uint64_t hash, uint32_t location_id) {
+  size_t mask = index->capa - 1;
+  size_t i = hash & mask;
+  while (index->buckets[i].hash) {
+    i = (i + 1) & mask;
   }
-  // The first smaller_len bytes are the same, but one is longer than the other.
-  // The shorter string should be considered smaller.
-  return k1->str_len > k2->str_len ? 1 : -1;
+  index->buckets[i].hash = hash;
+  index->buckets[i].location_id = location_id;
+  index->count++;
 }
 
-static st_index_t str_st_hash_hash(st_data_t arg) {
-  struct str_st_hash_key *k = (struct str_st_hash_key *)arg;
-  return st_hash(k->str, k->str_len, FNV1_32A_INIT);
+// Returns the ID of the location for this frame location, or 0 if there isn't one.
+static uint32_t location_index_lookup(struct mpp_pprof_location_index *index, struct mpp_pprof_records *locations,
+                                      uint64_t hash, const minimal_location_t *loc) {
+  size_t mask = index->capa - 1;
+  for (size_t i = hash & mask; index->buckets[i].hash; i = (i + 1) & mask) {
+    struct location_index_bucket *b = &index->buckets[i];
+    if (b->hash == hash) {
+      struct pprof_location *location = records_get(locations, b->location_id);
+      if (memcmp(&location->frame_location, loc, sizeof(minimal_location_t)) == 0) {
+        return b->location_id;
+      }
+    }
+  }
+  return 0;
+}
+
+// Adds a location which isn't already in the index, growing it if need be.
+static void location_index_insert(struct mpp_pprof_location_index *index, uint64_t hash, uint32_t location_id) {
+  if (index->count + 1 > (index->capa / 4) * 3) {
+    struct mpp_pprof_location_index old = *index;
+    location_index_init(index, old.capa * 2);
+    for (size_t i = 0; i < old.capa; i++) {
+      if (old.buckets[i].hash) {
+        location_index_add(index, old.buckets[i].hash, old.buckets[i].location_id);
+      }
+    }
+    mpp_free(old.buckets);
+  }
+  location_index_add(index, hash, location_id);
 }
 
-static const struct st_hash_type str_st_hash_type = {
-    .compare = str_st_hash_compare,
-    .hash = str_st_hash_hash,
+// An entry in the function cache.
+struct pprof_function_cache_entry {
+  // Must come first; the cache is keyed by a pointer to this. It's the location of a frame, with the line number
+  // zeroed out.
+  minimal_location_t location;
+  uint32_t function_id;
+  // The last flush that used this entry.
+  unsigned int generation;
 };
 
-struct intern_string_hash_update_ctx {
-  struct mpp_pprof_serctx *serctx;
-  bool copy;
-  bool did_retain_out;
-  int index_out;
+// Methods for a hash of (minimal_location_t *) -> (struct pprof_function_cache_entry *).
+static int location_st_hash_compare(st_data_t arg1, st_data_t arg2) {
+  return memcmp((minimal_location_t *)arg1, (minimal_location_t *)arg2, sizeof(minimal_location_t));
+}
+
+static st_index_t location_st_hash_hash(st_data_t arg) {
+  return st_hash((minimal_location_t *)arg, sizeof(minimal_location_t), FNV1_32A_INIT);
+}
+
+static const struct st_hash_type location_st_hash_type = {
+    .compare = location_st_hash_compare,
+    .hash = location_st_hash_hash,
 };
 
-static int intern_string_hash_update(st_data_t *key, st_data_t *value, st_data_t arg, int existing) {
-  struct intern_string_hash_update_ctx *ctx = (struct intern_string_hash_update_ctx *)arg;
-  if (existing) {
-    // Value was already in the hash; just return its existing index.
-    ctx->index_out = *value;
-  } else {
-    struct mpp_pprof_serctx *serctx = ctx->serctx;
-    bool copy = ctx->copy;
-    upb_Arena *arena = serctx->arena;
-    // Value NOT already in the hash. We need to add it.
-    // Need to actually create a new *key; the one passed into st_update is a stack pointer, which won't be valid after
-    // intern_string returns.
-    struct str_st_hash_key *new_key = upb_Arena_Malloc(arena, sizeof(struct str_st_hash_key));
-    struct str_st_hash_key *old_key = (struct str_st_hash_key *)*key;
-    const char *old_str = old_key->str;
-    size_t old_str_len = old_key->str_len;
-    // May also need to copy the string, if it's not already a pointer to the arena.
-    if (copy) {
-      char *new_str = upb_Arena_Malloc(arena, old_str_len + 1);
-      memcpy(new_str, old_str, old_str_len);
-      new_str[old_str_len] = '\0';
-      new_key->str = new_str;
+// Looks up the string with these contents, or adds it to the table if it's not there; if value is a String, a new
+// entry points into it rather than copying str. Either way, the string is marked as used by the current flush.
+static uint32_t intern_string_contents(struct mpp_pprof_serctx *serctx, const char *str, size_t len, VALUE value) {
+  uint64_t hash = mpp_string_hash(str, len);
+  struct mpp_pprof_string *entry = (struct mpp_pprof_string *)mpp_string_table_lookup(serctx->strings, hash, str, len);
+  if (!entry) {
+    if (value == Qundef) {
+      entry = mpp_xmalloc(sizeof(struct mpp_pprof_string) + len + 1);
+      memcpy(entry->contents, str, len);
+      entry->contents[len] = '\0';
+      entry->key.str = entry->contents;
     } else {
-      new_key->str = old_str;
-      ctx->did_retain_out = true;
+      entry = mpp_xmalloc(sizeof(struct mpp_pprof_string));
+      entry->key.str = str;
     }
-    new_key->str_len = old_str_len;
-    *key = (st_data_t)new_key;
-
-    // Now increment the value
-    *value = serctx->strings_counter++;
-    ctx->index_out = *value;
+    entry->key.len = len;
+    entry->key.hash = hash;
+    entry->value = value;
+    entry->profile_generation = 0;
+    entry->index = mpp_id_slots_add(&serctx->string_slots, entry);
+    mpp_string_table_add(serctx->strings, &entry->key);
   }
-  return ST_CONTINUE;
+  entry->generation = serctx->generation;
+  return entry->index;
 }
 
 static int intern_string(struct mpp_pprof_serctx *serctx, const char *str, size_t len) {
-  struct str_st_hash_key key = {.str = str, .str_len = len};
-  struct intern_string_hash_update_ctx ctx = {.serctx = serctx, .index_out = 0, .copy = true};
-  st_update(serctx->strings, (st_data_t)&key, intern_string_hash_update, (st_data_t)&ctx);
-  return ctx.index_out;
+  return intern_string_contents(serctx, str, len, Qundef);
 }
 
 static int intern_scratch_buffer(struct mpp_pprof_serctx *serctx) {
@@ -148,222 +260,467 @@ static int intern_scratch_buffer(struct mpp_pprof_serctx *serctx) {
   if (str_len >= serctx->scratch_buffer_capa) {
     str_len = serctx->scratch_buffer_capa - 1;
   }
-  struct str_st_hash_key key = {.str = serctx->scratch_buffer, .str_len = str_len};
-  struct intern_string_hash_update_ctx ctx = {.serctx = serctx, .index_out = 0, .copy = false, .did_retain_out = false};
-  st_update(serctx->strings, (st_data_t)&key, intern_string_hash_update, (st_data_t)&ctx);
-  if (ctx.did_retain_out) {
-    serctx->scratch_buffer = NULL;
-    serctx->scratch_buffer_capa = 0;
-    serctx->scratch_buffer_strlen = 0;
+  return intern_string(serctx, serctx->scratch_buffer, str_len);
+}
+
+// The string_values table packs the string ID and the last flush to look the VALUE up into its values.
+#define STRING_VALUE_PACK(index, generation) (((st_data_t)(generation) << 32) | (st_data_t)(index))
+#define STRING_VALUE_INDEX(packed) ((uint32_t)((packed)&0xFFFFFFFF))
+#define STRING_VALUE_GENERATION(packed) ((unsigned int)((packed) >> 32))
+
+// Interns the contents of a Ruby string without copying them; the string table entry points straight into the
+// string. Strings are looked up by VALUE first, so the contents only need hashing the first time we see each one;
+// most frames from the same file share the very same path string. Anything that isn't a String (e.g. the Qnil
+// filename of a cfunc frame) is interned as "".
+static int intern_string_value(struct mpp_pprof_serctx *serctx, VALUE str) {
+  if (!RB_TYPE_P(str, T_STRING)) {
+    return 0;
   }
-  return ctx.index_out;
+  bool existed;
+  st_data_t *packed = mpp_value_table_lookup_or_insert(serctx->string_values, str, &existed);
+  uint32_t index;
+  if (existed) {
+    index = STRING_VALUE_INDEX(*packed);
+    ((struct mpp_pprof_string *)serctx->string_slots.items[index])->generation = serctx->generation;
+  } else {
+    index = intern_string_contents(serctx, RSTRING_PTR(str), RSTRING_LEN(str), str);
+  }
+  *packed = STRING_VALUE_PACK(index, serctx->generation);
+  return (int)index;
 }
 
 static void ensure_scratch_buffer(struct mpp_pprof_serctx *serctx) {
   if (!serctx->scratch_buffer) {
-    serctx->scratch_buffer = upb_Arena_Malloc(serctx->arena, 256);
+    serctx->scratch_buffer = mpp_xmalloc(256);
     serctx->scratch_buffer_capa = 256;
     serctx->scratch_buffer_strlen = 0;
   }
 }
 
-// Initialize an already-allocated serialization context.
-struct mpp_pprof_serctx *mpp_pprof_serctx_new(char *errbuf, size_t errbuflen) {
+// Looks up the function with this name & file name, or adds a new one if there isn't one, and returns its ID.
+static uint32_t function_lookup_or_insert(struct mpp_pprof_serctx *ctx, uint32_t name, uint32_t file_name) {
+  st_data_t key = ((st_data_t)name << 32) | file_name;
+  st_data_t existing;
+  if (st_lookup(ctx->functions_index, key, &existing)) {
+    return (uint32_t)existing;
+  }
+  uint32_t id = records_add(ctx->functions);
+  struct pprof_function *function = records_get(ctx->functions, id);
+  function->name = name;
+  function->file_name = file_name;
+  function->generation = 0;
+  function->live = true;
+  st_insert(ctx->functions_index, key, id);
+  return id;
+}
+
+// Returns the index in the current profile's string table of the string with this ID, adding it to the end of that
+// table if this profile hasn't used it yet. Each profile's string table only has the strings it uses, in the order it
+// first used them; the IDs strings keep from one flush to the next never make it into a profile.
+static uint32_t profile_string(struct mpp_pprof_serctx *ctx, uint32_t index) {
+  struct mpp_pprof_string *entry = ctx->string_slots.items[index];
+  entry->generation = ctx->generation;
+  if (entry->profile_generation == ctx->generation) {
+    return entry->profile_index;
+  }
+  if (ctx->profile_strings_count == ctx->profile_strings_capa) {
+    ctx->profile_strings_capa = ctx->profile_strings_capa ? ctx->profile_strings_capa * 2 : 64;
+    ctx->profile_strings =
+        mpp_realloc(ctx->profile_strings, ctx->profile_strings_capa * sizeof(struct mpp_pprof_string *));
+  }
+  entry->profile_index = (uint32_t)ctx->profile_strings_count;
+  entry->profile_generation = ctx->generation;
+  ctx->profile_strings[ctx->profile_strings_count++] = entry;
+  return entry->profile_index;
+}
+
+// Create a new serialization context. It holds on to its string, function & location dictionaries from one flush to
+// the next; each flush's profile is built between calls to mpp_pprof_serctx_begin & mpp_pprof_serctx_finish.
+struct mpp_pprof_serctx *mpp_pprof_serctx_new(bool pretty_backtraces, char *errbuf, size_t errbuflen) {
   struct mpp_pprof_serctx *ctx = mpp_xmalloc(sizeof(struct mpp_pprof_serctx));
   ctx->allocator.func = mpp_pprof_upb_arena_malloc;
-  ctx->arena = upb_Arena_Init(NULL, 0, &ctx->allocator);
-  ctx->profile_proto = perftools_profiles_Profile_new(ctx->arena);
-  ctx->function_pbs = st_init_numtable();
-  ctx->location_pbs = st_init_table(&intpair_st_hash_type);
-  ctx->function_ids = st_init_table(&intpair_st_hash_type);
-  ctx->strings = st_init_table(&str_st_hash_type);
-  ctx->loc_counter = 1;
-  ctx->function_id_counter = 1;
-  ctx->strings_counter = 0;
+  ctx->arena = NULL;
+  ctx->profile_proto = NULL;
+  ctx->sample_pbs = NULL;
+  ctx->generation = 0;
+  ctx->functions = records_new(sizeof(struct pprof_function));
+  ctx->functions_index = st_init_numtable();
+  ctx->locations = records_new(sizeof(struct pprof_location));
+  ctx->location_index = mpp_xmalloc(sizeof(struct mpp_pprof_location_index));
+  location_index_init(ctx->location_index, LOCATION_INDEX_MIN_CAPA);
+  ctx->function_cache = st_init_table(&location_st_hash_type);
+  ctx->strings = mpp_string_table_new();
+  mpp_id_slots_init(&ctx->string_slots);
+  ctx->pretty_backtraces = pretty_backtraces;
+  ctx->string_values = mpp_value_table_new(0);
+  ctx->profile_strings = NULL;
+  ctx->profile_strings_count = 0;
+  ctx->profile_strings_capa = 0;
   ctx->interrupt = 0;
   ctx->scratch_buffer = NULL;
   ctx->scratch_buffer_capa = 0;
   ctx->scratch_buffer_strlen = 0;
+  return ctx;
+}
 
-  // Pprof requires that "" be interned at position 0 in the string table, so intern that now.
-  intern_string(ctx, "", 0);
+void mpp_pprof_serctx_begin(struct mpp_pprof_serctx *ctx) {
+  MPP_ASSERT_MSG(!ctx->arena, "serialization context already has a profile in progress");
+  // Generation 0 means "never used", for new dictionary entries.
+  if (++ctx->generation == 0) {
+    ctx->generation = 1;
+  }
+  ctx->interrupt = 0;
+  ctx->arena = upb_Arena_Init(NULL, 0, &ctx->allocator);
+  ctx->profile_proto = perftools_profiles_Profile_new(ctx->arena);
+  ctx->sample_pbs = st_init_numtable();
+  ctx->profile_strings_count = 0;
+
+  // Pprof requires that "" be at position 0 in the string table, so it's the very first string each profile adds. It's
+  // also the very first string a new ctx interns, and every flush uses it, so it's never pruned and keeps ID 0 (which
+  // intern_string_value relies on).
+  int empty_string_id = intern_string(ctx, "", 0);
+  MPP_ASSERT_MSG(empty_string_id == 0, "empty string wasn't interned with ID 0");
+  uint32_t empty_string_index = profile_string(ctx, (uint32_t)empty_string_id);
+  MPP_ASSERT_MSG(empty_string_index == 0, "empty string wasn't added at position 0");
 
   // Set up the sample types etc.
   perftools_profiles_ValueType *retained_objects_vt =
       perftools_profiles_Profile_add_sample_type(ctx->profile_proto, ctx->arena);
-  perftools_profiles_ValueType_set_type(retained_objects_vt,
-                                        intern_string(ctx, "retained_objects", strlen("retained_objects")));
-  perftools_profiles_ValueType_set_unit(retained_objects_vt, intern_string(ctx, "count", strlen("count")));
+  perftools_profiles_ValueType_set_type(
+      retained_objects_vt, profile_string(ctx, intern_string(ctx, "retained_objects", strlen("retained_objects"))));
+  perftools_profiles_ValueType_set_unit(retained_objects_vt,
+                                        profile_string(ctx, intern_string(ctx, "count", strlen("count"))));
   perftools_profiles_ValueType *retained_size_vt =
       perftools_profiles_Profile_add_sample_type(ctx->profile_proto, ctx->arena);
-  perftools_profiles_ValueType_set_type(retained_size_vt, intern_string(ctx, "retained_size", strlen("retained_size")));
-  perftools_profiles_ValueType_set_unit(retained_size_vt, intern_string(ctx, "bytes", strlen("bytes")));
+  perftools_profiles_ValueType_set_type(
+      retained_size_vt, profile_string(ctx, intern_string(ctx, "retained_size", strlen("retained_size"))));
+  perftools_profiles_ValueType_set_unit(retained_size_vt,
+                                        profile_string(ctx, intern_string(ctx, "bytes", strlen("bytes"))));
+}
 
-  return ctx;
+static int prune_each_string_value(st_data_t key, st_data_t value, st_data_t arg) {
+  unsigned int generation = (unsigned int)arg;
+  return STRING_VALUE_GENERATION(value) == generation ? ST_CONTINUE : ST_DELETE;
+}
+
+struct prune_cache_ctx {
+  st_table *survivors;
+  unsigned int generation;
+};
+
+static int prune_each_function_cache_entry(st_data_t key, st_data_t value, st_data_t arg) {
+  struct prune_cache_ctx *ctx = (struct prune_cache_ctx *)arg;
+  struct pprof_function_cache_entry *entry = (struct pprof_function_cache_entry *)value;
+  if (entry->generation == ctx->generation) {
+    st_insert(ctx->survivors, key, value);
+  } else {
+    mpp_free(entry);
+  }
+  return ST_CONTINUE;
+}
+
+static void prune_functions(struct mpp_pprof_serctx *ctx) {
+  for (uint32_t id = 1; id < ctx->functions->next_id; id++) {
+    struct pprof_function *function = records_get(ctx->functions, id);
+    if (function->live && function->generation != ctx->generation) {
+      st_data_t key = ((st_data_t)function->name << 32) | function->file_name;
+      st_delete(ctx->functions_index, &key, NULL);
+      function->live = false;
+      records_remove(ctx->functions, id);
+    }
+  }
+}
+
+static void prune_locations(struct mpp_pprof_serctx *ctx) {
+  bool pruned = false;
+  for (uint32_t id = 1; id < ctx->locations->next_id; id++) {
+    struct pprof_location *location = records_get(ctx->locations, id);
+    if (location->live && location->generation != ctx->generation) {
+      location->live = false;
+      records_remove(ctx->locations, id);
+      pruned = true;
+    }
+  }
+  if (!pruned) {
+    return;
+  }
+  memset(ctx->location_index->buckets, 0, ctx->location_index->capa * sizeof(struct location_index_bucket));
+  ctx->location_index->count = 0;
+  for (uint32_t id = 1; id < ctx->locations->next_id; id++) {
+    struct pprof_location *location = records_get(ctx->locations, id);
+    if (location->live) {
+      location_index_add(ctx->location_index, location_hash(&location->frame_location), id);
+    }
+  }
+}
+
+void mpp_pprof_serctx_finish(struct mpp_pprof_serctx *ctx) {
+  if (!ctx->arena) {
+    return;
+  }
+  st_free_table(ctx->sample_pbs);
+  ctx->sample_pbs = NULL;
+  ctx->profile_proto = NULL;
+  upb_Arena_Free(ctx->arena);
+  ctx->arena = NULL;
+
+  // Let go of everything this flush didn't use; the strings, functions & locations for code that isn't in any live
+  // sample any more would otherwise be kept forever. Something used by every flush (which is most things, in a
+  // long-running process) keeps its ID.
+  mpp_value_table_foreach(ctx->string_values, prune_each_string_value, (st_data_t)ctx->generation);
+  for (uint32_t i = 0; i < ctx->string_slots.next_id; i++) {
+    struct mpp_pprof_string *entry = ctx->string_slots.items[i];
+    if (entry && entry->generation != ctx->generation) {
+      mpp_string_table_delete(ctx->strings, &entry->key);
+      mpp_id_slots_remove(&ctx->string_slots, i);
+      mpp_free(entry);
+    }
+  }
+  // Every location this flush used points to a function it used, as does everything in the function cache that it
+  // used, and so those functions are all still there (with the same IDs).
+  prune_functions(ctx);
+  prune_locations(ctx);
+  struct prune_cache_ctx cache_ctx = {.survivors = st_init_table(&location_st_hash_type),
+                                      .generation = ctx->generation};
+  st_foreach(ctx->function_cache, prune_each_function_cache_entry, (st_data_t)&cache_ctx);
+  st_free_table(ctx->function_cache);
+  ctx->function_cache = cache_ctx.survivors;
+}
+
+static int free_each_cache_entry(st_data_t key, st_data_t value, st_data_t arg) {
+  mpp_free((void *)value);
+  return ST_CONTINUE;
 }
 
 // Destroys the serialization context. After this call, any stringtab indexes it held
 // are released, and any memory from its internal state is freed. *ctx itself is also
 // freed and must not be dereferenced after this.
 void mpp_pprof_serctx_destroy(struct mpp_pprof_serctx *ctx) {
-  if (ctx->function_pbs) {
-    st_free_table(ctx->function_pbs);
-  }
-  if (ctx->location_pbs) {
-    st_free_table(ctx->location_pbs);
+  mpp_pprof_serctx_finish(ctx);
+  records_destroy(ctx->functions);
+  st_free_table(ctx->functions_index);
+  records_destroy(ctx->locations);
+  mpp_free(ctx->location_index->buckets);
+  mpp_free(ctx->location_index);
+  st_foreach(ctx->function_cache, free_each_cache_entry, 0);
+  st_free_table(ctx->function_cache);
+  for (uint32_t i = 0; i < ctx->string_slots.next_id; i++) {
+    if (ctx->string_slots.items[i]) {
+      mpp_free(ctx->string_slots.items[i]);
+    }
   }
-  if (ctx->function_ids) {
-    st_free_table(ctx->function_ids);
+  mpp_id_slots_destroy(&ctx->string_slots);
+  mpp_string_table_destroy(ctx->strings);
+  mpp_value_table_destroy(ctx->string_values);
+  if (ctx->profile_strings) {
+    mpp_free(ctx->profile_strings);
   }
-  if (ctx->strings) {
-    st_free_table(ctx->strings);
+  if (ctx->scratch_buffer) {
+    mpp_free(ctx->scratch_buffer);
   }
-  upb_Arena_Free(ctx->arena);
   mpp_free(ctx);
 }
 
-struct mpp_pprof_serctx_map_add_ctx {
-  struct mpp_pprof_serctx *ctx;
-  int is_error;
-  char *errbuf;
-  size_t errbuflen;
-
-  int function_name;
-  int file_name;
-  unsigned long function_id;
-
-  // for add_location
-  int line_number;
-  unsigned long location_id_out;
-};
-
-static int mpp_pprof_serctx_add_function(st_data_t *key, st_data_t *value, st_data_t data, int existing) {
-  if (*value) {
-    // already exists in the map, don't create it again.
-    return ST_CONTINUE;
+size_t mpp_pprof_serctx_memsize(struct mpp_pprof_serctx *ctx) {
+  size_t sz = sizeof(struct mpp_pprof_serctx);
+  sz += records_memsize(ctx->functions) + st_memsize(ctx->functions_index);
+  sz += records_memsize(ctx->locations) + sizeof(struct mpp_pprof_location_index);
+  sz += ctx->location_index->capa * sizeof(struct location_index_bucket);
+  sz += st_memsize(ctx->function_cache) + ctx->function_cache->num_entries * sizeof(struct pprof_function_cache_entry);
+  sz += mpp_string_table_memsize(ctx->strings);
+  sz += mpp_id_slots_memsize(&ctx->string_slots);
+  for (uint32_t i = 0; i < ctx->string_slots.next_id; i++) {
+    struct mpp_pprof_string *entry = ctx->string_slots.items[i];
+    if (entry) {
+      sz += sizeof(struct mpp_pprof_string) + (entry->value == Qundef ? entry->key.len + 1 : 0);
+    }
   }
+  sz += mpp_value_table_memsize(ctx->string_values);
+  sz += ctx->profile_strings_capa * sizeof(struct mpp_pprof_string *);
+  sz += ctx->scratch_buffer_capa;
+  // The arena for a profile in progress isn't counted; it only lives as long as the flush.
+  return sz;
+}
 
-  struct mpp_pprof_serctx_map_add_ctx *thunkctx = (struct mpp_pprof_serctx_map_add_ctx *)data;
-  struct perftools_profiles_Function *fn_proto =
-      perftools_profiles_Profile_add_function(thunkctx->ctx->profile_proto, thunkctx->ctx->arena);
-
-  perftools_profiles_Function_set_id(fn_proto, thunkctx->function_id);
-
-  perftools_profiles_Function_set_name(fn_proto, thunkctx->function_name);
-  perftools_profiles_Function_set_system_name(fn_proto, thunkctx->function_name);
-  perftools_profiles_Function_set_filename(fn_proto, thunkctx->file_name);
+static int serctx_mark_each_string_value(st_data_t key, st_data_t value, st_data_t arg) {
+  // Pinned, because the string table holds pointers to the contents of embedded strings.
+  rb_gc_mark((VALUE)key);
+  return ST_CONTINUE;
+}
 
-  *value = (st_data_t)fn_proto;
+static int serctx_mark_each_function_cache_entry(st_data_t key, st_data_t value, st_data_t arg) {
+  // Pinned, because the cache is keyed by the VALUEs' addresses.
+  mpp_location_mark(&((struct pprof_function_cache_entry *)value)->location);
   return ST_CONTINUE;
 }
 
-static int mpp_pprof_serctx_add_location(st_data_t *key, st_data_t *value, st_data_t data, int existing) {
-  struct mpp_pprof_serctx_map_add_ctx *thunkctx = (struct mpp_pprof_serctx_map_add_ctx *)data;
-  if (*value) {
-    // already exists in the map, don't create it again.
-    struct perftools_profiles_Location *existing_loc = (struct perftools_profiles_Location *)(*value);
-    thunkctx->location_id_out = perftools_profiles_Location_id(existing_loc);
-    return ST_CONTINUE;
+void mpp_pprof_serctx_mark(struct mpp_pprof_serctx *ctx) {
+  mpp_value_table_foreach(ctx->string_values, serctx_mark_each_string_value, 0);
+  st_foreach(ctx->function_cache, serctx_mark_each_function_cache_entry, 0);
+  // Likewise the location index.
+  for (uint32_t id = 1; id < ctx->locations->next_id; id++) {
+    struct pprof_location *location = records_get(ctx->locations, id);
+    if (location->live) {
+      mpp_location_mark(&location->frame_location);
+    }
   }
+  // A string can outlive the entry in string_values for the VALUE it points into, if it's since been looked up by
+  // some other VALUE (or by its contents).
+  for (uint32_t i = 0; i < ctx->string_slots.next_id; i++) {
+    struct mpp_pprof_string *entry = ctx->string_slots.items[i];
+    if (entry && entry->value != Qundef) {
+      rb_gc_mark(entry->value);
+    }
+  }
+}
 
-  struct perftools_profiles_Location *loc_proto =
-      perftools_profiles_Profile_add_location(thunkctx->ctx->profile_proto, thunkctx->ctx->arena);
+// Works out which function a frame belongs to; two frames are the same function if they have the same name and the
+// same filename. Rendering the function name is by far the most expensive part of adding a sample, and all the
+// frames from the same method render the same, so the answer is cached against the frame's location (minus its line
+// number). The VALUEs in those locations are kept marked, and pinned, for as long as they're in the cache, so none of
+// them can be freed and have something else turn up at the same address (nor can GC.compact move them).
+static uint32_t frame_function(struct mpp_pprof_serctx *ctx, struct mpp_frame *frame) {
+  // Synthetic frames (like truncation markers) are named after their counts, which they keep in the line number, so
+  // they can't be cached this way; there's only ever a few of them anyway.
+  bool cacheable = !mpp_location_is_synthetic(&frame->location);
+  minimal_location_t cache_key;
+  if (cacheable) {
+    cache_key = frame->location;
+    cache_key.line_number = 0;
+    st_data_t existing;
+    if (st_lookup(ctx->function_cache, (st_data_t)&cache_key, &existing)) {
+      struct pprof_function_cache_entry *cached = (struct pprof_function_cache_entry *)existing;
+      cached->generation = ctx->generation;
+      return cached->function_id;
+    }
+  }
 
-  perftools_profiles_Location_set_id(loc_proto, thunkctx->ctx->loc_counter++);
-  perftools_profiles_Line *line_proto = perftools_profiles_Location_add_line(loc_proto, thunkctx->ctx->arena);
-  perftools_profiles_Line_set_function_id(line_proto, thunkctx->function_id);
-  perftools_profiles_Line_set_line(line_proto, (int64_t)thunkctx->line_number);
+  // Intern the frame names & filenames.
+  int function_name;
+  // Synthetic frames have no Ruby string for a label, so they always get rendered.
+  if (ctx->pretty_backtraces || !cacheable) {
+    ensure_scratch_buffer(ctx);
+    ctx->scratch_buffer_strlen = mpp_frame_function_name(frame, ctx->scratch_buffer, ctx->scratch_buffer_capa);
+    function_name = intern_scratch_buffer(ctx);
+  } else {
+    // The plain label already exists as a Ruby string, so it can go in the string table as-is, like filenames.
+    function_name = intern_string_value(ctx, mpp_frame_label_value(frame));
+  }
+  int file_name = intern_string_value(ctx, mpp_frame_file_name_value(frame));
+  uint32_t function_id = function_lookup_or_insert(ctx, (uint32_t)function_name, (uint32_t)file_name);
+
+  if (cacheable) {
+    struct pprof_function_cache_entry *cached = mpp_xmalloc(sizeof(struct pprof_function_cache_entry));
+    cached->location = cache_key;
+    cached->function_id = function_id;
+    cached->generation = ctx->generation;
+    st_insert(ctx->function_cache, (st_data_t)&cached->location, (st_data_t)cached);
+  }
+  return function_id;
+}
 
-  thunkctx->location_id_out = perftools_profiles_Location_id(loc_proto);
-  *value = (st_data_t)loc_proto;
-  return ST_CONTINUE;
+// Adds the function with this ID to the profile, if this flush hasn't already.
+static void use_function(struct mpp_pprof_serctx *ctx, uint32_t function_id) {
+  struct pprof_function *function = records_get(ctx->functions, function_id);
+  if (function->generation == ctx->generation) {
+    return;
+  }
+  function->generation = ctx->generation;
+  uint32_t name = profile_string(ctx, function->name);
+  uint32_t file_name = profile_string(ctx, function->file_name);
+  perftools_profiles_Function *fn_proto = perftools_profiles_Profile_add_function(ctx->profile_proto, ctx->arena);
+  perftools_profiles_Function_set_id(fn_proto, function_id);
+  perftools_profiles_Function_set_name(fn_proto, name);
+  perftools_profiles_Function_set_system_name(fn_proto, name);
+  perftools_profiles_Function_set_filename(fn_proto, file_name);
 }
 
-static int function_id_update_func(st_data_t *key, st_data_t *value, st_data_t arg, int existing) {
-  struct mpp_pprof_serctx_map_add_ctx *thunkctx = (struct mpp_pprof_serctx_map_add_ctx *)arg;
-  if (!existing) {
-    *value = thunkctx->ctx->function_id_counter++;
+// Returns the ID of the location for a frame, adding it (and its function) to the profile if this flush hasn't
+// already. Once a frame's location has been seen, by this flush or an earlier one, this is a single lookup in the
+// location index; only a frame location that's new works out its function, via frame_function. The location index
+// keeps the VALUEs in its frame locations marked and pinned, just like the function cache does.
+static uint32_t frame_location(struct mpp_pprof_serctx *ctx, struct mpp_frame *frame) {
+  uint64_t hash = location_hash(&frame->location);
+  uint32_t location_id = location_index_lookup(ctx->location_index, ctx->locations, hash, &frame->location);
+  if (!location_id) {
+    // Synthetic frames can go in the index too; their whole location, line number included, determines their name.
+    uint32_t function_id = frame_function(ctx, frame);
+    location_id = records_add(ctx->locations);
+    struct pprof_location *location = records_get(ctx->locations, location_id);
+    location->frame_location = frame->location;
+    location->function_id = function_id;
+    location->line_number = mpp_frame_line_number(frame);
+    location->generation = 0;
+    location->live = true;
+    location_index_insert(ctx->location_index, hash, location_id);
   }
-  thunkctx->function_id = *value;
-  return ST_CONTINUE;
+
+  // Functions & locations are only added to the profile the first time this flush uses them.
+  struct pprof_location *location = records_get(ctx->locations, location_id);
+  if (location->generation != ctx->generation) {
+    location->generation = ctx->generation;
+    use_function(ctx, location->function_id);
+    perftools_profiles_Location *loc_proto = perftools_profiles_Profile_add_location(ctx->profile_proto, ctx->arena);
+    perftools_profiles_Location_set_id(loc_proto, location_id);
+    perftools_profiles_Line *line_proto = perftools_profiles_Location_add_line(loc_proto, ctx->arena);
+    perftools_profiles_Line_set_function_id(line_proto, location->function_id);
+    perftools_profiles_Line_set_line(line_proto, (int64_t)location->line_number);
+  }
+  return location_id;
 }
 
-int mpp_pprof_serctx_add_sample(struct mpp_pprof_serctx *ctx, struct mpp_sample *sample, char *errbuf,
-                                size_t errbuflen) {
+int mpp_pprof_serctx_add_sample(struct mpp_pprof_serctx *ctx, struct mpp_stack_table *stacks, uint32_t stack_id,
+                                size_t retained_objects, size_t retained_size, char *errbuf, size_t errbuflen) {
   CHECK_IF_INTERRUPTED(return -1);
 
-  size_t frames_count = sample->frames_count;
+  // If we've already seen this stack, just add to its sample. The samples being flushed all existed (and so held a
+  // reference to their stacks) when the flush started, so a stack ID can't have been recycled for a different stack
+  // in the meantime.
+  st_data_t existing_sample_proto;
+  if (st_lookup(ctx->sample_pbs, stack_id, &existing_sample_proto)) {
+    size_t values_len;
+    int64_t *values =
+        perftools_profiles_Sample_mutable_value((perftools_profiles_Sample *)existing_sample_proto, &values_len);
+    MPP_ASSERT_MSG(values_len == 2, "sample protobuf has the wrong number of values");
+    values[0] += (int64_t)retained_objects;
+    values[1] += (int64_t)retained_size;
+    return 0;
+  }
+
+  struct mpp_stack *stack = mpp_stack_table_get(stacks, stack_id);
+  size_t frames_count = stack->frames_count;
   perftools_profiles_Sample *sample_proto = perftools_profiles_Profile_add_sample(ctx->profile_proto, ctx->arena);
   uint64_t *location_ids = perftools_profiles_Sample_resize_location_id(sample_proto, frames_count, ctx->arena);
 
   // Protobuf needs to be in most-recent-call-first, and backtracie is also in that order.
   for (size_t i = 0; i < frames_count; i++) {
-    // Create protobufs for function/location ID as needed.
-    struct mpp_pprof_serctx_map_add_ctx thunkctx;
-    thunkctx.ctx = ctx;
-    thunkctx.errbuf = errbuf;
-    thunkctx.errbuflen = errbuflen;
-    thunkctx.is_error = 0;
-    thunkctx.location_id_out = 0;
-
-    // Intern the frame names & filenames.
-    ensure_scratch_buffer(ctx);
-    ctx->scratch_buffer_strlen =
-        mpp_sample_frame_function_name(sample, i, ctx->scratch_buffer, ctx->scratch_buffer_capa);
-    thunkctx.function_name = intern_scratch_buffer(ctx);
-
-    ensure_scratch_buffer(ctx);
-    ctx->scratch_buffer_strlen = mpp_sample_frame_file_name(sample, i, ctx->scratch_buffer, ctx->scratch_buffer_capa);
-    thunkctx.file_name = intern_scratch_buffer(ctx);
-
-    thunkctx.line_number = mpp_sample_frame_line_number(sample, i);
-
-    // Fill in the function ID; the key is the (function_name, file_name) interned string index pair.
-    // This means that two frames are the same function if they have the same name and the same filename.
-    uint64_t func_id_key[2] = {thunkctx.function_name, thunkctx.file_name};
-    st_update(ctx->function_ids, (st_data_t)&func_id_key, function_id_update_func, (st_data_t)&thunkctx);
-
-    // Fill in the function & location protobuf structures.
-    st_update(ctx->function_pbs, thunkctx.function_id, mpp_pprof_serctx_add_function, (st_data_t)&thunkctx);
-    if (thunkctx.is_error) {
-      return -1;
-    }
-    uint64_t loc_key[2] = {thunkctx.function_id, thunkctx.line_number};
-    st_update(ctx->location_pbs, (st_data_t)&loc_key, mpp_pprof_serctx_add_location, (st_data_t)&thunkctx);
-    if (thunkctx.is_error) {
-      return -1;
-    }
-    MPP_ASSERT_MSG(thunkctx.location_id_out, "missing location ID out!");
-    location_ids[i] = thunkctx.location_id_out;
+    struct mpp_frame *frame = mpp_stack_table_get_frame(stacks, stack->frame_ids[i]);
+    location_ids[i] = frame_location(ctx, frame);
   }
 
   // Values are (retained_count, retained_size).
-  perftools_profiles_Sample_add_value(sample_proto, 1, ctx->arena);
-  perftools_profiles_Sample_add_value(sample_proto, (int64_t)sample->allocated_value_objsize, ctx->arena);
+  perftools_profiles_Sample_add_value(sample_proto, (int64_t)retained_objects, ctx->arena);
+  perftools_profiles_Sample_add_value(sample_proto, (int64_t)retained_size, ctx->arena);
+  st_insert(ctx->sample_pbs, stack_id, (st_data_t)sample_proto);
   return 0;
 }
 
-static int write_each_string_table_entry(st_data_t key, st_data_t value, st_data_t arg) {
-  struct str_st_hash_key *string_key = (struct str_st_hash_key *)key;
-  upb_StringView *stringtab_list_proto = (upb_StringView *)arg;
-  int index = value;
-  stringtab_list_proto[index].data = string_key->str;
-  stringtab_list_proto[index].size = string_key->str_len;
-  return ST_CONTINUE;
-}
-
 // Serializes the contained protobuf, and gzips the result. Writes a pointer to the memory in *buf_out,
-// and its length to buflen_out. The returned pointer is freed when mpp_pprof_serctx_destroy() is called,
+// and its length to buflen_out. The returned pointer is freed when mpp_pprof_serctx_finish() is called,
 // and should NOT be individually freed by the caller in any way (and nor is it valid after the call
-// to destroy()).
+// to finish()).
 int mpp_pprof_serctx_serialize(struct mpp_pprof_serctx *ctx, char **buf_out, size_t *buflen_out, char *errbuf,
                                size_t errbuflen) {
   CHECK_IF_INTERRUPTED(return -1);
 
-  // Include the string table in the output
-  upb_StringView *stringtab_list_proto =
-      perftools_profiles_Profile_resize_string_table(ctx->profile_proto, ctx->strings_counter, ctx->arena);
-  st_foreach(ctx->strings, write_each_string_table_entry, (st_data_t)stringtab_list_proto);
+  // Include the string table in the output: just the strings this profile refers to, and not whatever else the
+  // context is still holding on to from earlier flushes.
+  upb_StringView *stringtab_list_proto = perftools_profiles_Profile_resize_string_table(
+      ctx->profile_proto, ctx->profile_strings_count, ctx->arena);
+  for (size_t i = 0; i < ctx->profile_strings_count; i++) {
+    stringtab_list_proto[i].data = ctx->profile_strings[i]->key.str;
+    stringtab_list_proto[i].size = ctx->profile_strings[i]->key.len;
+  }
 
   CHECK_IF_INTERRUPTED(return -1);
 
@@ -1,6 +1,8 @@
 #include "ruby_private.h"
 
 #include "ruby_memprofiler_pprof.h"
+#include <backtracie.h>
+#include <ruby/debug.h>
 
 // An implementation of rb_gc_disable_no_rest(), which is defined non-static in gc.c in >= 2.7
 // but not given public symbol visibility.
@@ -105,6 +107,104 @@ bool mpp_is_someone_else_waiting_for_gvl() {
   return someone_waiting;
 }
 
+void mpp_minimal_location_from_profile_frame(VALUE frame, int line, minimal_location_t *loc) {
+  // rb_profile_frames gives us the method entry for method frames, and the iseq for everything else.
+  if (imemo_type_p(frame, imemo_ment)) {
+    const rb_callable_method_entry_t *cme = (const rb_callable_method_entry_t *)frame;
+    loc->is_ruby_frame = cme->def->type == VM_METHOD_TYPE_ISEQ;
+    loc->method_name_contents = BACKTRACIE_METHOD_NAME_CONTENTS_CME_ID;
+    loc->method_name.cme_method_id = cme->called_id;
+    loc->method_qualifier_contents = BACKTRACIE_METHOD_QUALIFIER_CONTENTS_CME_CLASS;
+    loc->method_qualifier.cme_defined_class = cme->owner;
+  } else {
+    loc->is_ruby_frame = 1;
+    loc->method_name_contents = BACKTRACIE_METHOD_NAME_CONTENTS_BASE_LABEL;
+    loc->method_name.base_label = rb_profile_frame_base_label(frame);
+    loc->method_qualifier_contents = BACKTRACIE_METHOD_QUALIFIER_CONTENTS_SELF_CLASS;
+    loc->method_qualifier.self_class = Qnil;
+  }
+  // These return strings already held by the iseq, so don't allocate. Code that was eval'd has no absolute path.
+  VALUE filename = rb_profile_frame_absolute_path(frame);
+  if (NIL_P(filename)) {
+    filename = rb_profile_frame_path(frame);
+  }
+  loc->filename = filename;
+  loc->line_number = line > 0 ? (uint32_t)line : 0;
+}
+
+// Fills in the words that identify a control frame in a backtrace fingerprint. The iseq & pc pick out the line of code,
+// the method entry (or cref) slot tells apart C functions (which have no iseq) and aliases of the same method, and
+// self's class is what backtracie would qualify the name with.
+static void stack_fingerprint_frame_words(const rb_control_frame_t *cfp, VALUE words[MPP_CONTROL_FRAME_WORDS]) {
+  VALUE self = cfp->self;
+  words[0] = (VALUE)cfp->iseq;
+  words[1] = (VALUE)cfp->pc;
+  words[2] = cfp->ep ? cfp->ep[VM_ENV_DATA_INDEX_ME_CREF] : 0;
+  words[3] = CLASS_OR_MODULE_P(self) ? self : rb_class_of(self);
+}
+
+size_t mpp_control_frames_count(void) {
+  const rb_execution_context_t *ec = GET_EC();
+  const rb_control_frame_t *end_cfp = RUBY_VM_END_CONTROL_FRAME(ec);
+  return ec->cfp < end_cfp ? (size_t)(end_cfp - ec->cfp) : 0;
+}
+
+uint64_t mpp_stack_fingerprint(struct mpp_stack_fingerprint_check *check, struct mpp_control_frame *control_frames) {
+  const rb_execution_context_t *ec = GET_EC();
+  const rb_control_frame_t *end_cfp = RUBY_VM_END_CONTROL_FRAME(ec);
+  size_t count = mpp_control_frames_count();
+  st_index_t fingerprint = 0x811c9dc5;
+  check->depth = 0;
+  check->iseq = ec->cfp < end_cfp ? (VALUE)ec->cfp->iseq : 0;
+  check->pc = ec->cfp < end_cfp ? ec->cfp->pc : NULL;
+  for (const rb_control_frame_t *cfp = ec->cfp; cfp < end_cfp; cfp = RUBY_VM_PREVIOUS_CONTROL_FRAME(cfp)) {
+    VALUE words[MPP_CONTROL_FRAME_WORDS];
+    stack_fingerprint_frame_words(cfp, words);
+    fingerprint = st_hash(words, sizeof(words), fingerprint);
+    if (control_frames) {
+      // The walk goes outwards from the innermost frame, but they're recorded outermost first, so that stacks which
+      // share their outer frames line up from the start.
+      struct mpp_control_frame *control_frame = &control_frames[count - 1 - check->depth];
+      control_frame->cfp = cfp;
+      memcpy(control_frame->words, words, sizeof(words));
+    }
+    check->depth++;
+  }
+  // Zero & one are reserved; see MPP_SAMPLE_LOG_INTERNED & MPP_SAMPLE_LOG_UNFINGERPRINTED.
+  return fingerprint > 1 ? (uint64_t)fingerprint : 2;
+}
+
+size_t mpp_stack_fingerprint_deps(VALUE *deps, size_t deps_capa) {
+  const rb_execution_context_t *ec = GET_EC();
+  const rb_control_frame_t *end_cfp = RUBY_VM_END_CONTROL_FRAME(ec);
+  size_t deps_count = 0;
+  for (const rb_control_frame_t *cfp = ec->cfp; cfp < end_cfp; cfp = RUBY_VM_PREVIOUS_CONTROL_FRAME(cfp)) {
+    VALUE words[MPP_CONTROL_FRAME_WORDS];
+    stack_fingerprint_frame_words(cfp, words);
+    // The pc (words[1]) points into its iseq's bytecode, so keeping the iseq alive takes care of that too.
+    VALUE objs[3] = {words[0], words[2], words[3]};
+    for (int i = 0; i < 3; i++) {
+      if (RB_SPECIAL_CONST_P(objs[i])) {
+        continue;
+      }
+      // Neighbouring frames very often share a class or (when recursing) everything, so skip anything that was
+      // among the last few objects collected.
+      bool seen = false;
+      for (size_t j = deps_count > 3 ? deps_count - 3 : 0; j < deps_count && !seen; j++) {
+        seen = deps[j] == objs[i];
+      }
+      if (seen) {
+        continue;
+      }
+      if (deps_count == deps_capa) {
+        return SIZE_MAX;
+      }
+      deps[deps_count++] = objs[i];
+    }
+  }
+  return deps_count;
+}
+
 // Unfreezes a passed in object so we can force setting something on
 // its internal attributes hash.
 VALUE mpp_rb_ivar_set_ignore_frozen(VALUE obj, ID key, VALUE value) {
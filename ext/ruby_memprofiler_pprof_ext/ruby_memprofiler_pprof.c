@@ -4,7 +4,11 @@
 // This should be the only symbol actually visible to Ruby
 __attribute__((visibility("default"))) void Init_ruby_memprofiler_pprof_ext() {
   rb_ext_ractor_safe(true);
+  mpp_rand_init();
 
   rb_define_module("MemprofilerPprof");
   mpp_setup_collector_class();
+#ifdef MPP_TEST_HOOKS
+  mpp_setup_test_hooks_module();
+#endif
 }
@@ -11,6 +11,7 @@
 
 #include <backtracie.h>
 #include <ruby.h>
+#include <ruby/st.h>
 
 // UPB header files trip up a BUNCH of -Wshorten-64-to-32
 // Also ignore -Wpragmas so that if -Wshorten-64-to-32 isn't present
@@ -44,11 +45,10 @@
 // threadsafe, without thinking about whether some other part of the process needs
 // the global seed to be set to some deterministic value, and without calling into
 // the kernel every time" is... too much to ask for.
-// BSD has arc4random(3) for this, but for glibc we have to use one of the threadsafe
-// RNG's and seed a global instance of it, guarded by a mutex....
-// These methods wrap all that rubbish up.
+// So we have our own little generator, with per-thread state that needs no locking and is
+// re-seeded after fork. mpp_rand_init() must be called once when the extension is loaded.
 uint32_t mpp_rand();
-void mpp_rand_init();
+void mpp_rand_init(void);
 
 // Wrapper to get monotonic time. Pre-sierra MacOS doesn't have clock_gettime, so we need a wrapper for this.
 // (n.b. - I haven't actually _implemented_ a fallback for pre-Sierra, but this is where we'd do it)
@@ -106,9 +106,368 @@ VALUE mpp_rb_obj_memsize_of(VALUE obj);
 bool mpp_is_value_still_validish(VALUE obj);
 // Is some other thread blocked waiting for the GVL?
 bool mpp_is_someone_else_waiting_for_gvl();
+// Fills in *loc (which must be zeroed) from one of the frame VALUEs & line numbers returned by rb_profile_frames,
+// without allocating. Method frames get their owner class as the qualifier, like backtracie would give them, but
+// other frames (blocks, class bodies, etc) don't have one; see mpp_frame_function_name.
+void mpp_minimal_location_from_profile_frame(VALUE frame, int line, minimal_location_t *loc);
+// What a backtrace's fingerprint is checked against, beyond the hash itself.
+struct mpp_stack_fingerprint_check {
+  // Number of control frames.
+  uint32_t depth;
+  // The innermost control frame's iseq & pc.
+  VALUE iseq;
+  const VALUE *pc;
+};
+// Number of words identifying a control frame in a backtrace fingerprint: its iseq, pc, method entry and self's class.
+#define MPP_CONTROL_FRAME_WORDS 4
+// One of the current thread's control frames, as mpp_stack_fingerprint saw it: where it was on the VM stack, and the
+// words it hashed for it.
+struct mpp_control_frame {
+  const void *cfp;
+  VALUE words[MPP_CONTROL_FRAME_WORDS];
+};
+// Number of control frames on the current thread's stack, which is how many mpp_stack_fingerprint walks.
+size_t mpp_control_frames_count(void);
+// Hashes the pointers that identify each of the current thread's control frames (iseq, pc, method entry and self's
+// class) into a fingerprint of its backtrace, without capturing any frames. Two backtraces with the same fingerprint
+// capture the same frames, for as long as the objects hashed into it stay alive and where they are (see
+// mpp_stack_fingerprint_deps). Never returns zero or one, which the sample log uses to mean other things. The hash
+// alone could collide, so *check is filled in with a few things about the backtrace which are compared too before a
+// fingerprint is trusted. If control_frames isn't NULL, it must have room for mpp_control_frames_count() entries, and
+// is filled in with each control frame walked, outermost first. This never allocates.
+uint64_t mpp_stack_fingerprint(struct mpp_stack_fingerprint_check *check, struct mpp_control_frame *control_frames);
+// Writes the heap objects hashed into the current thread's backtrace fingerprint into deps, and returns how many there
+// were; or returns SIZE_MAX if there are more than deps_capa of them. Whilst they're all kept alive & pinned, nothing
+// else can turn up at their addresses and make a different backtrace's fingerprint match. This never allocates.
+size_t mpp_stack_fingerprint_deps(VALUE *deps, size_t deps_capa);
 // Like rb_ivar_set, but ignore frozen status.
 VALUE mpp_rb_ivar_set_ignore_frozen(VALUE obj, ID key, VALUE value);
 
+// ======== SLAB ALLOCATOR DECLARATIONS ========
+
+// A pool of fixed-size objects backed by memory mapped directly from the OS, rather than ruby_xmalloc, so that the
+// profiler's own allocations don't count towards Ruby's malloc_increase and trigger extra GCs; see slab.c. Must only
+// be used whilst holding the GVL.
+struct mpp_slab;
+// If huge_pages is set, larger chunks are mapped aligned to, and advised to be backed by, transparent huge pages.
+struct mpp_slab *mpp_slab_new(size_t object_size, bool huge_pages);
+void mpp_slab_destroy(struct mpp_slab *slab);
+// Total size of all memory mapped by the slab (whether or not it's currently handed out), for accounting purposes.
+size_t mpp_slab_memsize(struct mpp_slab *slab);
+void *mpp_slab_alloc(struct mpp_slab *slab);
+void mpp_slab_free(struct mpp_slab *slab, void *mem);
+
+// ======== VALUE TABLE DECLARATIONS ========
+
+// A hash table of (VALUE) -> (st_data_t), keyed by Ruby heap objects, which never rehashes everything at once; see
+// value_table.c. Keys must not be 0 or Qundef.
+struct mpp_value_table;
+typedef int mpp_value_table_foreach_fn(st_data_t key, st_data_t value, st_data_t arg);
+typedef VALUE mpp_value_table_rekey_fn(VALUE key, st_data_t *value, void *ctx);
+typedef void mpp_value_table_merge_fn(st_data_t *existing_value, st_data_t value, void *ctx);
+// Creates a table with enough room for expected_entries entries before it needs to grow.
+struct mpp_value_table *mpp_value_table_new(size_t expected_entries);
+void mpp_value_table_destroy(struct mpp_value_table *t);
+size_t mpp_value_table_memsize(struct mpp_value_table *t);
+size_t mpp_value_table_count(struct mpp_value_table *t);
+// Whether entries are still being moved out of the old bucket array into a bigger one.
+bool mpp_value_table_is_migrating(struct mpp_value_table *t);
+// Grows the table (if needed) so it has room for expected_entries entries.
+void mpp_value_table_reserve(struct mpp_value_table *t, size_t expected_entries);
+bool mpp_value_table_lookup(struct mpp_value_table *t, VALUE key, st_data_t *value_out);
+// Returns a pointer to the value stored for key, or NULL. It's only valid until the table is next modified.
+st_data_t *mpp_value_table_lookup_ptr(struct mpp_value_table *t, VALUE key);
+// Returns a pointer to the value stored for key, inserting it with a value of zero if it's not already there.
+st_data_t *mpp_value_table_lookup_or_insert(struct mpp_value_table *t, VALUE key, bool *existed);
+// Returns true if the key already existed (and its value was overwritten).
+bool mpp_value_table_insert(struct mpp_value_table *t, VALUE key, st_data_t value);
+// Returns true if the key was present. Deleting never allocates memory (so can never trigger a GC).
+bool mpp_value_table_delete(struct mpp_value_table *t, VALUE key, st_data_t *value_out);
+// Calls fn for each entry; it can return ST_CONTINUE, ST_STOP, or ST_DELETE, but must not otherwise modify the table.
+void mpp_value_table_foreach(struct mpp_value_table *t, mpp_value_table_foreach_fn *fn, st_data_t arg);
+// Copies up to keys_capa of the table's keys into keys_out, returning how many were copied.
+size_t mpp_value_table_keys(struct mpp_value_table *t, VALUE *keys_out, size_t keys_capa);
+// Replaces the key of every entry with whatever fn returns (for following objects moved by GC compaction). If two
+// entries end up with the same key, merge is called to fold the second's value into the first.
+void mpp_value_table_rekey(struct mpp_value_table *t, mpp_value_table_rekey_fn *fn, mpp_value_table_merge_fn *merge,
+                           void *ctx);
+void mpp_value_table_clear(struct mpp_value_table *t);
+
+// ======== HEAP BITMAP DECLARATIONS ========
+
+// A set of heap objects, stored as one bit per heap slot. It's used to tell cheaply whether a freed object might be
+// one we sampled, without having to look it up in the sample map.
+struct mpp_heap_bitmap;
+struct mpp_heap_bitmap *mpp_heap_bitmap_new(void);
+void mpp_heap_bitmap_destroy(struct mpp_heap_bitmap *bm);
+size_t mpp_heap_bitmap_memsize(struct mpp_heap_bitmap *bm);
+// Returns false if obj is definitely not in the set. Returns true if it is, or if obj's address is outside the range
+// the bitmap can represent (in which case the caller needs to look it up some other way).
+bool mpp_heap_bitmap_test(struct mpp_heap_bitmap *bm, VALUE obj);
+void mpp_heap_bitmap_set(struct mpp_heap_bitmap *bm, VALUE obj);
+void mpp_heap_bitmap_clear(struct mpp_heap_bitmap *bm, VALUE obj);
+void mpp_heap_bitmap_clear_all(struct mpp_heap_bitmap *bm);
+
+// ======== STRING TABLE DECLARATIONS ========
+
+// A set of strings, looked up by their contents; see string_table.c. The table doesn't own its entries, which are
+// usually the start of some bigger struct, and which must stay put (along with the contents they point to) for as
+// long as they're in it.
+struct mpp_string_table_entry {
+  const char *str;
+  size_t len;
+  // From mpp_string_hash.
+  uint64_t hash;
+};
+struct mpp_string_table;
+// Hashes a string's contents for the string table. Never returns zero or one.
+uint64_t mpp_string_hash(const char *str, size_t len);
+struct mpp_string_table *mpp_string_table_new(void);
+void mpp_string_table_destroy(struct mpp_string_table *t);
+size_t mpp_string_table_memsize(struct mpp_string_table *t);
+size_t mpp_string_table_count(struct mpp_string_table *t);
+// Number of buckets, and how many of them are tombstones left by deleted entries.
+size_t mpp_string_table_capa(struct mpp_string_table *t);
+size_t mpp_string_table_tombstones(struct mpp_string_table *t);
+// Returns the entry with these contents (whose hash is given), or NULL. This never allocates memory.
+struct mpp_string_table_entry *mpp_string_table_lookup(struct mpp_string_table *t, uint64_t hash, const char *str,
+                                                       size_t len);
+// Adds an entry, whose contents mustn't already be in the table.
+void mpp_string_table_add(struct mpp_string_table *t, struct mpp_string_table_entry *entry);
+void mpp_string_table_delete(struct mpp_string_table *t, struct mpp_string_table_entry *entry);
+// Calls fn for each entry; it mustn't modify the table.
+void mpp_string_table_foreach(struct mpp_string_table *t, void (*fn)(struct mpp_string_table_entry *entry, void *arg),
+                              void *arg);
+
+// ======== STACK TABLE DECLARATIONS ========
+
+// A single backtrace frame captured by backtracie. The same frames show up in very many different stacks (every
+// stack shares the frames near the bottom, for a start), so frames are interned in a struct mpp_stack_table and
+// stacks refer to them by ID.
+struct mpp_frame {
+  // Number of references to this frame from stacks (a stack which contains it twice counts twice); it's freed when
+  // this drops to zero.
+  size_t refcount;
+  // Hash of the location, cached for the frame table index.
+  st_index_t hash;
+  uint32_t id;
+  minimal_location_t location;
+};
+
+// Frames we make up ourselves, rather than capture from the Ruby stack, are told apart from captured ones by a kind
+// stored in the reserved bits of their minimal_location_t (which backtracie leaves zeroed). They don't refer to any
+// VALUEs, and have no filename.
+#define MPP_FRAME_KIND_CAPTURED 0
+// Stands in for the outermost frames of a backtrace deeper than the collector's max_stack_depth. Its line number is
+// how many control frames were left out, which might include a few internal ones that backtraces never show (or, if
+// frames are being elided, how many of the frames left after that were).
+#define MPP_FRAME_KIND_TRUNCATED 1
+// Follows a single copy of a run of frames which was repeated back-to-back (i.e. recursion), standing in for the
+// other copies. Its line number is how many more times the run was repeated, and its method name field holds how
+// many frames long the run is.
+#define MPP_FRAME_KIND_REPEATED 2
+// Makes *loc (which must be zeroed) a marker for frames_count frames cut off the end of a backtrace.
+void mpp_location_init_truncated(minimal_location_t *loc, size_t frames_count);
+// Makes *loc (which must be zeroed) a marker for repeats more copies of the run_length frames before it.
+void mpp_location_init_repeated(minimal_location_t *loc, size_t run_length, size_t repeats);
+static inline bool mpp_location_is_synthetic(const minimal_location_t *loc) {
+  return loc->reserved_bits != MPP_FRAME_KIND_CAPTURED;
+}
+
+// A backtrace, as a list of frame IDs. Very many samples will have exactly the same backtrace (the same few hot
+// allocation sites get hit over and over), so stacks are interned in a struct mpp_stack_table and shared between
+// samples, which refer to them by ID.
+struct mpp_stack {
+  // Number of samples referring to this stack; it's freed when this drops to zero.
+  size_t refcount;
+  // Number of samples in the collector's sample map with this stack, and the total size of their objects as of
+  // when each was last measured; kept up to date by the collector, so flushing can just read them.
+  size_t live_objects;
+  size_t live_bytes;
+  // Hash of the frame IDs, cached for the stack table index.
+  st_index_t hash;
+  uint32_t id;
+  uint32_t frames_count;
+  // Frames are in most-recent-call-first order.
+  uint32_t frame_ids[];
+};
+
+// An array of pointers indexed by ID, which hands out IDs for new entries and recycles the IDs of removed ones.
+struct mpp_id_slots {
+  // ID -> entry. Slots for IDs not currently in use are NULL.
+  void **items;
+  size_t capa;
+  // IDs below this have been handed out at some point.
+  uint32_t next_id;
+  // IDs that were freed and can be re-used.
+  uint32_t *free_ids;
+  size_t free_ids_count;
+  size_t free_ids_capa;
+  // Number of IDs currently in use.
+  size_t count;
+};
+void mpp_id_slots_init(struct mpp_id_slots *slots);
+// Frees the slot arrays themselves; the caller is responsible for freeing the items in them.
+void mpp_id_slots_destroy(struct mpp_id_slots *slots);
+size_t mpp_id_slots_memsize(struct mpp_id_slots *slots);
+// Stores item in a free slot, and returns its ID.
+uint32_t mpp_id_slots_add(struct mpp_id_slots *slots, void *item);
+// Frees up the slot with the given ID for re-use. This never allocates memory.
+void mpp_id_slots_remove(struct mpp_id_slots *slots, uint32_t id);
+
+// Stacks are allocated from a slab per size class; class N holds stacks of up to
+// (MPP_STACK_TABLE_SLAB_MIN_FRAMES << N) frames. Deeper stacks than the largest class are allocated individually.
+#define MPP_STACK_TABLE_SLAB_CLASSES 8
+#define MPP_STACK_TABLE_SLAB_MIN_FRAMES 8
+// The mark table isn't rebuilt automatically until at least this many frames have been freed since it last was.
+#define MPP_STACK_TABLE_MIN_DEAD_FRAMES_FOR_REBUILD 1024
+// Number of slots in the (direct-mapped) cache of backtrace fingerprint -> stack ID.
+#define MPP_STACK_TABLE_FINGERPRINTS 2048
+
+// A slot in the stack table's fingerprint cache. It holds a reference to its stack, and keeps the objects hashed into
+// its fingerprint alive.
+struct mpp_stack_fingerprint {
+  // Zero if the slot is empty.
+  uint64_t fingerprint;
+  // The stack table's fingerprints_generation when the backtrace was captured; the slot is ignored if that's changed.
+  uint64_t generation;
+  // Compared along with the fingerprint, so that a hash collision between two backtraces is (nearly always) caught.
+  struct mpp_stack_fingerprint_check check;
+  uint32_t stack_id;
+  // The objects from mpp_stack_fingerprint_deps, each of which has a reference in the table's fingerprint_deps.
+  uint32_t deps_count;
+  VALUE *deps;
+};
+
+struct mpp_stack_table {
+  // Stack ID -> (struct mpp_stack *).
+  struct mpp_id_slots stacks;
+  // Map of stack contents -> stack ID, used to find an existing copy of a newly captured stack.
+  st_table *stacks_index;
+  // Frame ID -> (struct mpp_frame *).
+  struct mpp_id_slots frames;
+  // Map of frame contents -> frame ID.
+  st_table *frames_index;
+  // Set of VALUEs (the table's values are unused) which is used to make sure we only mark the parts of our frames
+  // once, since many of the frames will hold references to the same iseq's, filenames, etc. It's a superset of the
+  // VALUEs the live frames need: it's added to when frames are created, but only pruned when it's rebuilt.
+  struct mpp_value_table *mark_table;
+  // Number of frames freed since mark_table was last rebuilt.
+  size_t mark_table_dead_frames;
+  // Map of thread VALUE -> ID of the stack most recently interned for that thread (which it holds a reference to).
+  // Consecutive backtraces from one thread nearly always share most of their outermost frames, so when interning, a
+  // new backtrace is compared against this one first, and only the frames that differ need looking up in
+  // frames_index. (The backtrace has still been captured in full by then; this only saves lookups.) The thread VALUEs
+  // are neither marked nor updated by compaction, since they're only ever compared, never dereferenced: a thread that
+  // is freed or moved just leaves an entry behind that nothing will find, and one that lands on its old address just
+  // gets compared against a stack that shares fewer frames. Either way, every entry is dropped at each flush and
+  // compaction, which is what stops them piling up.
+  struct mpp_value_table *thread_last_stacks;
+  // Cache of backtrace fingerprint (from mpp_stack_fingerprint) -> stack, so that a backtrace we've seen before can
+  // be found without capturing its frames at all.
+  struct mpp_stack_fingerprint *fingerprints;
+  // Bumped whenever the frames captured for a backtrace would change (e.g. the capture backend is switched); every
+  // fingerprint taken before that is then ignored.
+  uint64_t fingerprints_generation;
+  // Map of VALUE -> number of fingerprint slots depending on it. Unlike the mark table's VALUEs, these are marked as
+  // pinned: whilst a slot is in use, the objects its fingerprint was hashed from can't be freed or moved, so no other
+  // backtrace can come to hash the same.
+  struct mpp_value_table *fingerprint_deps;
+  // Buffer which new backtraces get captured into, before being interned.
+  minimal_location_t *scratch_frames;
+  size_t scratch_frames_capa;
+  // Stack of frame IDs built up from scratch_frames, with room for scratch_frames_capa frames.
+  struct mpp_stack *scratch_stack;
+  struct mpp_slab *frame_slab;
+  struct mpp_slab *stack_slabs[MPP_STACK_TABLE_SLAB_CLASSES];
+};
+
+struct mpp_stack_table *mpp_stack_table_new(bool huge_pages);
+void mpp_stack_table_destroy(struct mpp_stack_table *stacks);
+// Total size of all memory owned by the stack table, for accounting purposes.
+size_t mpp_stack_table_memsize(struct mpp_stack_table *stacks);
+// Returns the scratch frame buffer, zeroed out and with room for at least frames_capa frames. Fill it in, and then
+// call mpp_stack_table_intern_scratch.
+minimal_location_t *mpp_stack_table_scratch(struct mpp_stack_table *stacks, size_t frames_capa);
+// Finds (or creates) the stack made of the first frames_count frames of the scratch buffer, takes a reference to it,
+// and returns its ID. thread is the thread the backtrace was captured on (or Qnil, if that's not known); it's only
+// used to find a previous stack to share frames with, so it doesn't matter if it's since died or moved.
+uint32_t mpp_stack_table_intern_scratch(struct mpp_stack_table *stacks, VALUE thread, size_t frames_count);
+// Like mpp_stack_table_intern_scratch, but for frames held somewhere else (which must have been zeroed before they
+// were filled in, for the same reason).
+uint32_t mpp_stack_table_intern(struct mpp_stack_table *stacks, VALUE thread, minimal_location_t *frames,
+                                size_t frames_count);
+// Drops the references to each thread's most recently interned stack (see thread_last_stacks).
+void mpp_stack_table_forget_threads(struct mpp_stack_table *stacks);
+// If a stack was remembered for this fingerprint & check (since the fingerprints were last invalidated), takes a
+// reference to it and returns true. This never allocates memory.
+bool mpp_stack_table_lookup_fingerprint(struct mpp_stack_table *stacks, uint64_t fingerprint,
+                                        const struct mpp_stack_fingerprint_check *check, uint32_t *stack_id);
+// Remembers that the backtrace with this fingerprint & check, which depends on the deps_count objects in deps (from
+// mpp_stack_fingerprint_deps), was interned as stack_id. generation is the value of fingerprints_generation when the
+// fingerprint was taken; if they've since been invalidated, this does nothing.
+void mpp_stack_table_remember_fingerprint(struct mpp_stack_table *stacks, uint64_t fingerprint,
+                                          const struct mpp_stack_fingerprint_check *check, const VALUE *deps,
+                                          size_t deps_count, uint64_t generation, uint32_t stack_id);
+// Makes every fingerprint taken so far miss. This never allocates memory.
+void mpp_stack_table_invalidate_fingerprints(struct mpp_stack_table *stacks);
+// Empties the fingerprint cache, dropping its references to stacks and letting go of the objects it was pinning.
+void mpp_stack_table_forget_fingerprints(struct mpp_stack_table *stacks);
+// Drops a reference to the given stack, freeing it (and any frames only it was using) if that was the last one.
+// This never allocates memory (so can never trigger a GC).
+void mpp_stack_table_release(struct mpp_stack_table *stacks, uint32_t stack_id);
+static inline struct mpp_stack *mpp_stack_table_get(struct mpp_stack_table *stacks, uint32_t stack_id) {
+  return (struct mpp_stack *)stacks->stacks.items[stack_id];
+}
+static inline struct mpp_frame *mpp_stack_table_get_frame(struct mpp_stack_table *stacks, uint32_t frame_id) {
+  return (struct mpp_frame *)stacks->frames.items[frame_id];
+}
+// Calls fn on each stack in the table, in ID order, until it returns ST_STOP. fn mustn't intern or release stacks.
+void mpp_stack_table_foreach(struct mpp_stack_table *stacks, int (*fn)(struct mpp_stack *stack, st_data_t ctxarg),
+                             st_data_t ctxarg);
+// GC-marks every VALUE referenced by a live frame.
+void mpp_stack_table_mark(struct mpp_stack_table *stacks);
+size_t mpp_stack_table_mark_table_size(struct mpp_stack_table *stacks);
+// Throws away VALUEs in the mark table that no live frame refers to any more. This never allocates memory.
+void mpp_stack_table_rebuild_mark_table(struct mpp_stack_table *stacks);
+// Checks that every VALUE referred to by a live frame is in the mark table (for tests).
+bool mpp_stack_table_mark_table_is_complete(struct mpp_stack_table *stacks);
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+// Updates the VALUEs referenced by frames after GC compaction.
+void mpp_stack_table_compact(struct mpp_stack_table *stacks);
+#endif
+// GC-marks (and pins) every VALUE referenced by a captured location.
+void mpp_location_mark(minimal_location_t *loc);
+// Fill in a provided buffer with the name of a frame.
+size_t mpp_frame_function_name(struct mpp_frame *frame, char *outbuf, size_t outbuf_len);
+// Get the String VALUE holding the plain label of a frame (the iseq's base label, or the name of the method), without
+// building the qualified name mpp_frame_function_name would. Might not be a String, if there's no such name.
+VALUE mpp_frame_label_value(struct mpp_frame *frame);
+// Fill in a provided buffer with the filename of a frame
+size_t mpp_frame_file_name(struct mpp_frame *frame, char *outbuf, size_t outbuf_len);
+// Get the String VALUE holding the filename of a frame (or Qnil if it doesn't have one), without copying it.
+VALUE mpp_frame_file_name_value(struct mpp_frame *frame);
+// Get the line number of a frame.
+int mpp_frame_line_number(struct mpp_frame *frame);
+
+// ======== FRAME ELIDER DECLARATIONS ========
+
+// A compiled set of rules for frames to leave out of captured backtraces: those whose filename starts with one of a
+// list of prefixes, or whose method label starts with one of another. Whether each filename & label matches is
+// cached against the identity of the String holding it, so checking a frame doesn't compare any strings; see
+// frame_elider.c.
+struct mpp_frame_elider;
+// Both arguments must be Arrays of Strings; the prefixes are copied out of them.
+struct mpp_frame_elider *mpp_frame_elider_new(VALUE file_prefixes, VALUE method_prefixes);
+void mpp_frame_elider_destroy(struct mpp_frame_elider *elider);
+size_t mpp_frame_elider_memsize(struct mpp_frame_elider *elider);
+// GC-marks (and pins) the Strings the elider has cached answers for.
+void mpp_frame_elider_mark(struct mpp_frame_elider *elider);
+// Empties the caches of Strings, so they don't keep filenames & labels from code that's since gone alive forever.
+void mpp_frame_elider_forget(struct mpp_frame_elider *elider);
+// Removes the frames matching the rules from frames, in place, and returns how many are left.
+size_t mpp_frame_elider_filter(struct mpp_frame_elider *elider, minimal_location_t *frames, size_t frames_count);
+
 // ======== SAMPLE DECLARATIONS ========
 
 // The struct mpp_sample is the core type for the data collected by ruby_memprofiler_pprof.
@@ -117,51 +476,229 @@ struct mpp_sample {
   // VALUE of the sampled object that was allocated, or Qundef it it's freed.
   VALUE allocated_value_weak;
   size_t allocated_value_objsize;
-  size_t frames_count;
-  size_t frames_capacity;
+  // ID of the backtrace in the stack table.
+  uint32_t stack_id;
   unsigned int flush_epoch;
-  minimal_location_t frames[];
+};
+// There's one of these for every live sample, so it's kept to three words (24 bytes on 64-bit platforms); whether an
+// insert got cancelled is tracked on its struct mpp_sample_log_entry, which only lives until the log is drained.
+#if SIZEOF_VOIDP == 8
+_Static_assert(sizeof(struct mpp_sample) == 24, "struct mpp_sample should be 24 bytes");
+#endif
+
+// The ways we know how to capture the current thread's backtrace.
+enum mpp_capture_backend {
+  // Asks backtracie for each frame in turn.
+  MPP_CAPTURE_BACKEND_BACKTRACIE,
+  // Collects all the frames in one walk of the control frame stack with rb_profile_frames. Frames for blocks (etc)
+  // don't record which class they're in, and before Ruby 3.0 C function frames are skipped.
+  MPP_CAPTURE_BACKEND_PROFILE_FRAMES,
+  // Only captures the innermost Ruby frame (i.e. the file & line ObjectSpace's allocation_sourcefile &
+  // allocation_sourceline would report), with rb_profile_frames; the rest of the stack is only walked if none of the
+  // innermost few frames will do.
+  MPP_CAPTURE_BACKEND_ALLOCATION_SITE,
+};
+
+// The longest run of frames that fold_recursion looks for repeats of.
+#define MPP_FOLD_RECURSION_MAX_RUN_LENGTH 8
+
+// Everything that affects which frames get captured for a backtrace.
+struct mpp_capture_opts {
+  enum mpp_capture_backend backend;
+  // If this isn't zero, only the innermost max_depth frames are kept, followed by a truncation marker frame if there
+  // were any more.
+  size_t max_depth;
+  // Whether runs of (up to MPP_FOLD_RECURSION_MAX_RUN_LENGTH) frames repeated back-to-back are folded into a single
+  // copy, followed by a marker frame counting the rest.
+  bool fold_recursion;
+  // If this isn't NULL, frames matching its rules are dropped from backtraces (before max_depth is applied).
+  struct mpp_frame_elider *elider;
+  // Where the rb_profile_frames backends have rb_profile_frames write a backtrace, before it's converted. It doesn't
+  // change which frames get captured, but everything that captures them is given these opts.
+  struct mpp_profile_frames_buffer *profile_frames;
+  // What the backtracie backend remembers of each thread's last backtrace, so it only has to capture the frames that
+  // have changed since. Like profile_frames, it doesn't change which frames get captured.
+  struct mpp_capture_cache *capture_cache;
 };
 
-// Captures a backtrace for a sample using Backtracie. The resulting sample contains VALUES inside
-// the raw_location struct whcih need to be marked.
-struct mpp_sample *mpp_sample_capture(VALUE allocated_value_weak);
-// Total size of all things owned by the sample, for accounting purposes
-size_t mpp_sample_memsize(struct mpp_sample *sample);
+// Buffer for rb_profile_frames to write a whole backtrace into in one call. It can't be read a batch at a time: some
+// Rubies (3.0 included) ignore rb_profile_frames' start argument, and return the innermost frames again every time.
+// The buffer is grown as deeper backtraces turn up, and kept for the next one.
+struct mpp_profile_frames_buffer {
+  VALUE *frames;
+  int *lines;
+  size_t capa;
+};
+
+struct mpp_profile_frames_buffer *mpp_profile_frames_buffer_new(void);
+void mpp_profile_frames_buffer_destroy(struct mpp_profile_frames_buffer *buf);
+size_t mpp_profile_frames_buffer_memsize(struct mpp_profile_frames_buffer *buf);
+
+// Most backtraces share nearly all of their (outer) frames with the last one captured on the same thread, so for each
+// thread, this keeps the control frames its last backtrace was captured from, along with the frames captured from
+// them. The next backtrace captured on the thread is compared against them, and backtracie is only asked for the
+// frames above the outermost control frame that's changed; the frames below it are copied from the last backtrace.
+struct mpp_capture_cache {
+  // The control frames of the backtrace about to be captured, as walked by mpp_sample_fingerprint (outermost first).
+  // current_count is zero if there's no such backtrace, i.e. if they've already been used.
+  struct mpp_control_frame *current;
+  size_t current_count;
+  size_t current_capa;
+  // Map of thread VALUE -> struct mpp_thread_capture *, for the last backtrace captured on each thread.
+  struct mpp_value_table *threads;
+  // Number of frames the capture backends have been asked for (which, for backtracie, excludes the ones copied from
+  // the thread's last backtrace), since this was last reset.
+  size_t frames_captured;
+};
+
+struct mpp_capture_cache *mpp_capture_cache_new(void);
+void mpp_capture_cache_destroy(struct mpp_capture_cache *cache);
+size_t mpp_capture_cache_memsize(struct mpp_capture_cache *cache);
+// GC-marks (and pins) the objects in each thread's last control frames and frames. Whilst they're alive and where they
+// are, nothing else can turn up at their addresses and make a different control frame look unchanged.
+void mpp_capture_cache_mark(struct mpp_capture_cache *cache);
+// Forgets every thread's last backtrace, letting go of the objects it was keeping alive. This never allocates memory.
+void mpp_capture_cache_forget_threads(struct mpp_capture_cache *cache);
+
+// Captures the current thread's backtrace and interns it into the stack table, returning its stack ID with a reference
+// held on it (which must be released with mpp_stack_table_release).
+uint32_t mpp_sample_capture_stack(struct mpp_stack_table *stacks, const struct mpp_capture_opts *opts);
+// Allocates a sample (from sample_slab) for a backtrace that's already in the stack table; the sample takes over the
+// caller's reference to stack_id, which must be released with mpp_stack_table_release when the sample is freed.
+struct mpp_sample *mpp_sample_new(struct mpp_slab *sample_slab, VALUE allocated_value_weak, uint32_t stack_id);
+// Fingerprints the current thread's backtrace (see mpp_stack_fingerprint). The control frames walked to do so are
+// remembered in opts->capture_cache, and the next call to mpp_sample_capture_frames uses them to work out which frames
+// have changed since the thread's last backtrace, so the stack mustn't change in between.
+uint64_t mpp_sample_fingerprint(const struct mpp_capture_opts *opts, struct mpp_stack_fingerprint_check *check);
+// Number of frames mpp_sample_capture_frames needs room for to capture the current thread's backtrace.
+size_t mpp_sample_frames_capa(const struct mpp_capture_opts *opts);
+// Captures the current thread's backtrace into frames (which must be zeroed, with room for the frames_capa frames that
+// mpp_sample_frames_capa asked for), and returns how many frames were captured.
+size_t mpp_sample_capture_frames(const struct mpp_capture_opts *opts, minimal_location_t *frames, size_t frames_capa);
 // free the sample
-void mpp_sample_free(struct mpp_sample *sample);
-// Fill in a provided buffer with the name of a frame.
-size_t mpp_sample_frame_function_name(struct mpp_sample *sample, int frame_index, char *outbuf, size_t outbuf_len);
-// Fill in a provided buffer with the filename of a frame
-size_t mpp_sample_frame_file_name(struct mpp_sample *sample, int frame_index, char *outbuf, size_t outbuf_len);
-// Get the line number of a frame.
-int mpp_sample_frame_line_number(struct mpp_sample *sample, int frame_index);
+void mpp_sample_free(struct mpp_slab *sample_slab, struct mpp_sample *sample);
+
+// ======== SAMPLE LOG DECLARATIONS ========
+
+// A log of sampled allocations (with their not-yet-interned backtraces) and frees of sampled objects, recorded by the
+// tracepoint hooks and applied to the sample map later, in a batch; see sample_log.c. The hooks can't grow it, so it
+// starts out with room for MPP_SAMPLE_LOG_ENTRIES entries, and is grown when it's drained if that wasn't enough.
+#define MPP_SAMPLE_LOG_ENTRIES 1024
+#define MPP_SAMPLE_LOG_FRAMES 8192
+#define MPP_SAMPLE_LOG_FINGERPRINT_DEPS 8192
+// The fingerprint of log entries whose backtraces are already in the stack table.
+#define MPP_SAMPLE_LOG_INTERNED 0
+// The fingerprint of log entries whose backtraces weren't fingerprinted at all.
+#define MPP_SAMPLE_LOG_UNFINGERPRINTED 1
+
+struct mpp_sample_log_entry {
+  // The object that was allocated (for an insert) or freed (for a remove).
+  VALUE obj;
+  bool is_insert;
+  // For inserts, the thread that made the allocation.
+  VALUE thread;
+  // For inserts, where the backtrace lives in the log's frames buffer.
+  uint32_t frames_start;
+  uint32_t frames_count;
+  // For inserts, the backtrace's fingerprint & the stack table's fingerprints_generation when it was taken; or, if
+  // the fingerprint already matched a stack, MPP_SAMPLE_LOG_INTERNED and the stack ID (holding a reference to it).
+  uint64_t fingerprint;
+  uint64_t fingerprint_generation;
+  struct mpp_stack_fingerprint_check fingerprint_check;
+  // For fingerprinted inserts, where the objects the fingerprint depends on live in the log's deps buffer.
+  uint32_t deps_start;
+  uint32_t deps_count;
+  uint32_t stack_id;
+  unsigned int flush_epoch;
+  // Set on an insert whose object was freed whilst the log was full; draining skips it.
+  bool cancelled;
+};
+
+struct mpp_sample_log {
+  // Entries, in the order the hooks recorded them.
+  struct mpp_sample_log_entry *entries;
+  size_t entries_count;
+  size_t entries_capa;
+  minimal_location_t *frames;
+  size_t frames_count;
+  VALUE *deps;
+  size_t deps_count;
+};
+
+struct mpp_sample_log *mpp_sample_log_new(size_t entries_capa);
+void mpp_sample_log_destroy(struct mpp_sample_log *log);
+size_t mpp_sample_log_memsize(struct mpp_sample_log *log);
+// Returns a zeroed buffer with room for frames_capa frames to capture a backtrace into, followed by a call to
+// mpp_sample_log_push_insert. Returns NULL if the log is full.
+minimal_location_t *mpp_sample_log_reserve_frames(struct mpp_sample_log *log, size_t frames_capa);
+// Records an insert, whose first frames_count frames were captured into the buffer from mpp_sample_log_reserve_frames.
+// fingerprint, fingerprint_check & fingerprint_generation are remembered against the stack it gets interned as, along
+// with the objects the fingerprint depends on, which this collects from the current thread's stack (or, if there's no
+// room left for them, the insert is recorded as MPP_SAMPLE_LOG_UNFINGERPRINTED instead). fingerprint_check is ignored
+// if fingerprint is MPP_SAMPLE_LOG_UNFINGERPRINTED.
+void mpp_sample_log_push_insert(struct mpp_sample_log *log, VALUE obj, VALUE thread, size_t frames_count,
+                                uint64_t fingerprint, const struct mpp_stack_fingerprint_check *fingerprint_check,
+                                uint64_t fingerprint_generation, unsigned int flush_epoch);
+// Records an insert whose backtrace was already interned as stack_id; the log takes over the caller's reference to
+// it. Returns false if the log is full.
+bool mpp_sample_log_push_interned_insert(struct mpp_sample_log *log, VALUE obj, uint32_t stack_id,
+                                         unsigned int flush_epoch);
+// Records a remove. Returns false if the log is full.
+bool mpp_sample_log_push_remove(struct mpp_sample_log *log, VALUE obj);
+// Cancels the most recent insert of obj still in the log, if there is one, and returns whether there was.
+bool mpp_sample_log_cancel_insert(struct mpp_sample_log *log, VALUE obj);
+// Whether the log has filled up enough that it ought to be drained soon.
+bool mpp_sample_log_wants_drain(struct mpp_sample_log *log);
+void mpp_sample_log_clear(struct mpp_sample_log *log);
+// Makes room for at least entries_capa entries. The log must be empty, and this mustn't be called from a hook, since
+// it allocates memory.
+void mpp_sample_log_grow(struct mpp_sample_log *log, size_t entries_capa);
+// GC-marks the VALUEs in the backtraces of pending inserts, and the objects their fingerprints depend on.
+void mpp_sample_log_mark(struct mpp_sample_log *log);
 
 // ======== PROTO SERIALIZATION ROUTINES ========
 struct mpp_pprof_serctx {
-  // Defines the allocation routine & memory arena used by this serialisation context. When the ctx
-  // is destroyed, we free the entire arena, so no other (protobuf) memory needs to be individually
-  // freed.
+  // Defines the allocation routine & memory arena used for the profile being built by the current flush. When the
+  // flush finishes, we free the entire arena, so no other (protobuf) memory needs to be individually freed.
   upb_alloc allocator;
   upb_Arena *arena;
-  // Map of function ID -> function protobuf
-  st_table *function_pbs;
-  // Map of (function ID, line number) -> location protobufs
-  st_table *location_pbs;
-  // Map of (function name string ID, file name string ID) -> function ID
-  st_table *function_ids;
-  // Counter for assigning location IDs
-  uint64_t loc_counter;
-  // Counter for assigning function IDs
-  uint64_t function_id_counter;
-  // Map of (string, len) -> string table index
-  st_table *strings;
-  // Counter for assigning string table indexes.
-  int strings_counter;
   // The protobuf representation we are building up.
   perftools_profiles_Profile *profile_proto;
+  // Map of stack ID -> sample protobuf. Every object with the same stack is counted in the one sample, rather than
+  // repeating the stack's location IDs for each of them.
+  st_table *sample_pbs;
 
-  // A buffer which, if non-NULL, points into the upb arena and can be stolen for interning strings.
+  // Everything from here on is kept from one flush to the next, so that strings, functions & locations keep the same
+  // IDs, and only need working out the first time they're seen. Each entry remembers the last flush (generation) to
+  // use it, and when a flush finishes, whatever it didn't use is pruned. (Strings' IDs aren't what go in the profile,
+  // though; see profile_strings.)
+  unsigned int generation;
+  // Function ID -> function, and (function name string ID, file name string ID) -> function ID.
+  struct mpp_pprof_records *functions;
+  st_table *functions_index;
+  // Location ID -> location, and frame location (line number included) -> location ID; see pprof_out.c.
+  struct mpp_pprof_records *locations;
+  struct mpp_pprof_location_index *location_index;
+  // Map of frame location (without its line number) -> function, so that each method only has its name rendered
+  // once, rather than once for every line of it that turns up in a new frame location.
+  st_table *function_cache;
+  // Map of (string, len) -> struct mpp_pprof_string; see pprof_out.c.
+  struct mpp_string_table *strings;
+  // String ID -> struct mpp_pprof_string. The IDs of pruned strings get re-used.
+  struct mpp_id_slots string_slots;
+  // Map of Ruby String VALUE -> string ID (and the last flush to look it up). The entries in strings for
+  // these point straight at the Ruby strings' contents rather than at a copy, so the strings must be kept alive & in
+  // place (with mpp_pprof_serctx_mark) until they're pruned.
+  struct mpp_value_table *string_values;
+  // The current profile's string table: the strings it uses, in the order it first used them. Protobuf fields get
+  // indexes into this, rather than strings' IDs, so that a profile doesn't carry every string from earlier flushes.
+  struct mpp_pprof_string **profile_strings;
+  size_t profile_strings_count;
+  size_t profile_strings_capa;
+  // Whether to name functions with backtracie's qualified names (Foo::Bar#baz), or just their plain labels (baz).
+  bool pretty_backtraces;
+
+  // A buffer that function names are rendered into before they're interned.
   char *scratch_buffer;
   size_t scratch_buffer_strlen;
   size_t scratch_buffer_capa;
@@ -170,14 +707,31 @@ struct mpp_pprof_serctx {
   uint8_t interrupt;
 };
 
-struct mpp_pprof_serctx *mpp_pprof_serctx_new(char *errbuf, size_t errbuflen);
+struct mpp_pprof_serctx *mpp_pprof_serctx_new(bool pretty_backtraces, char *errbuf, size_t errbuflen);
 void mpp_pprof_serctx_destroy(struct mpp_pprof_serctx *ctx);
-int mpp_pprof_serctx_add_sample(struct mpp_pprof_serctx *ctx, struct mpp_sample *sample, char *errbuf,
-                                size_t errbuflen);
+size_t mpp_pprof_serctx_memsize(struct mpp_pprof_serctx *ctx);
+// GC-marks (and pins) the Ruby strings the ctx's string table points into, and the VALUEs in its function cache.
+void mpp_pprof_serctx_mark(struct mpp_pprof_serctx *ctx);
+// Starts building a new profile.
+void mpp_pprof_serctx_begin(struct mpp_pprof_serctx *ctx);
+// Throws away the profile built since mpp_pprof_serctx_begin (including the buffer returned by
+// mpp_pprof_serctx_serialize), and prunes the strings, functions and locations it didn't use.
+void mpp_pprof_serctx_finish(struct mpp_pprof_serctx *ctx);
+// Adds retained_objects objects, totalling retained_size bytes, with the given stack to the profile. Objects with the
+// same stack are all counted in one sample, however many calls they're added in.
+int mpp_pprof_serctx_add_sample(struct mpp_pprof_serctx *ctx, struct mpp_stack_table *stacks, uint32_t stack_id,
+                                size_t retained_objects, size_t retained_size, char *errbuf, size_t errbuflen);
 int mpp_pprof_serctx_serialize(struct mpp_pprof_serctx *ctx, char **buf_out, size_t *buflen_out, char *errbuf,
                                size_t errbuflen);
 
 // ======== COLLECTOR RUBY CLASS ========
 void mpp_setup_collector_class();
 
+// ======== TEST HOOKS ========
+// Defines MemprofilerPprof::TestHooks, which exposes internal data structures to the test suite. Only built into the
+// extension when it's configured with --enable-test-hooks.
+#ifdef MPP_TEST_HOOKS
+void mpp_setup_test_hooks_module(void);
+#endif
+
 #endif
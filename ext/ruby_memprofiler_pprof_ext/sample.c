@@ -1,43 +1,462 @@
 #include "ruby_memprofiler_pprof.h"
 #include <backtracie.h>
 #include <ruby.h>
+#include <ruby/debug.h>
+#include <string.h>
 
-// Total size of all things owned by the sample, for accounting purposes
-size_t mpp_sample_memsize(struct mpp_sample *sample) {
-  return sizeof(struct mpp_sample) + sample->frames_capacity * sizeof(minimal_location_t);
+// The allocation site is nearly always within the innermost few frames, so those are looked at first, from a buffer
+// on the stack, before resorting to the whole backtrace.
+#define ALLOCATION_SITE_BATCH 8
+
+// Free the sample. The caller is responsible for releasing its stack.
+void mpp_sample_free(struct mpp_slab *sample_slab, struct mpp_sample *sample) { mpp_slab_free(sample_slab, sample); }
+
+// Number of control frames on the current thread's stack; every backend captures at most one frame per control frame.
+static size_t sample_stack_depth(void) { return (size_t)backtracie_frame_count_for_thread(rb_thread_current()); }
+
+size_t mpp_sample_frames_capa(const struct mpp_capture_opts *opts) {
+  if (opts->backend == MPP_CAPTURE_BACKEND_ALLOCATION_SITE) {
+    return 1;
+  }
+  size_t depth = sample_stack_depth();
+  // One frame more than the limit, so we can tell whether anything got cut off; see mpp_sample_capture_frames. If
+  // frames are being elided, we can't know how many frames are needed to end up with max_depth of them, so
+  // everything has to be captured.
+  if (opts->max_depth && !opts->elider && depth > opts->max_depth) {
+    return opts->max_depth + 1;
+  }
+  return depth;
 }
 
-// Free the sample, incl. releasing strings it interned.
-void mpp_sample_free(struct mpp_sample *sample) { mpp_free(sample); }
+// What the capture cache remembers of the last backtrace captured on a thread.
+struct mpp_thread_capture {
+  // The control frames it was captured from, outermost first.
+  struct mpp_control_frame *control_frames;
+  // frames_before[i] is the number of frames that were captured from control_frames[0..i), so there's one more of
+  // these than there are control frames; not every control frame gives a frame.
+  size_t *frames_before;
+  size_t control_frames_count;
+  size_t control_frames_capa;
+  // The frames captured, outermost first; there are frames_before[control_frames_count] of them.
+  minimal_location_t *frames;
+  size_t frames_capa;
+};
 
-struct mpp_sample *mpp_sample_capture(VALUE allocated_value_weak) {
-  VALUE thread = rb_thread_current();
-  int stack_size = backtracie_frame_count_for_thread(thread);
-  struct mpp_sample *sample = mpp_xmalloc(sizeof(struct mpp_sample) + stack_size * sizeof(minimal_location_t));
-  sample->frames_capacity = stack_size;
-  sample->frames_count = 0;
-  sample->allocated_value_weak = allocated_value_weak;
-  memset(sample->frames, 0, stack_size * sizeof(minimal_location_t));
+struct mpp_capture_cache *mpp_capture_cache_new(void) {
+  struct mpp_capture_cache *cache = mpp_xmalloc(sizeof(struct mpp_capture_cache));
+  cache->current = NULL;
+  cache->current_count = 0;
+  cache->current_capa = 0;
+  cache->threads = mpp_value_table_new(0);
+  cache->frames_captured = 0;
+  return cache;
+}
+
+static void thread_capture_destroy(struct mpp_thread_capture *tc) {
+  if (tc->control_frames) {
+    mpp_free(tc->control_frames);
+  }
+  mpp_free(tc->frames_before);
+  if (tc->frames) {
+    mpp_free(tc->frames);
+  }
+  mpp_free(tc);
+}
+
+static int capture_cache_forget_each_thread(st_data_t key, st_data_t value, st_data_t ctxarg) {
+  thread_capture_destroy((struct mpp_thread_capture *)value);
+  return ST_DELETE;
+}
+
+void mpp_capture_cache_forget_threads(struct mpp_capture_cache *cache) {
+  mpp_value_table_foreach(cache->threads, capture_cache_forget_each_thread, 0);
+}
 
-  for (int i = 0; i < stack_size; i++) {
-    minimal_location_t *frame = &sample->frames[sample->frames_count];
-    bool is_valid = backtracie_capture_minimal_frame_for_thread(thread, i, frame);
+void mpp_capture_cache_destroy(struct mpp_capture_cache *cache) {
+  mpp_capture_cache_forget_threads(cache);
+  mpp_value_table_destroy(cache->threads);
+  if (cache->current) {
+    mpp_free(cache->current);
+  }
+  mpp_free(cache);
+}
+
+static int capture_cache_memsize_each_thread(st_data_t key, st_data_t value, st_data_t ctxarg) {
+  struct mpp_thread_capture *tc = (struct mpp_thread_capture *)value;
+  size_t *sz = (size_t *)ctxarg;
+  *sz += sizeof(struct mpp_thread_capture);
+  *sz += tc->control_frames_capa * (sizeof(struct mpp_control_frame) + sizeof(size_t));
+  *sz += tc->frames_capa * sizeof(minimal_location_t);
+  return ST_CONTINUE;
+}
+
+size_t mpp_capture_cache_memsize(struct mpp_capture_cache *cache) {
+  size_t sz = sizeof(struct mpp_capture_cache) + mpp_value_table_memsize(cache->threads);
+  sz += cache->current_capa * sizeof(struct mpp_control_frame);
+  mpp_value_table_foreach(cache->threads, capture_cache_memsize_each_thread, (st_data_t)&sz);
+  return sz;
+}
+
+static int capture_cache_mark_each_thread(st_data_t key, st_data_t value, st_data_t ctxarg) {
+  struct mpp_thread_capture *tc = (struct mpp_thread_capture *)value;
+  for (size_t i = 0; i < tc->control_frames_count; i++) {
+    const VALUE *words = tc->control_frames[i].words;
+    // The pc (words[1]) points into its iseq's bytecode, so keeping the iseq alive takes care of that too.
+    VALUE objs[3] = {words[0], words[2], words[3]};
+    for (int j = 0; j < 3; j++) {
+      if (!RB_SPECIAL_CONST_P(objs[j])) {
+        rb_gc_mark(objs[j]);
+      }
+    }
+  }
+  for (size_t i = 0; i < tc->frames_before[tc->control_frames_count]; i++) {
+    mpp_location_mark(&tc->frames[i]);
+  }
+  return ST_CONTINUE;
+}
+
+void mpp_capture_cache_mark(struct mpp_capture_cache *cache) {
+  mpp_value_table_foreach(cache->threads, capture_cache_mark_each_thread, 0);
+}
+
+uint64_t mpp_sample_fingerprint(const struct mpp_capture_opts *opts, struct mpp_stack_fingerprint_check *check) {
+  struct mpp_capture_cache *cache = opts->capture_cache;
+  size_t count = mpp_control_frames_count();
+  if (count > cache->current_capa) {
+    if (cache->current) {
+      mpp_free(cache->current);
+    }
+    cache->current = mpp_xmalloc(count * sizeof(struct mpp_control_frame));
+    cache->current_capa = count;
+  }
+  uint64_t fingerprint = mpp_stack_fingerprint(check, cache->current);
+  cache->current_count = count;
+  return fingerprint;
+}
+
+static struct mpp_thread_capture *capture_cache_thread(struct mpp_capture_cache *cache, VALUE thread) {
+  bool existed;
+  st_data_t *value = mpp_value_table_lookup_or_insert(cache->threads, thread, &existed);
+  if (!existed) {
+    struct mpp_thread_capture *tc = mpp_xmalloc(sizeof(struct mpp_thread_capture));
+    tc->control_frames = NULL;
+    tc->frames_before = mpp_xmalloc(sizeof(size_t));
+    tc->frames_before[0] = 0;
+    tc->control_frames_count = 0;
+    tc->control_frames_capa = 0;
+    tc->frames = NULL;
+    tc->frames_capa = 0;
+    *value = (st_data_t)tc;
+  }
+  return (struct mpp_thread_capture *)*value;
+}
+
+// Grows tc's arrays to hold control_frames_count control frames and frames_count frames, keeping the first keep_count
+// control frames (and the frames captured from them).
+static void thread_capture_reserve(struct mpp_thread_capture *tc, size_t control_frames_count, size_t frames_count,
+                                   size_t keep_count) {
+  if (control_frames_count > tc->control_frames_capa) {
+    size_t capa = control_frames_count * 2;
+    struct mpp_control_frame *control_frames = mpp_xmalloc(capa * sizeof(struct mpp_control_frame));
+    size_t *frames_before = mpp_xmalloc((capa + 1) * sizeof(size_t));
+    if (tc->control_frames) {
+      memcpy(control_frames, tc->control_frames, keep_count * sizeof(struct mpp_control_frame));
+      mpp_free(tc->control_frames);
+    }
+    memcpy(frames_before, tc->frames_before, (keep_count + 1) * sizeof(size_t));
+    mpp_free(tc->frames_before);
+    tc->control_frames = control_frames;
+    tc->frames_before = frames_before;
+    tc->control_frames_capa = capa;
+  }
+  if (frames_count > tc->frames_capa) {
+    size_t capa = frames_count * 2;
+    minimal_location_t *frames = mpp_xmalloc(capa * sizeof(minimal_location_t));
+    if (tc->frames) {
+      memcpy(frames, tc->frames, tc->frames_before[keep_count] * sizeof(minimal_location_t));
+      mpp_free(tc->frames);
+    }
+    tc->frames = frames;
+    tc->frames_capa = capa;
+  }
+}
+
+static size_t sample_capture_frames_backtracie(struct mpp_capture_cache *cache, minimal_location_t *frames,
+                                               size_t frames_capa, size_t depth) {
+  VALUE thread = rb_thread_current();
+  size_t frames_count = 0;
+  size_t i;
+  for (i = 0; i < depth && frames_count < frames_capa; i++) {
+    bool is_valid = backtracie_capture_minimal_frame_for_thread(thread, (int)i, &frames[frames_count]);
     if (is_valid) {
-      sample->frames_count++;
+      frames_count++;
     }
   }
+  cache->frames_captured += i;
+  return frames_count;
+}
+
+// Like sample_capture_frames_backtracie, but given the control frames mpp_sample_fingerprint walked for the backtrace,
+// only asks backtracie for the frames above the ones it shares with the last backtrace captured on the thread; the
+// rest are copied from that. Returns SIZE_MAX (having captured nothing) if the control frames don't line up with
+// what backtracie sees, or there isn't room for the whole backtrace.
+static size_t sample_capture_frames_incremental(struct mpp_capture_cache *cache,
+                                                const struct mpp_control_frame *current, size_t current_count,
+                                                minimal_location_t *frames, size_t frames_capa, size_t depth) {
+  // Backtracie counts control frames outwards from the innermost one, leaving out the outermost (dummy) frame or
+  // two, so its frame i was walked as current[current_count - 1 - i].
+  if (depth > current_count || depth > frames_capa) {
+    return SIZE_MAX;
+  }
+  VALUE thread = rb_thread_current();
+  struct mpp_thread_capture *tc = capture_cache_thread(cache, thread);
+  // A control frame can only be reused if all of the control frames below it are unchanged too: an inner method that
+  // returns and then gets called again from another line of its caller looks just the same, but its caller doesn't.
+  size_t shared = 0;
+  while (shared < current_count && shared < tc->control_frames_count &&
+         memcmp(&current[shared], &tc->control_frames[shared], sizeof(struct mpp_control_frame)) == 0) {
+    shared++;
+  }
+  size_t shared_frames = tc->frames_before[shared];
+  size_t inner_count = current_count - shared;
+  if (inner_count > depth) {
+    inner_count = depth;
+  }
+  thread_capture_reserve(tc, current_count, shared_frames + inner_count, shared);
 
-  return sample;
+  // Capture the frames above the shared control frames, noting which control frames gave one in frames_before for
+  // now (frames_before[j + 1] for current[j]).
+  size_t captured = 0;
+  for (size_t j = shared; j < current_count; j++) {
+    tc->frames_before[j + 1] = 0;
+  }
+  for (size_t i = 0; i < inner_count; i++) {
+    if (backtracie_capture_minimal_frame_for_thread(thread, (int)i, &frames[captured])) {
+      tc->frames_before[current_count - i] = 1;
+      captured++;
+    }
+  }
+  cache->frames_captured += inner_count;
+  // Then the rest of the frames come from the thread's last backtrace (where they're outermost first).
+  for (size_t i = 0; i < shared_frames && captured + i < frames_capa; i++) {
+    frames[captured + i] = tc->frames[shared_frames - 1 - i];
+  }
+
+  // And this becomes the thread's last backtrace.
+  memcpy(&tc->control_frames[shared], &current[shared], (current_count - shared) * sizeof(struct mpp_control_frame));
+  for (size_t j = shared; j < current_count; j++) {
+    tc->frames_before[j + 1] += tc->frames_before[j];
+  }
+  tc->control_frames_count = current_count;
+  for (size_t i = 0; i < captured; i++) {
+    tc->frames[shared_frames + i] = frames[captured - 1 - i];
+  }
+  size_t frames_count = captured + shared_frames;
+  return frames_count < frames_capa ? frames_count : frames_capa;
+}
+
+struct mpp_profile_frames_buffer *mpp_profile_frames_buffer_new(void) {
+  struct mpp_profile_frames_buffer *buf = mpp_xmalloc(sizeof(struct mpp_profile_frames_buffer));
+  buf->frames = NULL;
+  buf->lines = NULL;
+  buf->capa = 0;
+  return buf;
+}
+
+void mpp_profile_frames_buffer_destroy(struct mpp_profile_frames_buffer *buf) {
+  if (buf->frames) {
+    mpp_free(buf->frames);
+    mpp_free(buf->lines);
+  }
+  mpp_free(buf);
+}
+
+size_t mpp_profile_frames_buffer_memsize(struct mpp_profile_frames_buffer *buf) {
+  return sizeof(struct mpp_profile_frames_buffer) + buf->capa * (sizeof(VALUE) + sizeof(int));
+}
+
+static void profile_frames_buffer_reserve(struct mpp_profile_frames_buffer *buf, size_t capa) {
+  if (capa <= buf->capa) {
+    return;
+  }
+  if (buf->frames) {
+    mpp_free(buf->frames);
+    mpp_free(buf->lines);
+  }
+  buf->frames = mpp_xmalloc(capa * sizeof(VALUE));
+  buf->lines = mpp_xmalloc(capa * sizeof(int));
+  buf->capa = capa;
+}
+
+static size_t sample_capture_frames_profile_frames(struct mpp_profile_frames_buffer *buf, minimal_location_t *frames,
+                                                   size_t frames_capa) {
+  profile_frames_buffer_reserve(buf, frames_capa);
+  int n = rb_profile_frames(0, (int)frames_capa, buf->frames, buf->lines);
+  for (int i = 0; i < n; i++) {
+    mpp_minimal_location_from_profile_frame(buf->frames[i], buf->lines[i], &frames[i]);
+  }
+  return (size_t)n;
+}
+
+// Looks through the frames rb_profile_frames returned for the innermost Ruby frame which the elider (if any) doesn't
+// want rid of, and captures it into frames[0]; returns whether there was one.
+static bool sample_find_allocation_site(const struct mpp_capture_opts *opts, const VALUE *frame_values,
+                                        const int *lines, int n, minimal_location_t *frames) {
+  for (int i = 0; i < n; i++) {
+    memset(&frames[0], 0, sizeof(minimal_location_t));
+    mpp_minimal_location_from_profile_frame(frame_values[i], lines[i], &frames[0]);
+    if (!frames[0].is_ruby_frame) {
+      continue;
+    }
+    if (opts->elider && mpp_frame_elider_filter(opts->elider, frames, 1) == 0) {
+      continue;
+    }
+    return true;
+  }
+  memset(&frames[0], 0, sizeof(minimal_location_t));
+  return false;
 }
 
-size_t mpp_sample_frame_function_name(struct mpp_sample *sample, int frame_index, char *outbuf, size_t outbuf_len) {
-  return backtracie_minimal_frame_name_cstr(&sample->frames[frame_index], outbuf, outbuf_len);
+// Captures the innermost Ruby frame which the elider (if any) doesn't want rid of into frames[0], skipping C function
+// frames, and returns 1; or returns 0 if there isn't one.
+static size_t sample_capture_allocation_site(const struct mpp_capture_opts *opts, minimal_location_t *frames) {
+  VALUE frame_values[ALLOCATION_SITE_BATCH];
+  int lines[ALLOCATION_SITE_BATCH];
+  int n = rb_profile_frames(0, ALLOCATION_SITE_BATCH, frame_values, lines);
+  if (sample_find_allocation_site(opts, frame_values, lines, n, frames)) {
+    return 1;
+  }
+  if (n < ALLOCATION_SITE_BATCH) {
+    return 0;
+  }
+  // It's further out than that, so get the whole backtrace, and look through the rest of it.
+  size_t depth = sample_stack_depth();
+  struct mpp_profile_frames_buffer *buf = opts->profile_frames;
+  profile_frames_buffer_reserve(buf, depth);
+  n = rb_profile_frames(0, (int)depth, buf->frames, buf->lines);
+  if (n <= ALLOCATION_SITE_BATCH) {
+    return 0;
+  }
+  return sample_find_allocation_site(opts, buf->frames + ALLOCATION_SITE_BATCH, buf->lines + ALLOCATION_SITE_BATCH,
+                                     n - ALLOCATION_SITE_BATCH, frames)
+             ? 1
+             : 0;
 }
 
-size_t mpp_sample_frame_file_name(struct mpp_sample *sample, int frame_index, char *outbuf, size_t outbuf_len) {
-  return backtracie_minimal_frame_filename_cstr(&sample->frames[frame_index], outbuf, outbuf_len);
+// Finds the run of frames starting at frames[0] which is repeated back-to-back the most (measured in frames covered),
+// and returns its length, with the number of copies of it in *repeats_out; or returns zero if there isn't one.
+static size_t sample_longest_repeated_run(minimal_location_t *frames, size_t frames_count, size_t *repeats_out) {
+  size_t best_run_length = 0;
+  size_t best_repeats = 0;
+  for (size_t run_length = 1; run_length <= MPP_FOLD_RECURSION_MAX_RUN_LENGTH && 2 * run_length <= frames_count;
+       run_length++) {
+    size_t repeats = 1;
+    while ((repeats + 1) * run_length <= frames_count &&
+           memcmp(frames, &frames[repeats * run_length], run_length * sizeof(minimal_location_t)) == 0) {
+      repeats++;
+    }
+    if (repeats > 1 && repeats * run_length > best_repeats * best_run_length) {
+      best_run_length = run_length;
+      best_repeats = repeats;
+    }
+  }
+  *repeats_out = best_repeats;
+  return best_run_length;
 }
 
-int mpp_sample_frame_line_number(struct mpp_sample *sample, int frame_index) {
-  return sample->frames[frame_index].line_number;
+// Folds each run of frames repeated back-to-back into its first copy plus a marker frame, in place, and returns the
+// new number of frames. The output never gets ahead of the input, since a run is only folded if that makes it
+// shorter.
+static size_t sample_fold_recursion(minimal_location_t *frames, size_t frames_count) {
+  size_t out = 0;
+  size_t i = 0;
+  while (i < frames_count) {
+    size_t repeats;
+    size_t run_length = sample_longest_repeated_run(&frames[i], frames_count - i, &repeats);
+    if (run_length && repeats * run_length > run_length + 1) {
+      memmove(&frames[out], &frames[i], run_length * sizeof(minimal_location_t));
+      out += run_length;
+      memset(&frames[out], 0, sizeof(minimal_location_t));
+      mpp_location_init_repeated(&frames[out], run_length, repeats - 1);
+      out++;
+      i += repeats * run_length;
+    } else {
+      if (out != i) {
+        frames[out] = frames[i];
+      }
+      out++;
+      i++;
+    }
+  }
+  return out;
+}
+
+size_t mpp_sample_capture_frames(const struct mpp_capture_opts *opts, minimal_location_t *frames, size_t frames_capa) {
+  if (opts->backend == MPP_CAPTURE_BACKEND_ALLOCATION_SITE) {
+    // A single frame, which has already been past the elider, never needs truncating or folding.
+    return sample_capture_allocation_site(opts, frames);
+  }
+  size_t depth = sample_stack_depth();
+  size_t max_depth = opts->max_depth;
+  struct mpp_capture_cache *cache = opts->capture_cache;
+  // The control frames mpp_sample_fingerprint walked (if it did) are only good for this capture.
+  size_t current_count = cache->current_count;
+  cache->current_count = 0;
+  size_t frames_count;
+  switch (opts->backend) {
+  case MPP_CAPTURE_BACKEND_PROFILE_FRAMES:
+    // rb_profile_frames can't be asked for particular control frames, so this always captures the whole backtrace.
+    frames_count = sample_capture_frames_profile_frames(opts->profile_frames, frames, frames_capa);
+    cache->frames_captured += frames_count;
+    break;
+  case MPP_CAPTURE_BACKEND_BACKTRACIE:
+  default:
+    // If the backtrace is going to be truncated, the frames captured are the innermost ones, which don't necessarily
+    // go all the way down to the ones shared with the last backtrace; it's simplest to capture those in full.
+    frames_count = SIZE_MAX;
+    if (current_count) {
+      frames_count =
+          sample_capture_frames_incremental(cache, cache->current, current_count, frames, frames_capa, depth);
+    }
+    if (frames_count == SIZE_MAX) {
+      frames_count = sample_capture_frames_backtracie(cache, frames, frames_capa, depth);
+    }
+    break;
+  }
+  if (opts->elider) {
+    frames_count = mpp_frame_elider_filter(opts->elider, frames, frames_count);
+  }
+  // If there was room for the extra frame past the limit and it got used, there's more stack than we were allowed
+  // to keep; the extra frame becomes a marker for the frames that got cut off. With an elider, the whole stack got
+  // captured, so we know exactly how many frames those were.
+  if (max_depth && frames_count > max_depth) {
+    size_t truncated_count;
+    if (opts->elider) {
+      truncated_count = frames_count - max_depth;
+    } else {
+      truncated_count = depth > max_depth ? depth - max_depth : 1;
+    }
+    memset(&frames[max_depth], 0, sizeof(minimal_location_t));
+    mpp_location_init_truncated(&frames[max_depth], truncated_count);
+    frames_count = max_depth + 1;
+  }
+  if (opts->fold_recursion) {
+    frames_count = sample_fold_recursion(frames, frames_count);
+  }
+  return frames_count;
+}
+
+uint32_t mpp_sample_capture_stack(struct mpp_stack_table *stacks, const struct mpp_capture_opts *opts) {
+  size_t frames_capa = mpp_sample_frames_capa(opts);
+  minimal_location_t *frames = mpp_stack_table_scratch(stacks, frames_capa);
+  size_t frames_count = mpp_sample_capture_frames(opts, frames, frames_capa);
+  return mpp_stack_table_intern_scratch(stacks, rb_thread_current(), frames_count);
+}
+
+struct mpp_sample *mpp_sample_new(struct mpp_slab *sample_slab, VALUE allocated_value_weak, uint32_t stack_id) {
+  struct mpp_sample *sample = mpp_slab_alloc(sample_slab);
+  sample->allocated_value_weak = allocated_value_weak;
+  sample->allocated_value_objsize = 0;
+  sample->stack_id = stack_id;
+  return sample;
 }
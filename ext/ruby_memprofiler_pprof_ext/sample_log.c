@@ -0,0 +1,177 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include <ruby.h>
+
+#include <backtracie.h>
+
+#include "ruby_memprofiler_pprof.h"
+
+// The sample log records sampled allocations & frees of sampled objects from the newobj/freeobj hooks, so that the
+// work of interning backtraces and updating the sample map can be done later, in a batch, from somewhere that isn't
+// a hook. All its buffers are allocated up-front, so appending to the log never allocates memory; the collector grows
+// the entries buffer once the log's been drained, if samples had to be dropped for want of room in it.
+
+struct mpp_sample_log *mpp_sample_log_new(size_t entries_capa) {
+  struct mpp_sample_log *log = mpp_xmalloc(sizeof(struct mpp_sample_log));
+  log->entries = mpp_xmalloc(entries_capa * sizeof(struct mpp_sample_log_entry));
+  log->entries_count = 0;
+  log->entries_capa = entries_capa;
+  log->frames = mpp_xmalloc(MPP_SAMPLE_LOG_FRAMES * sizeof(minimal_location_t));
+  log->frames_count = 0;
+  log->deps = mpp_xmalloc(MPP_SAMPLE_LOG_FINGERPRINT_DEPS * sizeof(VALUE));
+  log->deps_count = 0;
+  return log;
+}
+
+void mpp_sample_log_destroy(struct mpp_sample_log *log) {
+  mpp_free(log->entries);
+  mpp_free(log->frames);
+  mpp_free(log->deps);
+  mpp_free(log);
+}
+
+size_t mpp_sample_log_memsize(struct mpp_sample_log *log) {
+  return sizeof(struct mpp_sample_log) + log->entries_capa * sizeof(struct mpp_sample_log_entry) +
+         MPP_SAMPLE_LOG_FRAMES * sizeof(minimal_location_t) + MPP_SAMPLE_LOG_FINGERPRINT_DEPS * sizeof(VALUE);
+}
+
+minimal_location_t *mpp_sample_log_reserve_frames(struct mpp_sample_log *log, size_t frames_capa) {
+  if (log->entries_count == log->entries_capa || frames_capa > MPP_SAMPLE_LOG_FRAMES - log->frames_count) {
+    return NULL;
+  }
+  minimal_location_t *frames = &log->frames[log->frames_count];
+  // Frames are hashed & compared bytewise when they're interned, so they need to start out zeroed (backtracie won't
+  // touch padding or fields it doesn't use).
+  memset(frames, 0, frames_capa * sizeof(minimal_location_t));
+  return frames;
+}
+
+void mpp_sample_log_push_insert(struct mpp_sample_log *log, VALUE obj, VALUE thread, size_t frames_count,
+                                uint64_t fingerprint, const struct mpp_stack_fingerprint_check *fingerprint_check,
+                                uint64_t fingerprint_generation, unsigned int flush_epoch) {
+  MPP_ASSERT_MSG(log->entries_count < log->entries_capa, "sample log insert without reserving space");
+  struct mpp_sample_log_entry *entry = &log->entries[log->entries_count++];
+  entry->obj = obj;
+  entry->is_insert = true;
+  entry->thread = thread;
+  entry->frames_start = (uint32_t)log->frames_count;
+  entry->frames_count = (uint32_t)frames_count;
+  entry->fingerprint = fingerprint;
+  entry->fingerprint_generation = fingerprint_generation;
+  if (fingerprint_check) {
+    entry->fingerprint_check = *fingerprint_check;
+  }
+  entry->deps_start = (uint32_t)log->deps_count;
+  entry->deps_count = 0;
+  if (fingerprint != MPP_SAMPLE_LOG_UNFINGERPRINTED) {
+    size_t deps_count =
+        mpp_stack_fingerprint_deps(&log->deps[log->deps_count], MPP_SAMPLE_LOG_FINGERPRINT_DEPS - log->deps_count);
+    if (deps_count == SIZE_MAX) {
+      // The stack still gets interned; its fingerprint just won't be remembered.
+      entry->fingerprint = MPP_SAMPLE_LOG_UNFINGERPRINTED;
+    } else {
+      entry->deps_count = (uint32_t)deps_count;
+      log->deps_count += deps_count;
+    }
+  }
+  entry->stack_id = 0;
+  entry->flush_epoch = flush_epoch;
+  entry->cancelled = false;
+  log->frames_count += frames_count;
+}
+
+bool mpp_sample_log_push_interned_insert(struct mpp_sample_log *log, VALUE obj, uint32_t stack_id,
+                                         unsigned int flush_epoch) {
+  if (log->entries_count == log->entries_capa) {
+    return false;
+  }
+  struct mpp_sample_log_entry *entry = &log->entries[log->entries_count++];
+  entry->obj = obj;
+  entry->is_insert = true;
+  entry->thread = Qnil;
+  entry->frames_start = 0;
+  entry->frames_count = 0;
+  entry->fingerprint = MPP_SAMPLE_LOG_INTERNED;
+  entry->fingerprint_generation = 0;
+  entry->deps_start = 0;
+  entry->deps_count = 0;
+  entry->stack_id = stack_id;
+  entry->flush_epoch = flush_epoch;
+  entry->cancelled = false;
+  return true;
+}
+
+bool mpp_sample_log_push_remove(struct mpp_sample_log *log, VALUE obj) {
+  if (log->entries_count == log->entries_capa) {
+    return false;
+  }
+  struct mpp_sample_log_entry *entry = &log->entries[log->entries_count++];
+  entry->obj = obj;
+  entry->is_insert = false;
+  entry->thread = Qnil;
+  entry->frames_start = 0;
+  entry->frames_count = 0;
+  entry->fingerprint = MPP_SAMPLE_LOG_INTERNED;
+  entry->fingerprint_generation = 0;
+  entry->deps_start = 0;
+  entry->deps_count = 0;
+  entry->stack_id = 0;
+  entry->flush_epoch = 0;
+  entry->cancelled = false;
+  return true;
+}
+
+bool mpp_sample_log_cancel_insert(struct mpp_sample_log *log, VALUE obj) {
+  // Any earlier insert of obj was for a previous object at the same address, which has been freed already.
+  for (size_t i = log->entries_count; i > 0; i--) {
+    struct mpp_sample_log_entry *entry = &log->entries[i - 1];
+    if (entry->obj != obj) {
+      continue;
+    }
+    if (!entry->is_insert || entry->cancelled) {
+      return false;
+    }
+    entry->cancelled = true;
+    return true;
+  }
+  return false;
+}
+
+bool mpp_sample_log_wants_drain(struct mpp_sample_log *log) {
+  // Leave plenty of room for whatever gets recorded before the drain actually happens.
+  return log->entries_count >= log->entries_capa / 2 || log->frames_count >= MPP_SAMPLE_LOG_FRAMES / 2 ||
+         log->deps_count >= MPP_SAMPLE_LOG_FINGERPRINT_DEPS / 2;
+}
+
+void mpp_sample_log_clear(struct mpp_sample_log *log) {
+  log->entries_count = 0;
+  log->frames_count = 0;
+  log->deps_count = 0;
+}
+
+void mpp_sample_log_grow(struct mpp_sample_log *log, size_t entries_capa) {
+  MPP_ASSERT_MSG(log->entries_count == 0, "sample log grown whilst it still had entries");
+  if (entries_capa <= log->entries_capa) {
+    return;
+  }
+  // Nothing in the old buffer needs keeping, so there's no point in copying it with realloc.
+  mpp_free(log->entries);
+  log->entries = mpp_xmalloc(entries_capa * sizeof(struct mpp_sample_log_entry));
+  log->entries_capa = entries_capa;
+}
+
+void mpp_sample_log_mark(struct mpp_sample_log *log) {
+  // Frames that are still in the log haven't made it into the stack table (and its mark table) yet, so they need
+  // marking separately. There's at most MPP_SAMPLE_LOG_FRAMES of these, so it's not worth de-duplicating them.
+  // They're marked as pinned, because the log is always drained before compaction updates references, rather than
+  // fixed up in place.
+  for (size_t i = 0; i < log->frames_count; i++) {
+    mpp_location_mark(&log->frames[i]);
+  }
+  // The same goes for the objects the pending inserts' fingerprints depend on, which also need pinning, since it's
+  // their addresses that were hashed.
+  for (size_t i = 0; i < log->deps_count; i++) {
+    rb_gc_mark(log->deps[i]);
+  }
+}
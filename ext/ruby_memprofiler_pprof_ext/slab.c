@@ -0,0 +1,147 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ruby_memprofiler_pprof.h"
+
+// A pool of fixed-size objects, carved out of chunks of memory mapped directly from the OS. It's used for samples,
+// stacks and frames, which are allocated & freed constantly from the newobj/freeobj hooks:
+//
+//   * Allocating from ruby_xmalloc counts towards Ruby's malloc_increase, so the profiler's own churn would make the
+//     GC run more often in the program it's trying to measure. Memory mapped here is invisible to that accounting.
+//   * Freed objects go onto a free list and are handed straight back out, so in the steady state (where the number of
+//     live samples is capped by max_heap_samples) allocating and freeing is a couple of pointer moves, and the
+//     system allocator is never involved at all.
+//
+// Chunks are never returned to the OS until the slab is destroyed.
+//
+// There's no locking; all callers hold the GVL. That also makes it fork-safe: a fork can only happen from a thread
+// holding the GVL, so the child gets a copy of the (MAP_PRIVATE) chunks & free list in a consistent state.
+
+// Chunks start small, so that a collector which only ever sees a handful of distinct stacks doesn't map megabytes,
+// and double as the slab fills up.
+#define SLAB_MIN_CHUNK_SIZE ((size_t)64 * 1024)
+#define SLAB_MAX_CHUNK_SIZE ((size_t)2 * 1024 * 1024)
+// The size of a transparent huge page on x86_64 & (most) aarch64 kernels.
+#define SLAB_HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+#define SLAB_OBJECT_ALIGN 16
+
+struct slab_chunk {
+  struct slab_chunk *next;
+  size_t size;
+};
+
+struct slab_free_object {
+  struct slab_free_object *next;
+};
+
+struct mpp_slab {
+  size_t object_size;
+  bool huge_pages;
+  struct slab_free_object *free_list;
+  struct slab_chunk *chunks;
+  // The part of the newest chunk that has never been handed out.
+  char *bump;
+  char *bump_end;
+  size_t next_chunk_size;
+  size_t mapped_bytes;
+};
+
+static size_t slab_round_up(size_t n, size_t align) { return (n + align - 1) / align * align; }
+
+static void *slab_map(size_t size, size_t align) {
+  // Map extra so there's an aligned range of the right size somewhere inside it, then give back the ends.
+  size_t map_size = size + (align > (size_t)sysconf(_SC_PAGESIZE) ? align : 0);
+  void *mem = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    MPP_ASSERT_FAIL("failed to map memory in ruby_memprofiler_pprof gem");
+  }
+  if (map_size == size) {
+    return mem;
+  }
+  uintptr_t start = slab_round_up((uintptr_t)mem, align);
+  uintptr_t end = start + size;
+  if (start > (uintptr_t)mem) {
+    munmap(mem, start - (uintptr_t)mem);
+  }
+  if ((uintptr_t)mem + map_size > end) {
+    munmap((void *)end, (uintptr_t)mem + map_size - end);
+  }
+  return (void *)start;
+}
+
+static void slab_add_chunk(struct mpp_slab *slab) {
+  size_t size = slab->next_chunk_size;
+  size_t min_size = slab_round_up(sizeof(struct slab_chunk), SLAB_OBJECT_ALIGN) + slab->object_size;
+  if (size < min_size) {
+    size = slab_round_up(min_size, (size_t)sysconf(_SC_PAGESIZE));
+  }
+  bool use_huge_pages = slab->huge_pages && size >= SLAB_HUGE_PAGE_SIZE && size % SLAB_HUGE_PAGE_SIZE == 0;
+
+  struct slab_chunk *chunk = slab_map(size, use_huge_pages ? SLAB_HUGE_PAGE_SIZE : 0);
+#ifdef MADV_HUGEPAGE
+  if (use_huge_pages) {
+    // Only advice; if transparent huge pages are disabled, we just get normal pages.
+    madvise(chunk, size, MADV_HUGEPAGE);
+  }
+#endif
+  chunk->size = size;
+  chunk->next = slab->chunks;
+  slab->chunks = chunk;
+  slab->mapped_bytes += size;
+
+  slab->bump = (char *)chunk + slab_round_up(sizeof(struct slab_chunk), SLAB_OBJECT_ALIGN);
+  slab->bump_end = (char *)chunk + size;
+  if (slab->next_chunk_size < SLAB_MAX_CHUNK_SIZE) {
+    slab->next_chunk_size *= 2;
+  }
+}
+
+struct mpp_slab *mpp_slab_new(size_t object_size, bool huge_pages) {
+  struct mpp_slab *slab = mpp_xmalloc(sizeof(struct mpp_slab));
+  slab->object_size = slab_round_up(object_size < sizeof(struct slab_free_object) ? sizeof(struct slab_free_object)
+                                                                                    : object_size,
+                                    SLAB_OBJECT_ALIGN);
+  slab->huge_pages = huge_pages;
+  slab->free_list = NULL;
+  slab->chunks = NULL;
+  slab->bump = NULL;
+  slab->bump_end = NULL;
+  slab->next_chunk_size = SLAB_MIN_CHUNK_SIZE;
+  slab->mapped_bytes = 0;
+  return slab;
+}
+
+void mpp_slab_destroy(struct mpp_slab *slab) {
+  struct slab_chunk *chunk = slab->chunks;
+  while (chunk) {
+    struct slab_chunk *next = chunk->next;
+    munmap(chunk, chunk->size);
+    chunk = next;
+  }
+  mpp_free(slab);
+}
+
+size_t mpp_slab_memsize(struct mpp_slab *slab) { return sizeof(struct mpp_slab) + slab->mapped_bytes; }
+
+void *mpp_slab_alloc(struct mpp_slab *slab) {
+  struct slab_free_object *obj = slab->free_list;
+  if (obj) {
+    slab->free_list = obj->next;
+    return obj;
+  }
+  if (slab->bump == NULL || (size_t)(slab->bump_end - slab->bump) < slab->object_size) {
+    slab_add_chunk(slab);
+  }
+  void *mem = slab->bump;
+  slab->bump += slab->object_size;
+  return mem;
+}
+
+void mpp_slab_free(struct mpp_slab *slab, void *mem) {
+  struct slab_free_object *obj = mem;
+  obj->next = slab->free_list;
+  slab->free_list = obj;
+}
@@ -0,0 +1,689 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include <ruby.h>
+#include <ruby/st.h>
+
+#include <backtracie.h>
+
+#include "ruby_memprofiler_pprof.h"
+
+// I copied this magic number out of st.c from Ruby.
+#define FNV1_32A_INIT 0x811c9dc5
+
+// Methods for a hash of (struct mpp_frame *) -> (frame ID), which compares frames by their location.
+static int frame_st_hash_compare(st_data_t arg1, st_data_t arg2) {
+  struct mpp_frame *f1 = (struct mpp_frame *)arg1;
+  struct mpp_frame *f2 = (struct mpp_frame *)arg2;
+  return memcmp(&f1->location, &f2->location, sizeof(minimal_location_t));
+}
+
+static st_index_t frame_st_hash_hash(st_data_t arg) {
+  struct mpp_frame *frame = (struct mpp_frame *)arg;
+  return frame->hash;
+}
+
+static const struct st_hash_type frame_st_hash_type = {
+    .compare = frame_st_hash_compare,
+    .hash = frame_st_hash_hash,
+};
+
+// Methods for a hash of (struct mpp_stack *) -> (stack ID), which compares stacks by their frame IDs.
+static int stack_st_hash_compare(st_data_t arg1, st_data_t arg2) {
+  struct mpp_stack *s1 = (struct mpp_stack *)arg1;
+  struct mpp_stack *s2 = (struct mpp_stack *)arg2;
+  if (s1->frames_count != s2->frames_count) {
+    return 1;
+  }
+  return memcmp(s1->frame_ids, s2->frame_ids, s1->frames_count * sizeof(uint32_t));
+}
+
+static st_index_t stack_st_hash_hash(st_data_t arg) {
+  struct mpp_stack *stack = (struct mpp_stack *)arg;
+  return stack->hash;
+}
+
+static const struct st_hash_type stack_st_hash_type = {
+    .compare = stack_st_hash_compare,
+    .hash = stack_st_hash_hash,
+};
+
+static void frame_compute_hash(struct mpp_frame *frame) {
+  frame->hash = st_hash(&frame->location, sizeof(minimal_location_t), FNV1_32A_INIT);
+}
+
+static void stack_compute_hash(struct mpp_stack *stack) {
+  stack->hash = st_hash(stack->frame_ids, stack->frames_count * sizeof(uint32_t), FNV1_32A_INIT);
+}
+
+void mpp_id_slots_init(struct mpp_id_slots *slots) {
+  slots->items = NULL;
+  slots->capa = 0;
+  slots->next_id = 0;
+  slots->free_ids = NULL;
+  slots->free_ids_count = 0;
+  slots->free_ids_capa = 0;
+  slots->count = 0;
+}
+
+void mpp_id_slots_destroy(struct mpp_id_slots *slots) {
+  if (slots->items) {
+    mpp_free(slots->items);
+  }
+  if (slots->free_ids) {
+    mpp_free(slots->free_ids);
+  }
+}
+
+size_t mpp_id_slots_memsize(struct mpp_id_slots *slots) {
+  return slots->capa * sizeof(void *) + slots->free_ids_capa * sizeof(uint32_t);
+}
+
+uint32_t mpp_id_slots_add(struct mpp_id_slots *slots, void *item) {
+  uint32_t id;
+  if (slots->free_ids_count > 0) {
+    id = slots->free_ids[--slots->free_ids_count];
+  } else {
+    if (slots->next_id == slots->capa) {
+      MPP_ASSERT_MSG(slots->capa < UINT32_MAX / 2, "too many IDs in use");
+      size_t new_capa = slots->capa ? slots->capa * 2 : 1024;
+      slots->items = mpp_realloc(slots->items, new_capa * sizeof(void *));
+      // There can never be more free IDs than we've handed out, so growing this in step with the items means
+      // mpp_id_slots_remove never needs to allocate (it runs from the freeobj hook, where that must not happen).
+      slots->free_ids = mpp_realloc(slots->free_ids, new_capa * sizeof(uint32_t));
+      slots->capa = new_capa;
+      slots->free_ids_capa = new_capa;
+    }
+    id = slots->next_id++;
+  }
+  slots->items[id] = item;
+  slots->count++;
+  return id;
+}
+
+void mpp_id_slots_remove(struct mpp_id_slots *slots, uint32_t id) {
+  slots->items[id] = NULL;
+  slots->count--;
+  // Stash the ID for re-use; see mpp_id_slots_add for why there's always room.
+  MPP_ASSERT_MSG(slots->free_ids_count < slots->free_ids_capa, "free ID list overflowed");
+  slots->free_ids[slots->free_ids_count++] = id;
+}
+
+// Fills values with the VALUEs a location refers to, and returns how many there are.
+#define LOCATION_MAX_VALUES 3
+static int location_values(minimal_location_t *loc, VALUE values[LOCATION_MAX_VALUES]) {
+  int n = 0;
+  if (mpp_location_is_synthetic(loc)) {
+    return n;
+  }
+  if (loc->method_name_contents == BACKTRACIE_METHOD_NAME_CONTENTS_BASE_LABEL) {
+    values[n++] = loc->method_name.base_label;
+  }
+  switch (loc->method_qualifier_contents) {
+  case BACKTRACIE_METHOD_QUALIFIER_CONTENTS_SELF:
+    values[n++] = loc->method_qualifier.self;
+    break;
+  case BACKTRACIE_METHOD_QUALIFIER_CONTENTS_SELF_CLASS:
+    values[n++] = loc->method_qualifier.self_class;
+    break;
+  case BACKTRACIE_METHOD_QUALIFIER_CONTENTS_CME_CLASS:
+    values[n++] = loc->method_qualifier.cme_defined_class;
+    break;
+  }
+  values[n++] = loc->filename;
+  return n;
+}
+
+// The mark table is only ever added to as frames are created; VALUEs belonging to frames which have since been freed
+// are left in it (and so kept alive a little longer than strictly needed) until it's next rebuilt from the live
+// frames. This means freeing a frame doesn't need to touch it at all.
+static bool mark_table_wants(VALUE key) { return key != Qnil && key != Qundef && key != 0; }
+
+// Adds each of the VALUEs in the frame to the mark table, if they're not already there.
+static void mark_table_add_frame(struct mpp_value_table *mark_table, struct mpp_frame *frame) {
+  VALUE values[LOCATION_MAX_VALUES];
+  int n = location_values(&frame->location, values);
+  for (int i = 0; i < n; i++) {
+    if (mark_table_wants(values[i])) {
+      mpp_value_table_lookup_or_insert(mark_table, values[i], NULL);
+    }
+  }
+}
+
+void mpp_location_init_truncated(minimal_location_t *loc, size_t frames_count) {
+  loc->reserved_bits = MPP_FRAME_KIND_TRUNCATED;
+  loc->line_number = frames_count > UINT32_MAX ? UINT32_MAX : (uint32_t)frames_count;
+}
+
+void mpp_location_init_repeated(minimal_location_t *loc, size_t run_length, size_t repeats) {
+  loc->reserved_bits = MPP_FRAME_KIND_REPEATED;
+  loc->line_number = repeats > UINT32_MAX ? UINT32_MAX : (uint32_t)repeats;
+  loc->method_name.cme_method_id = (ID)run_length;
+}
+
+void mpp_location_mark(minimal_location_t *loc) {
+  VALUE values[LOCATION_MAX_VALUES];
+  int n = location_values(loc, values);
+  for (int i = 0; i < n; i++) {
+    rb_gc_mark(values[i]);
+  }
+}
+
+// Returns the slab size class for stacks of frames_count frames, or -1 if it's too big for any of them.
+static int stack_table_slab_class(size_t frames_count) {
+  for (int i = 0; i < MPP_STACK_TABLE_SLAB_CLASSES; i++) {
+    if (frames_count <= ((size_t)MPP_STACK_TABLE_SLAB_MIN_FRAMES << i)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static struct mpp_stack *stack_table_alloc_stack(struct mpp_stack_table *stacks, size_t frames_count) {
+  int slab_class = stack_table_slab_class(frames_count);
+  if (slab_class == -1) {
+    return mpp_xmalloc(sizeof(struct mpp_stack) + frames_count * sizeof(uint32_t));
+  }
+  return mpp_slab_alloc(stacks->stack_slabs[slab_class]);
+}
+
+static void stack_table_free_stack(struct mpp_stack_table *stacks, struct mpp_stack *stack) {
+  int slab_class = stack_table_slab_class(stack->frames_count);
+  if (slab_class == -1) {
+    mpp_free(stack);
+  } else {
+    mpp_slab_free(stacks->stack_slabs[slab_class], stack);
+  }
+}
+
+struct mpp_stack_table *mpp_stack_table_new(bool huge_pages) {
+  struct mpp_stack_table *stacks = mpp_xmalloc(sizeof(struct mpp_stack_table));
+  mpp_id_slots_init(&stacks->stacks);
+  stacks->stacks_index = st_init_table(&stack_st_hash_type);
+  mpp_id_slots_init(&stacks->frames);
+  stacks->frames_index = st_init_table(&frame_st_hash_type);
+  stacks->mark_table = mpp_value_table_new(0);
+  stacks->mark_table_dead_frames = 0;
+  stacks->thread_last_stacks = mpp_value_table_new(0);
+  stacks->fingerprints = mpp_xmalloc(MPP_STACK_TABLE_FINGERPRINTS * sizeof(struct mpp_stack_fingerprint));
+  memset(stacks->fingerprints, 0, MPP_STACK_TABLE_FINGERPRINTS * sizeof(struct mpp_stack_fingerprint));
+  stacks->fingerprints_generation = 0;
+  stacks->fingerprint_deps = mpp_value_table_new(0);
+  stacks->scratch_frames = NULL;
+  stacks->scratch_frames_capa = 0;
+  stacks->scratch_stack = NULL;
+  stacks->frame_slab = mpp_slab_new(sizeof(struct mpp_frame), huge_pages);
+  for (int i = 0; i < MPP_STACK_TABLE_SLAB_CLASSES; i++) {
+    size_t max_frames = (size_t)MPP_STACK_TABLE_SLAB_MIN_FRAMES << i;
+    stacks->stack_slabs[i] = mpp_slab_new(sizeof(struct mpp_stack) + max_frames * sizeof(uint32_t), huge_pages);
+  }
+  return stacks;
+}
+
+void mpp_stack_table_destroy(struct mpp_stack_table *stacks) {
+  // Everything else lives in the slabs, which are freed wholesale below.
+  for (uint32_t i = 0; i < stacks->stacks.next_id; i++) {
+    struct mpp_stack *stack = stacks->stacks.items[i];
+    if (stack && stack_table_slab_class(stack->frames_count) == -1) {
+      mpp_free(stack);
+    }
+  }
+  mpp_id_slots_destroy(&stacks->stacks);
+  mpp_id_slots_destroy(&stacks->frames);
+  if (stacks->scratch_frames) {
+    mpp_free(stacks->scratch_frames);
+  }
+  if (stacks->scratch_stack) {
+    mpp_free(stacks->scratch_stack);
+  }
+  st_free_table(stacks->stacks_index);
+  st_free_table(stacks->frames_index);
+  mpp_value_table_destroy(stacks->mark_table);
+  mpp_value_table_destroy(stacks->thread_last_stacks);
+  for (size_t i = 0; i < MPP_STACK_TABLE_FINGERPRINTS; i++) {
+    if (stacks->fingerprints[i].deps) {
+      mpp_free(stacks->fingerprints[i].deps);
+    }
+  }
+  mpp_free(stacks->fingerprints);
+  mpp_value_table_destroy(stacks->fingerprint_deps);
+  mpp_slab_destroy(stacks->frame_slab);
+  for (int i = 0; i < MPP_STACK_TABLE_SLAB_CLASSES; i++) {
+    mpp_slab_destroy(stacks->stack_slabs[i]);
+  }
+  mpp_free(stacks);
+}
+
+size_t mpp_stack_table_memsize(struct mpp_stack_table *stacks) {
+  size_t sz = sizeof(*stacks);
+  sz += mpp_id_slots_memsize(&stacks->stacks);
+  sz += mpp_id_slots_memsize(&stacks->frames);
+  sz += st_memsize(stacks->stacks_index);
+  sz += st_memsize(stacks->frames_index);
+  sz += mpp_value_table_memsize(stacks->mark_table);
+  sz += mpp_value_table_memsize(stacks->thread_last_stacks);
+  sz += MPP_STACK_TABLE_FINGERPRINTS * sizeof(struct mpp_stack_fingerprint);
+  for (size_t i = 0; i < MPP_STACK_TABLE_FINGERPRINTS; i++) {
+    sz += stacks->fingerprints[i].deps_count * sizeof(VALUE);
+  }
+  sz += mpp_value_table_memsize(stacks->fingerprint_deps);
+  sz += stacks->scratch_frames_capa * sizeof(minimal_location_t);
+  if (stacks->scratch_stack) {
+    sz += sizeof(struct mpp_stack) + stacks->scratch_frames_capa * sizeof(uint32_t);
+  }
+  sz += mpp_slab_memsize(stacks->frame_slab);
+  for (int i = 0; i < MPP_STACK_TABLE_SLAB_CLASSES; i++) {
+    sz += mpp_slab_memsize(stacks->stack_slabs[i]);
+  }
+  for (uint32_t i = 0; i < stacks->stacks.next_id; i++) {
+    struct mpp_stack *stack = stacks->stacks.items[i];
+    if (stack && stack_table_slab_class(stack->frames_count) == -1) {
+      sz += sizeof(struct mpp_stack) + stack->frames_count * sizeof(uint32_t);
+    }
+  }
+  return sz;
+}
+
+static void stack_table_ensure_scratch(struct mpp_stack_table *stacks, size_t frames_capa) {
+  if (frames_capa > stacks->scratch_frames_capa || !stacks->scratch_frames) {
+    if (stacks->scratch_frames) {
+      mpp_free(stacks->scratch_frames);
+    }
+    if (stacks->scratch_stack) {
+      mpp_free(stacks->scratch_stack);
+    }
+    stacks->scratch_frames = mpp_xmalloc(frames_capa * sizeof(minimal_location_t));
+    stacks->scratch_stack = mpp_xmalloc(sizeof(struct mpp_stack) + frames_capa * sizeof(uint32_t));
+    stacks->scratch_frames_capa = frames_capa;
+  }
+}
+
+minimal_location_t *mpp_stack_table_scratch(struct mpp_stack_table *stacks, size_t frames_capa) {
+  stack_table_ensure_scratch(stacks, frames_capa);
+  // Zero the frames, because frames are hashed & compared bytewise, and backtracie won't touch padding or
+  // fields it doesn't use.
+  memset(stacks->scratch_frames, 0, frames_capa * sizeof(minimal_location_t));
+  return stacks->scratch_frames;
+}
+
+// Finds the frame with the given location, or creates it with a refcount of zero. The caller is responsible for
+// taking a reference to it.
+static uint32_t stack_table_find_or_create_frame(struct mpp_stack_table *stacks, minimal_location_t *location) {
+  struct mpp_frame key;
+  key.location = *location;
+  frame_compute_hash(&key);
+
+  st_data_t existing_id;
+  if (st_lookup(stacks->frames_index, (st_data_t)&key, &existing_id)) {
+    return (uint32_t)existing_id;
+  }
+
+  struct mpp_frame *frame = mpp_slab_alloc(stacks->frame_slab);
+  *frame = key;
+  frame->refcount = 0;
+  frame->id = mpp_id_slots_add(&stacks->frames, frame);
+  st_insert(stacks->frames_index, (st_data_t)frame, frame->id);
+  // This is the first time we've seen this frame; its VALUEs now need to be kept alive.
+  mark_table_add_frame(stacks->mark_table, frame);
+  return frame->id;
+}
+
+static void stack_table_release_frame(struct mpp_stack_table *stacks, uint32_t frame_id) {
+  struct mpp_frame *frame = mpp_stack_table_get_frame(stacks, frame_id);
+  MPP_ASSERT_MSG(frame->refcount > 0, "frame released too many times");
+  if (--frame->refcount > 0) {
+    return;
+  }
+
+  st_data_t key = (st_data_t)frame;
+  st_delete(stacks->frames_index, &key, NULL);
+  mpp_id_slots_remove(&stacks->frames, frame_id);
+  mpp_slab_free(stacks->frame_slab, frame);
+
+  // Once more frames have died since the mark table was last rebuilt than are alive, rebuilding it costs about as
+  // much as the frees since then did, so the cost stays amortised; and the table never holds more than about twice
+  // the VALUEs it needs to.
+  stacks->mark_table_dead_frames++;
+  if (stacks->mark_table_dead_frames > MPP_STACK_TABLE_MIN_DEAD_FRAMES_FOR_REBUILD &&
+      stacks->mark_table_dead_frames > stacks->frames.count) {
+    mpp_stack_table_rebuild_mark_table(stacks);
+  }
+}
+
+uint32_t mpp_stack_table_intern_scratch(struct mpp_stack_table *stacks, VALUE thread, size_t frames_count) {
+  return mpp_stack_table_intern(stacks, thread, stacks->scratch_frames, frames_count);
+}
+
+// Frames are stored most-recent-call-first, so the outermost frames two stacks share are at the _end_ of each. Fills
+// in the IDs of the frames at the end of frames that are the same as those at the end of prev, and returns how many
+// there were. Comparing locations directly is much cheaper than hashing them and looking them up in frames_index,
+// though it doesn't save capturing them in the first place.
+static size_t stack_table_reuse_shared_frames(struct mpp_stack_table *stacks, struct mpp_stack *prev,
+                                              minimal_location_t *frames, size_t frames_count, uint32_t *frame_ids) {
+  size_t shared = 0;
+  while (shared < frames_count && shared < prev->frames_count) {
+    uint32_t frame_id = prev->frame_ids[prev->frames_count - 1 - shared];
+    struct mpp_frame *frame = mpp_stack_table_get_frame(stacks, frame_id);
+    if (memcmp(&frame->location, &frames[frames_count - 1 - shared], sizeof(minimal_location_t)) != 0) {
+      break;
+    }
+    frame_ids[frames_count - 1 - shared] = frame_id;
+    shared++;
+  }
+  return shared;
+}
+
+// Takes a reference to whichever stack was interned into stack_id, and makes it the thread's last stack.
+static uint32_t stack_table_take_reference(struct mpp_stack_table *stacks, VALUE thread, uint32_t stack_id,
+                                           st_data_t *last_stack_id) {
+  mpp_stack_table_get(stacks, stack_id)->refcount++;
+  if (last_stack_id) {
+    // The thread's last stack gets a reference of its own too. Take that before dropping the old one, in case
+    // they're the same.
+    mpp_stack_table_get(stacks, stack_id)->refcount++;
+    uint32_t old_stack_id = (uint32_t)*last_stack_id;
+    *last_stack_id = stack_id;
+    mpp_stack_table_release(stacks, old_stack_id);
+  } else if (thread != Qnil) {
+    mpp_stack_table_get(stacks, stack_id)->refcount++;
+    mpp_value_table_insert(stacks->thread_last_stacks, thread, stack_id);
+  }
+  return stack_id;
+}
+
+uint32_t mpp_stack_table_intern(struct mpp_stack_table *stacks, VALUE thread, minimal_location_t *frames,
+                                size_t frames_count) {
+  stack_table_ensure_scratch(stacks, frames_count);
+  struct mpp_stack *scratch = stacks->scratch_stack;
+  scratch->frames_count = (uint32_t)frames_count;
+
+  size_t shared = 0;
+  st_data_t *last_stack_id = thread == Qnil ? NULL : mpp_value_table_lookup_ptr(stacks->thread_last_stacks, thread);
+  if (last_stack_id) {
+    struct mpp_stack *prev = mpp_stack_table_get(stacks, (uint32_t)*last_stack_id);
+    shared = stack_table_reuse_shared_frames(stacks, prev, frames, frames_count, scratch->frame_ids);
+  }
+  for (size_t i = 0; i < frames_count - shared; i++) {
+    scratch->frame_ids[i] = stack_table_find_or_create_frame(stacks, &frames[i]);
+  }
+  stack_compute_hash(scratch);
+
+  st_data_t existing_id;
+  if (st_lookup(stacks->stacks_index, (st_data_t)scratch, &existing_id)) {
+    // n.b. if the stack already exists, then so did all of its frames, so there's no refcount-zero frames to
+    // clean up here.
+    return stack_table_take_reference(stacks, thread, (uint32_t)existing_id, last_stack_id);
+  }
+
+  size_t stack_size = sizeof(struct mpp_stack) + frames_count * sizeof(uint32_t);
+  struct mpp_stack *stack = stack_table_alloc_stack(stacks, frames_count);
+  memcpy(stack, scratch, stack_size);
+  stack->refcount = 0;
+  stack->live_objects = 0;
+  stack->live_bytes = 0;
+  stack->id = mpp_id_slots_add(&stacks->stacks, stack);
+  st_insert(stacks->stacks_index, (st_data_t)stack, stack->id);
+  for (size_t i = 0; i < frames_count; i++) {
+    mpp_stack_table_get_frame(stacks, stack->frame_ids[i])->refcount++;
+  }
+  return stack_table_take_reference(stacks, thread, stack->id, last_stack_id);
+}
+
+static int stack_table_forget_each_thread(st_data_t key, st_data_t value, st_data_t ctxarg) {
+  struct mpp_stack_table *stacks = (struct mpp_stack_table *)ctxarg;
+  mpp_stack_table_release(stacks, (uint32_t)value);
+  return ST_DELETE;
+}
+
+void mpp_stack_table_forget_threads(struct mpp_stack_table *stacks) {
+  mpp_value_table_foreach(stacks->thread_last_stacks, stack_table_forget_each_thread, (st_data_t)stacks);
+}
+
+static struct mpp_stack_fingerprint *stack_table_fingerprint_slot(struct mpp_stack_table *stacks,
+                                                                   uint64_t fingerprint) {
+  return &stacks->fingerprints[fingerprint % MPP_STACK_TABLE_FINGERPRINTS];
+}
+
+bool mpp_stack_table_lookup_fingerprint(struct mpp_stack_table *stacks, uint64_t fingerprint,
+                                        const struct mpp_stack_fingerprint_check *check, uint32_t *stack_id) {
+  struct mpp_stack_fingerprint *slot = stack_table_fingerprint_slot(stacks, fingerprint);
+  if (slot->fingerprint != fingerprint || slot->generation != stacks->fingerprints_generation) {
+    return false;
+  }
+  // A different backtrace which happens to hash the same nearly always differs in depth or where it is right now.
+  if (slot->check.depth != check->depth || slot->check.iseq != check->iseq || slot->check.pc != check->pc) {
+    return false;
+  }
+  mpp_stack_table_get(stacks, slot->stack_id)->refcount++;
+  *stack_id = slot->stack_id;
+  return true;
+}
+
+// Drops an in-use fingerprint slot's references to its stack & to the objects its fingerprint was made from.
+static void stack_table_release_fingerprint_slot(struct mpp_stack_table *stacks, struct mpp_stack_fingerprint *slot) {
+  mpp_stack_table_release(stacks, slot->stack_id);
+  for (uint32_t i = 0; i < slot->deps_count; i++) {
+    st_data_t *refcount = mpp_value_table_lookup_ptr(stacks->fingerprint_deps, slot->deps[i]);
+    if (--*refcount == 0) {
+      mpp_value_table_delete(stacks->fingerprint_deps, slot->deps[i], NULL);
+    }
+  }
+  if (slot->deps) {
+    mpp_free(slot->deps);
+  }
+}
+
+void mpp_stack_table_remember_fingerprint(struct mpp_stack_table *stacks, uint64_t fingerprint,
+                                          const struct mpp_stack_fingerprint_check *check, const VALUE *deps,
+                                          size_t deps_count, uint64_t generation, uint32_t stack_id) {
+  if (generation != stacks->fingerprints_generation) {
+    return;
+  }
+  struct mpp_stack_fingerprint *slot = stack_table_fingerprint_slot(stacks, fingerprint);
+  // As with the threads' last stacks, take the new references before dropping the old ones, in case they're the same.
+  mpp_stack_table_get(stacks, stack_id)->refcount++;
+  VALUE *slot_deps = NULL;
+  if (deps_count > 0) {
+    slot_deps = mpp_xmalloc(deps_count * sizeof(VALUE));
+    memcpy(slot_deps, deps, deps_count * sizeof(VALUE));
+  }
+  for (size_t i = 0; i < deps_count; i++) {
+    (*mpp_value_table_lookup_or_insert(stacks->fingerprint_deps, deps[i], NULL))++;
+  }
+  if (slot->fingerprint) {
+    stack_table_release_fingerprint_slot(stacks, slot);
+  }
+  slot->fingerprint = fingerprint;
+  slot->generation = generation;
+  slot->check = *check;
+  slot->stack_id = stack_id;
+  slot->deps_count = (uint32_t)deps_count;
+  slot->deps = slot_deps;
+}
+
+void mpp_stack_table_invalidate_fingerprints(struct mpp_stack_table *stacks) { stacks->fingerprints_generation++; }
+
+void mpp_stack_table_forget_fingerprints(struct mpp_stack_table *stacks) {
+  for (size_t i = 0; i < MPP_STACK_TABLE_FINGERPRINTS; i++) {
+    struct mpp_stack_fingerprint *slot = &stacks->fingerprints[i];
+    if (slot->fingerprint) {
+      stack_table_release_fingerprint_slot(stacks, slot);
+      slot->fingerprint = 0;
+      slot->deps_count = 0;
+      slot->deps = NULL;
+    }
+  }
+}
+
+void mpp_stack_table_release(struct mpp_stack_table *stacks, uint32_t stack_id) {
+  struct mpp_stack *stack = mpp_stack_table_get(stacks, stack_id);
+  MPP_ASSERT_MSG(stack->refcount > 0, "stack released too many times");
+  if (--stack->refcount > 0) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < stack->frames_count; i++) {
+    stack_table_release_frame(stacks, stack->frame_ids[i]);
+  }
+  st_data_t key = (st_data_t)stack;
+  st_delete(stacks->stacks_index, &key, NULL);
+  mpp_id_slots_remove(&stacks->stacks, stack_id);
+  stack_table_free_stack(stacks, stack);
+}
+
+void mpp_stack_table_foreach(struct mpp_stack_table *stacks, int (*fn)(struct mpp_stack *stack, st_data_t ctxarg),
+                             st_data_t ctxarg) {
+  for (uint32_t i = 0; i < stacks->stacks.next_id; i++) {
+    struct mpp_stack *stack = stacks->stacks.items[i];
+    if (stack && fn(stack, ctxarg) == ST_STOP) {
+      return;
+    }
+  }
+}
+
+static int stack_table_mark_each_table_entry(st_data_t key, st_data_t value, st_data_t ctxarg) {
+  rb_gc_mark_movable((VALUE)key);
+  return ST_CONTINUE;
+}
+
+static int stack_table_mark_each_fingerprint_dep(st_data_t key, st_data_t value, st_data_t ctxarg) {
+  rb_gc_mark((VALUE)key);
+  return ST_CONTINUE;
+}
+
+void mpp_stack_table_mark(struct mpp_stack_table *stacks) {
+  mpp_value_table_foreach(stacks->mark_table, stack_table_mark_each_table_entry, 0);
+  // Pinned, since fingerprints are made from these objects' addresses; see fingerprint_deps.
+  mpp_value_table_foreach(stacks->fingerprint_deps, stack_table_mark_each_fingerprint_dep, 0);
+}
+
+size_t mpp_stack_table_mark_table_size(struct mpp_stack_table *stacks) {
+  return mpp_value_table_count(stacks->mark_table);
+}
+
+void mpp_stack_table_rebuild_mark_table(struct mpp_stack_table *stacks) {
+  // Clearing keeps the table's capacity, and the live frames can't have more VALUEs between them than the table
+  // already held, so this doesn't allocate.
+  mpp_value_table_clear(stacks->mark_table);
+  for (uint32_t i = 0; i < stacks->frames.next_id; i++) {
+    struct mpp_frame *frame = stacks->frames.items[i];
+    if (frame) {
+      mark_table_add_frame(stacks->mark_table, frame);
+    }
+  }
+  stacks->mark_table_dead_frames = 0;
+}
+
+bool mpp_stack_table_mark_table_is_complete(struct mpp_stack_table *stacks) {
+  for (uint32_t i = 0; i < stacks->frames.next_id; i++) {
+    struct mpp_frame *frame = stacks->frames.items[i];
+    if (!frame) {
+      continue;
+    }
+    VALUE values[LOCATION_MAX_VALUES];
+    int n = location_values(&frame->location, values);
+    for (int j = 0; j < n; j++) {
+      if (mark_table_wants(values[j]) && !mpp_value_table_lookup(stacks->mark_table, values[j], NULL)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+
+static void frame_compact_location(struct mpp_frame *frame) {
+  minimal_location_t *loc = &frame->location;
+  if (mpp_location_is_synthetic(loc)) {
+    return;
+  }
+  if (loc->method_name_contents == BACKTRACIE_METHOD_NAME_CONTENTS_BASE_LABEL) {
+    loc->method_name.base_label = rb_gc_location(loc->method_name.base_label);
+  }
+  switch (loc->method_qualifier_contents) {
+  case BACKTRACIE_METHOD_QUALIFIER_CONTENTS_SELF:
+    loc->method_qualifier.self = rb_gc_location(loc->method_qualifier.self);
+    break;
+  case BACKTRACIE_METHOD_QUALIFIER_CONTENTS_SELF_CLASS:
+    loc->method_qualifier.self_class = rb_gc_location(loc->method_qualifier.self_class);
+    break;
+  case BACKTRACIE_METHOD_QUALIFIER_CONTENTS_CME_CLASS:
+    loc->method_qualifier.cme_defined_class = rb_gc_location(loc->method_qualifier.cme_defined_class);
+    break;
+  }
+  loc->filename = rb_gc_location(loc->filename);
+}
+
+void mpp_stack_table_compact(struct mpp_stack_table *stacks) {
+  // Moving VALUEs changes the contents of the frames, and hence their hashes; the frame index needs to be rebuilt
+  // from scratch. Clearing it keeps its capacity, so re-inserting the same frames won't allocate. Stacks are made
+  // of frame IDs, which don't change, so they don't need touching at all.
+  st_clear(stacks->frames_index);
+  for (uint32_t i = 0; i < stacks->frames.next_id; i++) {
+    struct mpp_frame *frame = stacks->frames.items[i];
+    if (!frame) {
+      continue;
+    }
+    frame_compact_location(frame);
+    frame_compute_hash(frame);
+    st_insert(stacks->frames_index, (st_data_t)frame, frame->id);
+  }
+  // Threads may have moved, leaving their last stacks keyed under addresses they no longer live at.
+  mpp_stack_table_forget_threads(stacks);
+  // The mark table might have entries for VALUEs that no frame refers to any more (and which may even have been
+  // freed by now); rather than fix it up, just start it again from the (updated) live frames.
+  mpp_stack_table_rebuild_mark_table(stacks);
+}
+#endif
+
+size_t mpp_frame_function_name(struct mpp_frame *frame, char *outbuf, size_t outbuf_len) {
+  minimal_location_t *loc = &frame->location;
+  switch (loc->reserved_bits) {
+  case MPP_FRAME_KIND_TRUNCATED:
+    return (size_t)snprintf(outbuf, outbuf_len, "[truncated %u frames]", loc->line_number);
+  case MPP_FRAME_KIND_REPEATED:
+    if (loc->method_name.cme_method_id == 1) {
+      return (size_t)snprintf(outbuf, outbuf_len, "[previous frame repeated %u more times]", loc->line_number);
+    }
+    return (size_t)snprintf(outbuf, outbuf_len, "[previous %u frames repeated %u more times]",
+                            (unsigned int)loc->method_name.cme_method_id, loc->line_number);
+  }
+  if (loc->method_qualifier_contents != BACKTRACIE_METHOD_QUALIFIER_CONTENTS_SELF_CLASS ||
+      loc->method_qualifier.self_class != Qnil) {
+    return backtracie_minimal_frame_name_cstr(loc, outbuf, outbuf_len);
+  }
+  // Backtracie always knows the class of self, so this frame came from the profile_frames capture backend, which
+  // doesn't; the best we can do is the plain label. Same semantics as backtracie (i.e. snprintf).
+  VALUE label = mpp_frame_label_value(frame);
+  if (!RB_TYPE_P(label, T_STRING)) {
+    return (size_t)snprintf(outbuf, outbuf_len, "%s", "");
+  }
+  return (size_t)snprintf(outbuf, outbuf_len, "%.*s", (int)RSTRING_LEN(label), RSTRING_PTR(label));
+}
+
+VALUE mpp_frame_label_value(struct mpp_frame *frame) {
+  minimal_location_t *loc = &frame->location;
+  if (mpp_location_is_synthetic(loc)) {
+    return Qnil;
+  }
+  if (loc->method_name_contents == BACKTRACIE_METHOD_NAME_CONTENTS_BASE_LABEL) {
+    return loc->method_name.base_label;
+  }
+  return rb_id2str(loc->method_name.cme_method_id);
+}
+size_t mpp_frame_file_name(struct mpp_frame *frame, char *outbuf, size_t outbuf_len) {
+  if (mpp_location_is_synthetic(&frame->location)) {
+    return (size_t)snprintf(outbuf, outbuf_len, "%s", "");
+  }
+  return backtracie_minimal_frame_filename_cstr(&frame->location, outbuf, outbuf_len);
+}
+
+VALUE mpp_frame_file_name_value(struct mpp_frame *frame) {
+  return mpp_location_is_synthetic(&frame->location) ? Qnil : frame->location.filename;
+}
+
+int mpp_frame_line_number(struct mpp_frame *frame) {
+  // Synthetic frames use the line number for something else.
+  return mpp_location_is_synthetic(&frame->location) ? 0 : frame->location.line_number;
+}
@@ -0,0 +1,224 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ruby_memprofiler_pprof.h"
+
+// The pprof string table is interned with a purpose-built open-addressing hash table, rather than an st_table. Every
+// frame name & filename interned goes through it, and it's kept across flushes, so it ends up holding every distinct
+// name in the app (tens of thousands of them, in a big Rails app):
+//
+//   * Each bucket holds the string's full 64-bit hash, its length and its first few bytes inline, so a probe can
+//     rule out nearly every non-matching bucket without following the pointer to the string itself; only a bucket
+//     that matches on all three gets a memcmp of the rest.
+//   * The hash reads eight bytes at a time and mixes them with a 64x64->128 bit multiply, in the style of wyhash,
+//     rather than going a byte at a time like st_hash's FNV-1a. Frame names & paths are often 50-100 bytes long.
+//   * The hash is stored on the entry too, so growing the table never re-hashes any strings.
+//
+// Deleted entries leave a tombstone behind, which is cleaned up when the table next grows (or is rebuilt at the same
+// size, if it's mostly tombstones). script/benchmark_string_table.rb compares it against the st_table it replaced.
+
+#define STRING_TABLE_EMPTY 0
+#define STRING_TABLE_TOMBSTONE 1
+#define STRING_TABLE_MIN_CAPA 256
+// Grow once live entries + tombstones would exceed 3/4 of the buckets.
+#define STRING_TABLE_MAX_USED(capa) (((capa) / 4) * 3)
+
+struct string_table_bucket {
+  // STRING_TABLE_EMPTY or STRING_TABLE_TOMBSTONE if there's no entry here; real hashes never take those values.
+  uint64_t hash;
+  uint32_t len;
+  // The first (up to) four bytes of the string, zero-padded.
+  uint32_t prefix;
+  struct mpp_string_table_entry *entry;
+};
+
+struct mpp_string_table {
+  struct string_table_bucket *buckets;
+  size_t capa;
+  // Number of buckets holding an entry.
+  size_t live;
+  // Number of buckets holding an entry or a tombstone.
+  size_t used;
+};
+
+static inline uint64_t string_hash_read64(const char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t string_hash_read32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t string_hash_mix(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+  uint64_t r = (a ^ (a >> 32)) * (b | 1);
+  return r ^ (r >> 29) ^ b;
+#endif
+}
+
+// These constants are wyhash's.
+#define STRING_HASH_P0 0xa0761d6478bd642fULL
+#define STRING_HASH_P1 0xe7037ed1a0b428dbULL
+#define STRING_HASH_P2 0x8ebc6af09c88c6e3ULL
+
+uint64_t mpp_string_hash(const char *str, size_t len) {
+  uint64_t seed = STRING_HASH_P0 ^ len;
+  uint64_t a, b;
+  if (len <= 16) {
+    if (len >= 4) {
+      // Two (possibly overlapping) reads from each end cover everything in between.
+      a = (string_hash_read32(str) << 32) | string_hash_read32(str + ((len >> 3) << 2));
+      b = (string_hash_read32(str + len - 4) << 32) | string_hash_read32(str + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = ((uint64_t)(unsigned char)str[0] << 16) | ((uint64_t)(unsigned char)str[len >> 1] << 8) |
+          (unsigned char)str[len - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    const char *p = str;
+    size_t remaining = len;
+    while (remaining > 16) {
+      seed = string_hash_mix(string_hash_read64(p) ^ STRING_HASH_P1, string_hash_read64(p + 8) ^ seed);
+      p += 16;
+      remaining -= 16;
+    }
+    // The last 16 bytes, overlapping what's already been mixed in if need be.
+    a = string_hash_read64(str + len - 16);
+    b = string_hash_read64(str + len - 8);
+  }
+  uint64_t hash = string_hash_mix(STRING_HASH_P1 ^ len, string_hash_mix(a ^ STRING_HASH_P1, b ^ seed ^ STRING_HASH_P2));
+  return hash > STRING_TABLE_TOMBSTONE ? hash : hash + 2;
+}
+
+static inline uint32_t string_prefix(const char *str, size_t len) {
+  uint32_t prefix = 0;
+  memcpy(&prefix, str, len < sizeof(prefix) ? len : sizeof(prefix));
+  return prefix;
+}
+
+static void string_table_init(struct mpp_string_table *t, size_t capa) {
+  t->capa = capa;
+  t->buckets = mpp_xmalloc(capa * sizeof(struct string_table_bucket));
+  memset(t->buckets, 0, capa * sizeof(struct string_table_bucket));
+  t->live = 0;
+  t->used = 0;
+}
+
+struct mpp_string_table *mpp_string_table_new(void) {
+  struct mpp_string_table *t = mpp_xmalloc(sizeof(struct mpp_string_table));
+  string_table_init(t, STRING_TABLE_MIN_CAPA);
+  return t;
+}
+
+void mpp_string_table_destroy(struct mpp_string_table *t) {
+  mpp_free(t->buckets);
+  mpp_free(t);
+}
+
+size_t mpp_string_table_memsize(struct mpp_string_table *t) {
+  return sizeof(struct mpp_string_table) + t->capa * sizeof(struct string_table_bucket);
+}
+
+size_t mpp_string_table_count(struct mpp_string_table *t) { return t->live; }
+
+size_t mpp_string_table_capa(struct mpp_string_table *t) { return t->capa; }
+
+size_t mpp_string_table_tombstones(struct mpp_string_table *t) { return t->used - t->live; }
+
+// Puts an entry, which mustn't already be present, into the table. The table must have room.
+static void string_table_add(struct mpp_string_table *t, uint64_t hash, uint32_t prefix,
+                             struct mpp_string_table_entry *entry) {
+  size_t mask = t->capa - 1;
+  size_t i = hash & mask;
+  while (t->buckets[i].hash > STRING_TABLE_TOMBSTONE) {
+    i = (i + 1) & mask;
+  }
+  struct string_table_bucket *b = &t->buckets[i];
+  if (b->hash == STRING_TABLE_EMPTY) {
+    t->used++;
+  }
+  t->live++;
+  b->hash = hash;
+  b->len = (uint32_t)entry->len;
+  b->prefix = prefix;
+  b->entry = entry;
+}
+
+static void string_table_rebuild(struct mpp_string_table *t, size_t capa) {
+  struct string_table_bucket *old_buckets = t->buckets;
+  size_t old_capa = t->capa;
+  string_table_init(t, capa);
+  for (size_t i = 0; i < old_capa; i++) {
+    struct string_table_bucket *b = &old_buckets[i];
+    if (b->hash > STRING_TABLE_TOMBSTONE) {
+      string_table_add(t, b->hash, b->prefix, b->entry);
+    }
+  }
+  mpp_free(old_buckets);
+}
+
+// Makes sure there's room for one more entry.
+static void string_table_ensure_room(struct mpp_string_table *t) {
+  if (t->used + 1 <= STRING_TABLE_MAX_USED(t->capa)) {
+    return;
+  }
+  // If it's mostly tombstones, rebuilding at the same size is enough to clean them up; otherwise, double it.
+  string_table_rebuild(t, t->live >= t->capa / 4 ? t->capa * 2 : t->capa);
+}
+
+// Returns the bucket for the string with this hash & contents, or the empty bucket where it would go.
+static struct string_table_bucket *string_table_find(struct mpp_string_table *t, uint64_t hash, uint32_t prefix,
+                                                     const char *str, size_t len) {
+  size_t mask = t->capa - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    struct string_table_bucket *b = &t->buckets[i];
+    if (b->hash == hash && b->len == len && b->prefix == prefix) {
+      // The first sizeof(prefix) bytes are known to match already.
+      if (len <= sizeof(prefix) ||
+          memcmp(b->entry->str + sizeof(prefix), str + sizeof(prefix), len - sizeof(prefix)) == 0) {
+        return b;
+      }
+    }
+    if (b->hash == STRING_TABLE_EMPTY) {
+      return b;
+    }
+  }
+}
+
+struct mpp_string_table_entry *mpp_string_table_lookup(struct mpp_string_table *t, uint64_t hash, const char *str,
+                                                       size_t len) {
+  return string_table_find(t, hash, string_prefix(str, len), str, len)->entry;
+}
+
+void mpp_string_table_add(struct mpp_string_table *t, struct mpp_string_table_entry *entry) {
+  string_table_ensure_room(t);
+  string_table_add(t, entry->hash, string_prefix(entry->str, entry->len), entry);
+}
+
+void mpp_string_table_delete(struct mpp_string_table *t, struct mpp_string_table_entry *entry) {
+  struct string_table_bucket *b = string_table_find(t, entry->hash, string_prefix(entry->str, entry->len),
+                                                    entry->str, entry->len);
+  MPP_ASSERT_MSG(b->entry == entry, "deleting a string that isn't in the string table");
+  b->hash = STRING_TABLE_TOMBSTONE;
+  b->entry = NULL;
+  t->live--;
+}
+
+void mpp_string_table_foreach(struct mpp_string_table *t, void (*fn)(struct mpp_string_table_entry *entry, void *arg),
+                              void *arg) {
+  for (size_t i = 0; i < t->capa; i++) {
+    if (t->buckets[i].hash > STRING_TABLE_TOMBSTONE) {
+      fn(t->buckets[i].entry, arg);
+    }
+  }
+}
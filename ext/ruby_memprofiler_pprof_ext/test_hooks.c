@@ -0,0 +1,589 @@
+#include "ruby_private.h"
+
+#include "ruby_memprofiler_pprof.h"
+
+#ifdef MPP_TEST_HOOKS
+
+// MemprofilerPprof::TestHooks holds thin Ruby wrappers around the extension's internal data structures, so that the
+// test suite can exercise them directly, rather than only through whatever a Collector happens to do with them.
+// They're not part of the gem's API, and are only compiled in for test builds (see extconf.rb). Objects are passed in
+// and out as plain Integer addresses, which the wrapped structures never dereference; nothing here checks that they're
+// being used sensibly. Slab is the exception, since it does hand out real memory; see below.
+
+static VALUE test_hooks_addr_arg(VALUE addr) { return (VALUE)NUM2SIZET(addr); }
+
+// ======== HeapBitmap ========
+
+static void test_hooks_heap_bitmap_free(void *ptr) {
+  if (ptr) {
+    mpp_heap_bitmap_destroy(ptr);
+  }
+}
+
+static size_t test_hooks_heap_bitmap_memsize(const void *ptr) {
+  return ptr ? mpp_heap_bitmap_memsize((struct mpp_heap_bitmap *)ptr) : 0;
+}
+
+static const rb_data_type_t test_hooks_heap_bitmap_type = {"mpp_test_hooks_heap_bitmap",
+                                                           {
+                                                               NULL,
+                                                               test_hooks_heap_bitmap_free,
+                                                               test_hooks_heap_bitmap_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+                                                               NULL,
+#endif
+                                                               {0}, /* reserved */
+                                                           },
+                                                           /* parent, data, [ flags ] */
+                                                           NULL,
+                                                           NULL,
+                                                           0};
+
+static struct mpp_heap_bitmap *test_hooks_heap_bitmap_get(VALUE self) {
+  return rb_check_typeddata(self, &test_hooks_heap_bitmap_type);
+}
+
+static VALUE test_hooks_heap_bitmap_alloc(VALUE klass) {
+  return TypedData_Wrap_Struct(klass, &test_hooks_heap_bitmap_type, mpp_heap_bitmap_new());
+}
+
+static VALUE test_hooks_heap_bitmap_set(VALUE self, VALUE addr) {
+  mpp_heap_bitmap_set(test_hooks_heap_bitmap_get(self), test_hooks_addr_arg(addr));
+  return Qnil;
+}
+
+static VALUE test_hooks_heap_bitmap_clear(VALUE self, VALUE addr) {
+  mpp_heap_bitmap_clear(test_hooks_heap_bitmap_get(self), test_hooks_addr_arg(addr));
+  return Qnil;
+}
+
+static VALUE test_hooks_heap_bitmap_test(VALUE self, VALUE addr) {
+  return mpp_heap_bitmap_test(test_hooks_heap_bitmap_get(self), test_hooks_addr_arg(addr)) ? Qtrue : Qfalse;
+}
+
+static VALUE test_hooks_heap_bitmap_clear_all(VALUE self) {
+  mpp_heap_bitmap_clear_all(test_hooks_heap_bitmap_get(self));
+  return Qnil;
+}
+
+static VALUE test_hooks_heap_bitmap_memsize_m(VALUE self) {
+  return SIZET2NUM(mpp_heap_bitmap_memsize(test_hooks_heap_bitmap_get(self)));
+}
+
+// ======== ValueTable ========
+
+static void test_hooks_value_table_free(void *ptr) {
+  if (ptr) {
+    mpp_value_table_destroy(ptr);
+  }
+}
+
+static size_t test_hooks_value_table_memsize(const void *ptr) {
+  return ptr ? mpp_value_table_memsize((struct mpp_value_table *)ptr) : 0;
+}
+
+static const rb_data_type_t test_hooks_value_table_type = {"mpp_test_hooks_value_table",
+                                                           {
+                                                               NULL,
+                                                               test_hooks_value_table_free,
+                                                               test_hooks_value_table_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+                                                               NULL,
+#endif
+                                                               {0}, /* reserved */
+                                                           },
+                                                           /* parent, data, [ flags ] */
+                                                           NULL,
+                                                           NULL,
+                                                           0};
+
+static struct mpp_value_table *test_hooks_value_table_get(VALUE self) {
+  struct mpp_value_table *t = rb_check_typeddata(self, &test_hooks_value_table_type);
+  if (!t) {
+    rb_raise(rb_eRuntimeError, "ruby_memprofiler_pprof: ValueTable not initialized");
+  }
+  return t;
+}
+
+static VALUE test_hooks_value_table_key_arg(VALUE key) {
+  VALUE k = test_hooks_addr_arg(key);
+  if (k == 0 || k == Qundef) {
+    rb_raise(rb_eArgError, "ruby_memprofiler_pprof: invalid key for value table");
+  }
+  return k;
+}
+
+static VALUE test_hooks_value_table_alloc(VALUE klass) {
+  return TypedData_Wrap_Struct(klass, &test_hooks_value_table_type, NULL);
+}
+
+static VALUE test_hooks_value_table_initialize(VALUE self, VALUE expected_entries) {
+  if (DATA_PTR(self)) {
+    rb_raise(rb_eRuntimeError, "ruby_memprofiler_pprof: ValueTable already initialized");
+  }
+  DATA_PTR(self) = mpp_value_table_new(NUM2SIZET(expected_entries));
+  return Qnil;
+}
+
+static VALUE test_hooks_value_table_insert(VALUE self, VALUE key, VALUE value) {
+  bool existed = mpp_value_table_insert(test_hooks_value_table_get(self), test_hooks_value_table_key_arg(key),
+                                        (st_data_t)NUM2SIZET(value));
+  return existed ? Qtrue : Qfalse;
+}
+
+static VALUE test_hooks_value_table_lookup(VALUE self, VALUE key) {
+  st_data_t value;
+  if (!mpp_value_table_lookup(test_hooks_value_table_get(self), test_hooks_value_table_key_arg(key), &value)) {
+    return Qnil;
+  }
+  return SIZET2NUM((size_t)value);
+}
+
+static VALUE test_hooks_value_table_delete(VALUE self, VALUE key) {
+  st_data_t value;
+  if (!mpp_value_table_delete(test_hooks_value_table_get(self), test_hooks_value_table_key_arg(key), &value)) {
+    return Qnil;
+  }
+  return SIZET2NUM((size_t)value);
+}
+
+static VALUE test_hooks_value_table_count(VALUE self) {
+  return SIZET2NUM(mpp_value_table_count(test_hooks_value_table_get(self)));
+}
+
+static VALUE test_hooks_value_table_migrating_p(VALUE self) {
+  return mpp_value_table_is_migrating(test_hooks_value_table_get(self)) ? Qtrue : Qfalse;
+}
+
+static int test_hooks_value_table_to_h_each(st_data_t key, st_data_t value, st_data_t arg) {
+  rb_hash_aset((VALUE)arg, SIZET2NUM((size_t)key), SIZET2NUM((size_t)value));
+  return ST_CONTINUE;
+}
+
+static VALUE test_hooks_value_table_to_h(VALUE self) {
+  VALUE hash = rb_hash_new();
+  mpp_value_table_foreach(test_hooks_value_table_get(self), test_hooks_value_table_to_h_each, (st_data_t)hash);
+  return hash;
+}
+
+static VALUE test_hooks_value_table_memsize_m(VALUE self) {
+  return SIZET2NUM(mpp_value_table_memsize(test_hooks_value_table_get(self)));
+}
+
+// ======== Slab ========
+
+// Objects are handed out to Ruby as Integer addresses, and read & freed through them, so the addresses of the objects
+// currently allocated are kept in a table; anything else passed back in is refused, rather than dereferenced.
+struct test_hooks_slab {
+  struct mpp_slab *slab;
+  size_t object_size;
+  st_table *allocated;
+};
+
+static void test_hooks_slab_free(void *ptr) {
+  struct test_hooks_slab *ts = ptr;
+  if (ts->slab) {
+    mpp_slab_destroy(ts->slab);
+    st_free_table(ts->allocated);
+  }
+  ruby_xfree(ts);
+}
+
+static size_t test_hooks_slab_memsize(const void *ptr) {
+  const struct test_hooks_slab *ts = ptr;
+  if (!ts->slab) {
+    return sizeof(struct test_hooks_slab);
+  }
+  return sizeof(struct test_hooks_slab) + mpp_slab_memsize(ts->slab) + st_memsize(ts->allocated);
+}
+
+static const rb_data_type_t test_hooks_slab_type = {"mpp_test_hooks_slab",
+                                                    {
+                                                        NULL,
+                                                        test_hooks_slab_free,
+                                                        test_hooks_slab_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+                                                        NULL,
+#endif
+                                                        {0}, /* reserved */
+                                                    },
+                                                    /* parent, data, [ flags ] */
+                                                    NULL,
+                                                    NULL,
+                                                    0};
+
+static struct test_hooks_slab *test_hooks_slab_get(VALUE self) {
+  struct test_hooks_slab *ts;
+  TypedData_Get_Struct(self, struct test_hooks_slab, &test_hooks_slab_type, ts);
+  if (!ts->slab) {
+    rb_raise(rb_eRuntimeError, "ruby_memprofiler_pprof: Slab not initialized");
+  }
+  return ts;
+}
+
+static VALUE test_hooks_slab_alloc(VALUE klass) {
+  struct test_hooks_slab *ts;
+  VALUE v = TypedData_Make_Struct(klass, struct test_hooks_slab, &test_hooks_slab_type, ts);
+  ts->slab = NULL;
+  ts->object_size = 0;
+  ts->allocated = NULL;
+  return v;
+}
+
+static VALUE test_hooks_slab_initialize(VALUE self, VALUE object_size) {
+  struct test_hooks_slab *ts;
+  TypedData_Get_Struct(self, struct test_hooks_slab, &test_hooks_slab_type, ts);
+  if (ts->slab) {
+    rb_raise(rb_eRuntimeError, "ruby_memprofiler_pprof: Slab already initialized");
+  }
+  ts->object_size = NUM2SIZET(object_size);
+  ts->slab = mpp_slab_new(ts->object_size, false);
+  ts->allocated = st_init_numtable();
+  return Qnil;
+}
+
+// Returns the address of a new object, after filling all of it with fill_byte; that way, the test can tell if any
+// objects overlap.
+static VALUE test_hooks_slab_alloc_m(VALUE self, VALUE fill_byte) {
+  struct test_hooks_slab *ts = test_hooks_slab_get(self);
+  void *mem = mpp_slab_alloc(ts->slab);
+  memset(mem, NUM2INT(fill_byte), ts->object_size);
+  st_insert(ts->allocated, (st_data_t)mem, 0);
+  return SIZET2NUM((size_t)mem);
+}
+
+// Returns the object at addr, raising unless it's one this slab handed out and which hasn't been freed since.
+static void *test_hooks_slab_object_arg(struct test_hooks_slab *ts, VALUE addr) {
+  void *mem = (void *)NUM2SIZET(addr);
+  if (!st_lookup(ts->allocated, (st_data_t)mem, NULL)) {
+    rb_raise(rb_eArgError, "ruby_memprofiler_pprof: %p is not an object allocated from this slab", mem);
+  }
+  return mem;
+}
+
+// Returns the bytes of the (allocated) object at addr.
+static VALUE test_hooks_slab_read(VALUE self, VALUE addr) {
+  struct test_hooks_slab *ts = test_hooks_slab_get(self);
+  return rb_str_new(test_hooks_slab_object_arg(ts, addr), (long)ts->object_size);
+}
+
+static VALUE test_hooks_slab_free_m(VALUE self, VALUE addr) {
+  struct test_hooks_slab *ts = test_hooks_slab_get(self);
+  st_data_t mem = (st_data_t)test_hooks_slab_object_arg(ts, addr);
+  st_delete(ts->allocated, &mem, NULL);
+  mpp_slab_free(ts->slab, (void *)mem);
+  return Qnil;
+}
+
+static VALUE test_hooks_slab_memsize_m(VALUE self) {
+  return SIZET2NUM(mpp_slab_memsize(test_hooks_slab_get(self)->slab));
+}
+
+// ======== StringTable ========
+
+// The entries are copies of the Strings inserted, which the table owns.
+struct test_hooks_string {
+  struct mpp_string_table_entry key;
+  char contents[];
+};
+
+static void test_hooks_string_table_free_each(struct mpp_string_table_entry *entry, void *arg) { mpp_free(entry); }
+
+static void test_hooks_string_table_free(void *ptr) {
+  if (ptr) {
+    mpp_string_table_foreach(ptr, test_hooks_string_table_free_each, NULL);
+    mpp_string_table_destroy(ptr);
+  }
+}
+
+static size_t test_hooks_string_table_memsize(const void *ptr) {
+  return ptr ? mpp_string_table_memsize((struct mpp_string_table *)ptr) : 0;
+}
+
+static const rb_data_type_t test_hooks_string_table_type = {"mpp_test_hooks_string_table",
+                                                            {
+                                                                NULL,
+                                                                test_hooks_string_table_free,
+                                                                test_hooks_string_table_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+                                                                NULL,
+#endif
+                                                                {0}, /* reserved */
+                                                            },
+                                                            /* parent, data, [ flags ] */
+                                                            NULL,
+                                                            NULL,
+                                                            0};
+
+static struct mpp_string_table *test_hooks_string_table_get(VALUE self) {
+  return rb_check_typeddata(self, &test_hooks_string_table_type);
+}
+
+static VALUE test_hooks_string_table_alloc(VALUE klass) {
+  return TypedData_Wrap_Struct(klass, &test_hooks_string_table_type, mpp_string_table_new());
+}
+
+// Methods taking a String also take an optional hash to use for it in place of its real one, so that tests can make
+// strings collide.
+static uint64_t test_hooks_string_table_hash_args(int argc, VALUE *argv, VALUE *str) {
+  VALUE hash;
+  rb_scan_args(argc, argv, "11", str, &hash);
+  StringValue(*str);
+  if (NIL_P(hash)) {
+    return mpp_string_hash(RSTRING_PTR(*str), RSTRING_LEN(*str));
+  }
+  uint64_t h = NUM2ULL(hash);
+  if (h < 2) {
+    rb_raise(rb_eArgError, "ruby_memprofiler_pprof: string table hashes can't be 0 or 1");
+  }
+  return h;
+}
+
+static VALUE test_hooks_string_table_s_hash(VALUE klass, VALUE str) {
+  StringValue(str);
+  return ULL2NUM(mpp_string_hash(RSTRING_PTR(str), RSTRING_LEN(str)));
+}
+
+// Returns false if the string was already in the table.
+static VALUE test_hooks_string_table_insert(int argc, VALUE *argv, VALUE self) {
+  struct mpp_string_table *t = test_hooks_string_table_get(self);
+  VALUE str;
+  uint64_t hash = test_hooks_string_table_hash_args(argc, argv, &str);
+  size_t len = RSTRING_LEN(str);
+  if (mpp_string_table_lookup(t, hash, RSTRING_PTR(str), len)) {
+    return Qfalse;
+  }
+  struct test_hooks_string *entry = mpp_xmalloc(sizeof(struct test_hooks_string) + len);
+  memcpy(entry->contents, RSTRING_PTR(str), len);
+  entry->key.str = entry->contents;
+  entry->key.len = len;
+  entry->key.hash = hash;
+  mpp_string_table_add(t, &entry->key);
+  return Qtrue;
+}
+
+static VALUE test_hooks_string_table_include_p(int argc, VALUE *argv, VALUE self) {
+  VALUE str;
+  uint64_t hash = test_hooks_string_table_hash_args(argc, argv, &str);
+  struct mpp_string_table_entry *entry =
+      mpp_string_table_lookup(test_hooks_string_table_get(self), hash, RSTRING_PTR(str), RSTRING_LEN(str));
+  return entry ? Qtrue : Qfalse;
+}
+
+// Returns false if the string wasn't in the table.
+static VALUE test_hooks_string_table_delete(int argc, VALUE *argv, VALUE self) {
+  struct mpp_string_table *t = test_hooks_string_table_get(self);
+  VALUE str;
+  uint64_t hash = test_hooks_string_table_hash_args(argc, argv, &str);
+  struct mpp_string_table_entry *entry = mpp_string_table_lookup(t, hash, RSTRING_PTR(str), RSTRING_LEN(str));
+  if (!entry) {
+    return Qfalse;
+  }
+  mpp_string_table_delete(t, entry);
+  mpp_free(entry);
+  return Qtrue;
+}
+
+// Looks up each of the Strings in strs (by their real hashes), and returns how many were found. This is a loop in C,
+// so that benchmarks measure the table rather than method calls.
+static VALUE test_hooks_string_table_count_found(VALUE self, VALUE strs) {
+  struct mpp_string_table *t = test_hooks_string_table_get(self);
+  Check_Type(strs, T_ARRAY);
+  long found = 0;
+  for (long i = 0; i < RARRAY_LEN(strs); i++) {
+    VALUE str = RARRAY_AREF(strs, i);
+    Check_Type(str, T_STRING);
+    const char *ptr = RSTRING_PTR(str);
+    size_t len = RSTRING_LEN(str);
+    if (mpp_string_table_lookup(t, mpp_string_hash(ptr, len), ptr, len)) {
+      found++;
+    }
+  }
+  return LONG2NUM(found);
+}
+
+static void test_hooks_string_table_to_a_each(struct mpp_string_table_entry *entry, void *arg) {
+  rb_ary_push((VALUE)arg, rb_str_new(entry->str, (long)entry->len));
+}
+
+static VALUE test_hooks_string_table_to_a(VALUE self) {
+  VALUE ary = rb_ary_new();
+  mpp_string_table_foreach(test_hooks_string_table_get(self), test_hooks_string_table_to_a_each, (void *)ary);
+  return ary;
+}
+
+static VALUE test_hooks_string_table_count(VALUE self) {
+  return SIZET2NUM(mpp_string_table_count(test_hooks_string_table_get(self)));
+}
+
+static VALUE test_hooks_string_table_capacity(VALUE self) {
+  return SIZET2NUM(mpp_string_table_capa(test_hooks_string_table_get(self)));
+}
+
+static VALUE test_hooks_string_table_tombstones(VALUE self) {
+  return SIZET2NUM(mpp_string_table_tombstones(test_hooks_string_table_get(self)));
+}
+
+static VALUE test_hooks_string_table_memsize_m(VALUE self) {
+  return SIZET2NUM(mpp_string_table_memsize(test_hooks_string_table_get(self)));
+}
+
+// ======== StTableStringTable ========
+
+// The st_table, keyed by (pointer, length) and hashed with st_hash's FNV-1a, that the string table replaced. It's only
+// here as a baseline for script/benchmark_string_table.rb to measure the string table against, so like the rest of
+// this file it never makes it into a normal build of the extension.
+
+struct test_hooks_st_string {
+  const char *str;
+  size_t len;
+  char contents[];
+};
+
+static int test_hooks_st_string_compare(st_data_t arg1, st_data_t arg2) {
+  struct test_hooks_st_string *k1 = (struct test_hooks_st_string *)arg1;
+  struct test_hooks_st_string *k2 = (struct test_hooks_st_string *)arg2;
+  size_t smaller_len = (k1->len > k2->len) ? k2->len : k1->len;
+  int cmp = memcmp(k1->str, k2->str, smaller_len);
+  if (cmp != 0 || k1->len == k2->len) {
+    return cmp;
+  }
+  return k1->len > k2->len ? 1 : -1;
+}
+
+static st_index_t test_hooks_st_string_hash(st_data_t arg) {
+  struct test_hooks_st_string *k = (struct test_hooks_st_string *)arg;
+  return st_hash(k->str, k->len, 0x811c9dc5);
+}
+
+static const struct st_hash_type test_hooks_st_string_hash_type = {
+    .compare = test_hooks_st_string_compare,
+    .hash = test_hooks_st_string_hash,
+};
+
+static int test_hooks_st_string_table_free_each(st_data_t key, st_data_t value, st_data_t arg) {
+  mpp_free((void *)key);
+  return ST_CONTINUE;
+}
+
+static void test_hooks_st_string_table_free(void *ptr) {
+  if (ptr) {
+    st_foreach(ptr, test_hooks_st_string_table_free_each, 0);
+    st_free_table(ptr);
+  }
+}
+
+static size_t test_hooks_st_string_table_memsize(const void *ptr) { return ptr ? st_memsize(ptr) : 0; }
+
+static const rb_data_type_t test_hooks_st_string_table_type = {"mpp_test_hooks_st_string_table",
+                                                               {
+                                                                   NULL,
+                                                                   test_hooks_st_string_table_free,
+                                                                   test_hooks_st_string_table_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+                                                                   NULL,
+#endif
+                                                                   {0}, /* reserved */
+                                                               },
+                                                               /* parent, data, [ flags ] */
+                                                               NULL,
+                                                               NULL,
+                                                               0};
+
+static st_table *test_hooks_st_string_table_get(VALUE self) {
+  return rb_check_typeddata(self, &test_hooks_st_string_table_type);
+}
+
+static VALUE test_hooks_st_string_table_alloc(VALUE klass) {
+  return TypedData_Wrap_Struct(klass, &test_hooks_st_string_table_type,
+                               st_init_table(&test_hooks_st_string_hash_type));
+}
+
+static VALUE test_hooks_st_string_table_insert(VALUE self, VALUE str) {
+  st_table *t = test_hooks_st_string_table_get(self);
+  StringValue(str);
+  struct test_hooks_st_string key = {.str = RSTRING_PTR(str), .len = RSTRING_LEN(str)};
+  if (st_lookup(t, (st_data_t)&key, NULL)) {
+    return Qfalse;
+  }
+  struct test_hooks_st_string *entry = mpp_xmalloc(sizeof(struct test_hooks_st_string) + key.len);
+  memcpy(entry->contents, key.str, key.len);
+  entry->str = entry->contents;
+  entry->len = key.len;
+  st_insert(t, (st_data_t)entry, 0);
+  return Qtrue;
+}
+
+static VALUE test_hooks_st_string_table_count_found(VALUE self, VALUE strs) {
+  st_table *t = test_hooks_st_string_table_get(self);
+  Check_Type(strs, T_ARRAY);
+  long found = 0;
+  for (long i = 0; i < RARRAY_LEN(strs); i++) {
+    VALUE str = RARRAY_AREF(strs, i);
+    Check_Type(str, T_STRING);
+    struct test_hooks_st_string key = {.str = RSTRING_PTR(str), .len = RSTRING_LEN(str)};
+    if (st_lookup(t, (st_data_t)&key, NULL)) {
+      found++;
+    }
+  }
+  return LONG2NUM(found);
+}
+
+static VALUE test_hooks_st_string_table_count(VALUE self) {
+  return SIZET2NUM(test_hooks_st_string_table_get(self)->num_entries);
+}
+
+void mpp_setup_test_hooks_module(void) {
+  VALUE mMemprofilerPprof = rb_const_get(rb_cObject, rb_intern("MemprofilerPprof"));
+  VALUE mTestHooks = rb_define_module_under(mMemprofilerPprof, "TestHooks");
+
+  VALUE cHeapBitmap = rb_define_class_under(mTestHooks, "HeapBitmap", rb_cObject);
+  rb_define_alloc_func(cHeapBitmap, test_hooks_heap_bitmap_alloc);
+  rb_define_const(cHeapBitmap, "PAGE_SIZE", SIZET2NUM(HEAP_PAGE_ALIGN));
+  rb_define_const(cHeapBitmap, "SLOT_SIZE", SIZET2NUM(sizeof(RVALUE)));
+  rb_define_method(cHeapBitmap, "set", test_hooks_heap_bitmap_set, 1);
+  rb_define_method(cHeapBitmap, "clear", test_hooks_heap_bitmap_clear, 1);
+  rb_define_method(cHeapBitmap, "test", test_hooks_heap_bitmap_test, 1);
+  rb_define_method(cHeapBitmap, "clear_all", test_hooks_heap_bitmap_clear_all, 0);
+  rb_define_method(cHeapBitmap, "memsize", test_hooks_heap_bitmap_memsize_m, 0);
+
+  VALUE cValueTable = rb_define_class_under(mTestHooks, "ValueTable", rb_cObject);
+  rb_define_alloc_func(cValueTable, test_hooks_value_table_alloc);
+  rb_define_method(cValueTable, "initialize", test_hooks_value_table_initialize, 1);
+  rb_define_method(cValueTable, "insert", test_hooks_value_table_insert, 2);
+  rb_define_method(cValueTable, "lookup", test_hooks_value_table_lookup, 1);
+  rb_define_method(cValueTable, "delete", test_hooks_value_table_delete, 1);
+  rb_define_method(cValueTable, "count", test_hooks_value_table_count, 0);
+  rb_define_method(cValueTable, "migrating?", test_hooks_value_table_migrating_p, 0);
+  rb_define_method(cValueTable, "to_h", test_hooks_value_table_to_h, 0);
+  rb_define_method(cValueTable, "memsize", test_hooks_value_table_memsize_m, 0);
+
+  VALUE cSlab = rb_define_class_under(mTestHooks, "Slab", rb_cObject);
+  rb_define_alloc_func(cSlab, test_hooks_slab_alloc);
+  rb_define_method(cSlab, "initialize", test_hooks_slab_initialize, 1);
+  rb_define_method(cSlab, "alloc", test_hooks_slab_alloc_m, 1);
+  rb_define_method(cSlab, "read", test_hooks_slab_read, 1);
+  rb_define_method(cSlab, "free", test_hooks_slab_free_m, 1);
+  rb_define_method(cSlab, "memsize", test_hooks_slab_memsize_m, 0);
+
+  VALUE cStringTable = rb_define_class_under(mTestHooks, "StringTable", rb_cObject);
+  rb_define_alloc_func(cStringTable, test_hooks_string_table_alloc);
+  rb_define_singleton_method(cStringTable, "hash_string", test_hooks_string_table_s_hash, 1);
+  rb_define_method(cStringTable, "insert", test_hooks_string_table_insert, -1);
+  rb_define_method(cStringTable, "include?", test_hooks_string_table_include_p, -1);
+  rb_define_method(cStringTable, "delete", test_hooks_string_table_delete, -1);
+  rb_define_method(cStringTable, "count_found", test_hooks_string_table_count_found, 1);
+  rb_define_method(cStringTable, "to_a", test_hooks_string_table_to_a, 0);
+  rb_define_method(cStringTable, "count", test_hooks_string_table_count, 0);
+  rb_define_method(cStringTable, "capacity", test_hooks_string_table_capacity, 0);
+  rb_define_method(cStringTable, "tombstones", test_hooks_string_table_tombstones, 0);
+  rb_define_method(cStringTable, "memsize", test_hooks_string_table_memsize_m, 0);
+
+  VALUE cStTableStringTable = rb_define_class_under(mTestHooks, "StTableStringTable", rb_cObject);
+  rb_define_alloc_func(cStTableStringTable, test_hooks_st_string_table_alloc);
+  rb_define_method(cStTableStringTable, "insert", test_hooks_st_string_table_insert, 1);
+  rb_define_method(cStTableStringTable, "count_found", test_hooks_st_string_table_count_found, 1);
+  rb_define_method(cStTableStringTable, "count", test_hooks_st_string_table_count, 0);
+}
+
+#endif
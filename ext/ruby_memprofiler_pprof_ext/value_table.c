@@ -0,0 +1,330 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include <ruby.h>
+#include <ruby/st.h>
+
+#include "ruby_memprofiler_pprof.h"
+
+// A hash table of (VALUE) -> (st_data_t), for keys which are pointers to Ruby heap objects. It's used instead of
+// st_table for the heap sample map & mark table, because those live on the newobj/freeobj hook path:
+//
+//   * It's open-addressing with linear probing, so a lookup is a hash and a short scan of one flat array, with no
+//     pointer chasing through st_table's separate entries & bins arrays.
+//   * The hash is a single multiply. Heap VALUEs are all multiples of the (40 byte) slot size, so their low bits
+//     carry no information; Fibonacci hashing takes the high bits of the product instead, which mixes the bits that
+//     do vary.
+//   * It never rehashes the whole table in one go. When it needs to grow, a new bucket array is allocated and
+//     entries are migrated over a few buckets at a time on subsequent inserts & deletes, whilst lookups consult both
+//     arrays. This keeps the worst-case latency of any one operation in a hook bounded, rather than stalling for a
+//     full rehash of tens of thousands of entries whilst the GC is disabled.
+//
+// Deleted entries are replaced with a tombstone, so that deleting never moves other entries around (which also means
+// deleting from within mpp_value_table_foreach is safe). Tombstones are cleaned up when the table next migrates.
+
+#define VALUE_TABLE_EMPTY ((VALUE)0)
+#define VALUE_TABLE_TOMBSTONE Qundef
+#define VALUE_TABLE_MIN_CAPA_LOG2 6
+// Number of buckets of the old array migrated per insert/delete, whilst the table is growing.
+#define VALUE_TABLE_MIGRATE_STEP 64
+// Grow once live entries + tombstones would exceed 3/4 of the buckets.
+#define VALUE_TABLE_MAX_USED(capa) (((capa) / 4) * 3)
+
+struct value_table_bucket {
+  VALUE key;
+  st_data_t value;
+};
+
+struct value_table_array {
+  struct value_table_bucket *buckets;
+  size_t capa;
+  unsigned int capa_log2;
+  // Number of buckets holding an entry.
+  size_t live;
+  // Number of buckets holding an entry or a tombstone.
+  size_t used;
+};
+
+struct mpp_value_table {
+  // The array new entries are inserted into.
+  struct value_table_array cur;
+  // Whilst migrating, the array entries are being moved out of; otherwise, buckets is NULL.
+  struct value_table_array old;
+  // Buckets in old below this have been migrated.
+  size_t migrate_pos;
+};
+
+static inline size_t value_table_hash(VALUE key, unsigned int capa_log2) {
+  return (size_t)(((uint64_t)(key >> 3) * 0x9E3779B97F4A7C15ULL) >> (64 - capa_log2));
+}
+
+static unsigned int value_table_capa_log2_for(size_t expected_entries) {
+  unsigned int capa_log2 = VALUE_TABLE_MIN_CAPA_LOG2;
+  while (VALUE_TABLE_MAX_USED((size_t)1 << capa_log2) < expected_entries) {
+    capa_log2++;
+  }
+  return capa_log2;
+}
+
+static void value_table_array_init(struct value_table_array *arr, unsigned int capa_log2) {
+  arr->capa_log2 = capa_log2;
+  arr->capa = (size_t)1 << capa_log2;
+  arr->buckets = mpp_xmalloc(arr->capa * sizeof(struct value_table_bucket));
+  memset(arr->buckets, 0, arr->capa * sizeof(struct value_table_bucket));
+  arr->live = 0;
+  arr->used = 0;
+}
+
+static void value_table_array_free(struct value_table_array *arr) {
+  if (arr->buckets) {
+    mpp_free(arr->buckets);
+  }
+  arr->buckets = NULL;
+  arr->capa = 0;
+  arr->live = 0;
+  arr->used = 0;
+}
+
+// Returns the bucket holding key, or NULL.
+static struct value_table_bucket *value_table_array_find(struct value_table_array *arr, VALUE key) {
+  size_t mask = arr->capa - 1;
+  for (size_t i = value_table_hash(key, arr->capa_log2);; i = (i + 1) & mask) {
+    struct value_table_bucket *b = &arr->buckets[i];
+    if (b->key == key) {
+      return b;
+    }
+    if (b->key == VALUE_TABLE_EMPTY) {
+      return NULL;
+    }
+  }
+}
+
+// Puts key, which must not already be present, into the array and returns its bucket. The array must have room.
+static struct value_table_bucket *value_table_array_add(struct value_table_array *arr, VALUE key, st_data_t value) {
+  size_t mask = arr->capa - 1;
+  size_t i = value_table_hash(key, arr->capa_log2);
+  while (arr->buckets[i].key != VALUE_TABLE_EMPTY && arr->buckets[i].key != VALUE_TABLE_TOMBSTONE) {
+    i = (i + 1) & mask;
+  }
+  struct value_table_bucket *b = &arr->buckets[i];
+  if (b->key == VALUE_TABLE_EMPTY) {
+    arr->used++;
+  }
+  arr->live++;
+  b->key = key;
+  b->value = value;
+  return b;
+}
+
+static void value_table_array_remove(struct value_table_array *arr, struct value_table_bucket *b) {
+  b->key = VALUE_TABLE_TOMBSTONE;
+  arr->live--;
+}
+
+static void value_table_migrate_step(struct mpp_value_table *t, size_t max_buckets) {
+  if (!t->old.buckets) {
+    return;
+  }
+  size_t end = t->migrate_pos + max_buckets;
+  if (end > t->old.capa) {
+    end = t->old.capa;
+  }
+  for (; t->migrate_pos < end; t->migrate_pos++) {
+    struct value_table_bucket *b = &t->old.buckets[t->migrate_pos];
+    if (b->key != VALUE_TABLE_EMPTY && b->key != VALUE_TABLE_TOMBSTONE) {
+      value_table_array_add(&t->cur, b->key, b->value);
+      // Leave a tombstone, so that lookups for other keys in old still probe past this bucket.
+      value_table_array_remove(&t->old, b);
+    }
+  }
+  if (t->migrate_pos == t->old.capa) {
+    value_table_array_free(&t->old);
+  }
+}
+
+static void value_table_finish_migration(struct mpp_value_table *t) { value_table_migrate_step(t, SIZE_MAX / 2); }
+
+// Starts migrating everything into a new array with 2^capa_log2 buckets.
+static void value_table_start_migration(struct mpp_value_table *t, unsigned int capa_log2) {
+  value_table_finish_migration(t);
+  t->old = t->cur;
+  t->migrate_pos = 0;
+  value_table_array_init(&t->cur, capa_log2);
+}
+
+// Makes sure there's room in cur for one more entry.
+static void value_table_ensure_room(struct mpp_value_table *t) {
+  if (t->cur.used + 1 <= VALUE_TABLE_MAX_USED(t->cur.capa)) {
+    return;
+  }
+  // If it's mostly tombstones, migrating into a same-sized array is enough to clean them up; otherwise, double it.
+  // Either way, the new array has room for everything in the old one plus all the inserts that can happen before
+  // migration completes, so migrations never overlap.
+  unsigned int capa_log2 = t->cur.capa_log2;
+  if (t->cur.live >= t->cur.capa / 4) {
+    capa_log2++;
+  }
+  value_table_start_migration(t, capa_log2);
+}
+
+struct mpp_value_table *mpp_value_table_new(size_t expected_entries) {
+  struct mpp_value_table *t = mpp_xmalloc(sizeof(struct mpp_value_table));
+  value_table_array_init(&t->cur, value_table_capa_log2_for(expected_entries));
+  memset(&t->old, 0, sizeof(struct value_table_array));
+  t->migrate_pos = 0;
+  return t;
+}
+
+void mpp_value_table_destroy(struct mpp_value_table *t) {
+  value_table_array_free(&t->cur);
+  value_table_array_free(&t->old);
+  mpp_free(t);
+}
+
+size_t mpp_value_table_memsize(struct mpp_value_table *t) {
+  return sizeof(struct mpp_value_table) + (t->cur.capa + t->old.capa) * sizeof(struct value_table_bucket);
+}
+
+size_t mpp_value_table_count(struct mpp_value_table *t) { return t->cur.live + t->old.live; }
+
+bool mpp_value_table_is_migrating(struct mpp_value_table *t) { return t->old.buckets != NULL; }
+
+void mpp_value_table_reserve(struct mpp_value_table *t, size_t expected_entries) {
+  unsigned int capa_log2 = value_table_capa_log2_for(expected_entries);
+  if (capa_log2 > t->cur.capa_log2) {
+    value_table_start_migration(t, capa_log2);
+  }
+}
+
+st_data_t *mpp_value_table_lookup_ptr(struct mpp_value_table *t, VALUE key) {
+  struct value_table_bucket *b = value_table_array_find(&t->cur, key);
+  if (!b && t->old.buckets) {
+    b = value_table_array_find(&t->old, key);
+  }
+  return b ? &b->value : NULL;
+}
+
+bool mpp_value_table_lookup(struct mpp_value_table *t, VALUE key, st_data_t *value_out) {
+  st_data_t *value = mpp_value_table_lookup_ptr(t, key);
+  if (!value) {
+    return false;
+  }
+  if (value_out) {
+    *value_out = *value;
+  }
+  return true;
+}
+
+st_data_t *mpp_value_table_lookup_or_insert(struct mpp_value_table *t, VALUE key, bool *existed) {
+  MPP_ASSERT_MSG(key != VALUE_TABLE_EMPTY && key != VALUE_TABLE_TOMBSTONE, "invalid key for value table");
+  value_table_migrate_step(t, VALUE_TABLE_MIGRATE_STEP);
+
+  struct value_table_bucket *b = value_table_array_find(&t->cur, key);
+  if (!b && t->old.buckets) {
+    b = value_table_array_find(&t->old, key);
+  }
+  if (b) {
+    if (existed) {
+      *existed = true;
+    }
+    return &b->value;
+  }
+
+  value_table_ensure_room(t);
+  if (existed) {
+    *existed = false;
+  }
+  return &value_table_array_add(&t->cur, key, 0)->value;
+}
+
+bool mpp_value_table_insert(struct mpp_value_table *t, VALUE key, st_data_t value) {
+  bool existed;
+  *mpp_value_table_lookup_or_insert(t, key, &existed) = value;
+  return existed;
+}
+
+bool mpp_value_table_delete(struct mpp_value_table *t, VALUE key, st_data_t *value_out) {
+  value_table_migrate_step(t, VALUE_TABLE_MIGRATE_STEP);
+
+  struct value_table_array *arr = &t->cur;
+  struct value_table_bucket *b = value_table_array_find(arr, key);
+  if (!b && t->old.buckets) {
+    arr = &t->old;
+    b = value_table_array_find(arr, key);
+  }
+  if (!b) {
+    return false;
+  }
+  if (value_out) {
+    *value_out = b->value;
+  }
+  value_table_array_remove(arr, b);
+  return true;
+}
+
+static bool value_table_array_foreach(struct value_table_array *arr, mpp_value_table_foreach_fn *fn, st_data_t arg) {
+  for (size_t i = 0; i < arr->capa; i++) {
+    struct value_table_bucket *b = &arr->buckets[i];
+    if (b->key == VALUE_TABLE_EMPTY || b->key == VALUE_TABLE_TOMBSTONE) {
+      continue;
+    }
+    switch (fn((st_data_t)b->key, b->value, arg)) {
+    case ST_DELETE:
+      value_table_array_remove(arr, b);
+      break;
+    case ST_STOP:
+      return false;
+    }
+  }
+  return true;
+}
+
+void mpp_value_table_foreach(struct mpp_value_table *t, mpp_value_table_foreach_fn *fn, st_data_t arg) {
+  if (t->old.buckets && !value_table_array_foreach(&t->old, fn, arg)) {
+    return;
+  }
+  value_table_array_foreach(&t->cur, fn, arg);
+}
+
+size_t mpp_value_table_keys(struct mpp_value_table *t, VALUE *keys_out, size_t keys_capa) {
+  size_t n = 0;
+  struct value_table_array *arrs[2] = {&t->old, &t->cur};
+  for (int a = 0; a < 2; a++) {
+    for (size_t i = 0; i < arrs[a]->capa && n < keys_capa; i++) {
+      VALUE key = arrs[a]->buckets[i].key;
+      if (key != VALUE_TABLE_EMPTY && key != VALUE_TABLE_TOMBSTONE) {
+        keys_out[n++] = key;
+      }
+    }
+  }
+  return n;
+}
+
+void mpp_value_table_rekey(struct mpp_value_table *t, mpp_value_table_rekey_fn *fn, mpp_value_table_merge_fn *merge,
+                           void *ctx) {
+  value_table_finish_migration(t);
+  struct value_table_array src = t->cur;
+  value_table_array_init(&t->cur, src.capa_log2);
+  for (size_t i = 0; i < src.capa; i++) {
+    struct value_table_bucket *b = &src.buckets[i];
+    if (b->key == VALUE_TABLE_EMPTY || b->key == VALUE_TABLE_TOMBSTONE) {
+      continue;
+    }
+    st_data_t value = b->value;
+    VALUE new_key = fn(b->key, &value, ctx);
+    struct value_table_bucket *existing = value_table_array_find(&t->cur, new_key);
+    if (existing) {
+      merge(&existing->value, value, ctx);
+    } else {
+      value_table_array_add(&t->cur, new_key, value);
+    }
+  }
+  value_table_array_free(&src);
+}
+
+void mpp_value_table_clear(struct mpp_value_table *t) {
+  value_table_array_free(&t->old);
+  memset(t->cur.buckets, 0, t->cur.capa * sizeof(struct value_table_bucket));
+  t->cur.live = 0;
+  t->cur.used = 0;
+}
@@ -8,11 +8,21 @@
 require "logger"
 require "ruby_memprofiler_pprof"
 
-collector = MemprofilerPprof::Collector.new
+collector = MemprofilerPprof::Collector.new(
+  huge_pages: ENV.fetch("RUBY_MEMPROFILER_PPROF_HUGE_PAGES", "0") == "1",
+  pretty_backtraces: ENV.fetch("RUBY_MEMPROFILER_PPROF_PRETTY_BACKTRACES", "1") != "0",
+  capture_backend: ENV.fetch("RUBY_MEMPROFILER_PPROF_CAPTURE_BACKEND", "backtracie").to_sym,
+  fold_recursion: ENV.fetch("RUBY_MEMPROFILER_PPROF_FOLD_RECURSION", "0") == "1",
+  elide_files: ENV.fetch("RUBY_MEMPROFILER_PPROF_ELIDE_FILES", "").split(",").reject(&:empty?),
+  elide_methods: ENV.fetch("RUBY_MEMPROFILER_PPROF_ELIDE_METHODS", "").split(",").reject(&:empty?)
+)
 collector.sample_rate = ENV.fetch("RUBY_MEMPROFILER_PPROF_SAMPLE_RATE", "1").to_f
 if ENV.key?("RUBY_MEMPROFILER_PPROF_MAX_HEAP_SAMPLES")
   collector.max_heap_samples = ENV["RUBY_MEMPROFILER_PPROF_MAX_HEAP_SAMPLES"].to_i
 end
+if ENV.key?("RUBY_MEMPROFILER_PPROF_MAX_STACK_DEPTH")
+  collector.max_stack_depth = ENV["RUBY_MEMPROFILER_PPROF_MAX_STACK_DEPTH"].to_i
+end
 
 kwargs = {
   logger: Logger.new($stderr)
@@ -41,5 +41,17 @@ Benchmark.bm(36) do |b|
       File.write("tmp/benchmark-#{perc}p.pb.gz", $collector.flush.pprof_data)
       $collector.stop!
     end
+
+    leak_pit = []
+    sc = BENCHMARK_SCENARIO.dup
+    GC.start
+    $collector.pretty_backtraces = false
+    b.report("with reporting (#{perc}%, plain names)") do
+      $collector.start!
+
+      benchmark_machine(sc, leak_pit)
+      File.write("tmp/benchmark-#{perc}p-plain.pb.gz", $collector.flush.pprof_data)
+      $collector.stop!
+    end
   end
 end
@@ -0,0 +1,57 @@
+#!/usr/bin/env ruby
+
+# Compares the pprof string table's interner against the st_table (keyed by pointer & length, hashed with FNV-1a)
+# that it replaced, on a Rails-sized set of method names & gem paths. Lookups are skewed towards a few common strings,
+# like the frames of real stacks are.
+#
+# Both tables are only reachable through MemprofilerPprof::TestHooks, so this needs a test build of the extension:
+#
+#     MPP_TEST_HOOKS=true bundle exec rake compile
+#     bundle exec ruby script/benchmark_string_table.rb
+
+require "bundler/setup"
+require "benchmark"
+require "ruby_memprofiler_pprof"
+
+unless defined?(MemprofilerPprof::TestHooks)
+  abort "MemprofilerPprof::TestHooks isn't built in; compile with `MPP_TEST_HOOKS=true bundle exec rake compile`"
+end
+
+NUM_STRINGS = 60_000
+NUM_LOOKUPS = 5_000_000
+ROUNDS = 3
+
+MODULES = %w[ActiveRecord ActionController ActiveSupport ActionView ActiveModel Rack ActionDispatch Arel Sprockets
+  Devise Sidekiq App Api::V1 Admin].freeze
+GEMS = %w[activerecord-7.0.4 actionpack-7.0.4 activesupport-7.0.4 actionview-7.0.4 activemodel-7.0.4 rack-2.2.6
+  arel-9.0.0 sprockets-4.2.0 devise-4.8.1 sidekiq-7.0.2 app app/controllers/api/v1 app/admin].freeze
+
+rng = Random.new(42)
+strings = NUM_STRINGS.times.map do |i|
+  case rng.rand(3)
+  when 0 then "/usr/local/bundle/ruby/3.1.0/gems/#{GEMS.sample(random: rng)}/lib/support/module_#{i}.rb"
+  when 1 then "#{MODULES.sample(random: rng)}::Component#{i % 997}::Handler#process_#{i}"
+  else "#{MODULES.sample(random: rng)}::Concern#{i % 211}.method_#{i}"
+  end
+end
+# Looked up by copies, so that nothing can get away with comparing pointers.
+lookups = NUM_LOOKUPS.times.map { strings[(rng.rand**3 * NUM_STRINGS).to_i].dup }
+
+tables = {
+  "st_table + FNV-1a" => MemprofilerPprof::TestHooks::StTableStringTable,
+  "string table" => MemprofilerPprof::TestHooks::StringTable
+}
+
+ROUNDS.times do |round|
+  puts "Round #{round + 1}: #{NUM_STRINGS} strings, #{NUM_LOOKUPS} lookups"
+  tables.each do |name, klass|
+    GC.start
+    t = klass.new
+    build = Benchmark.realtime { strings.each { |s| t.insert(s) } }
+    found = nil
+    lookup = Benchmark.realtime { found = t.count_found(lookups) }
+    raise "#{name} only found #{found} of #{NUM_LOOKUPS} strings" unless found == NUM_LOOKUPS
+    printf("  %-20s build %7.1f ms   lookups %7.1f ms (%5.1f ns each)\n",
+      name, build * 1e3, lookup * 1e3, lookup * 1e9 / NUM_LOOKUPS)
+  end
+end
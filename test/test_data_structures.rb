@@ -0,0 +1,232 @@
+# frozen_string_literal: true
+
+require_relative "test_helper"
+
+describe MemprofilerPprof::TestHooks::HeapBitmap do
+  it "sets, clears and tests bits across radix tree levels" do
+    bm = MemprofilerPprof::TestHooks::HeapBitmap.new
+    page = MemprofilerPprof::TestHooks::HeapBitmap::PAGE_SIZE
+    slot = MemprofilerPprof::TestHooks::HeapBitmap::SLOT_SIZE
+    # Each leaf of the tree covers 2^11 heap pages, and each mid level 2^11 leaves.
+    leaf_span = page << 11
+    mid_span = leaf_span << 11
+    base = 0x7f00_0000_0000
+    addrs = [
+      base, base + slot, base + 64 * slot, base + page - slot, base + page,
+      base + leaf_span, base + leaf_span + slot, base + mid_span, base + 3 * mid_span + 5 * page + 7 * slot
+    ]
+    assert(addrs.none? { |a| bm.test(a) })
+    empty_memsize = bm.memsize
+
+    set = []
+    addrs.each do |addr|
+      memsize_before = bm.memsize
+      bm.set(addr)
+      set << addr
+      addrs.each { |a| assert_equal set.include?(a), bm.test(a), "testing #{a.to_s(16)} after setting #{addr.to_s(16)}" }
+      # Setting a bit in a leaf (or mid level) of its own allocates it.
+      assert_operator bm.memsize, :>, memsize_before if [base, base + leaf_span, base + mid_span].include?(addr)
+    end
+    # The other slots on those pages are still clear.
+    refute bm.test(base + 2 * slot)
+    refute bm.test(base + leaf_span + 2 * slot)
+
+    addrs.each_slice(2) { |a, _| bm.clear(a) }
+    addrs.each_with_index { |a, i| assert_equal i.odd?, bm.test(a) }
+    # Clearing a bit in a part of the tree that was never allocated doesn't allocate it.
+    memsize = bm.memsize
+    bm.clear(base + 7 * mid_span)
+    assert_equal memsize, bm.memsize
+
+    bm.clear_all
+    assert(addrs.none? { |a| bm.test(a) })
+    # The levels are kept for next time.
+    assert_operator bm.memsize, :>, empty_memsize
+    assert_equal memsize, bm.memsize
+
+    # Addresses beyond the tree's reach can't be tracked, so they always might be in the set.
+    assert bm.test(1 << 48)
+  end
+end
+
+describe MemprofilerPprof::TestHooks::ValueTable do
+  # Keys look like heap object addresses.
+  def value_table_key(i)
+    0x7f00_0000_0000 + i * MemprofilerPprof::TestHooks::HeapBitmap::SLOT_SIZE
+  end
+
+  it "keeps every entry when inserts and deletes are interleaved with a migration" do
+    t = MemprofilerPprof::TestHooks::ValueTable.new(10_000)
+    model = {}
+    next_key = 0
+    until t.migrating?
+      refute t.insert(value_table_key(next_key), next_key)
+      model[value_table_key(next_key)] = next_key
+      next_key += 1
+    end
+
+    rng = Random.new(1234)
+    deleted = []
+    ops = 0
+    while t.migrating?
+      case rng.rand(4)
+      when 0
+        refute t.insert(value_table_key(next_key), next_key)
+        model[value_table_key(next_key)] = next_key
+        next_key += 1
+      when 1
+        key = model.keys.sample(random: rng)
+        assert_equal model.delete(key), t.delete(key)
+        assert_nil t.delete(key)
+        deleted << key
+      when 2
+        key = model.keys.sample(random: rng)
+        assert t.insert(key, model[key] + 1)
+        model[key] += 1
+      when 3
+        # Put back something deleted earlier in the migration.
+        key = deleted.pop or next
+        refute t.insert(key, 7)
+        model[key] = 7
+      end
+      ops += 1
+      key = model.keys.sample(random: rng)
+      assert_equal model[key], t.lookup(key)
+      assert_equal model.size, t.count
+    end
+    # The migration was spread over many operations, rather than done all at once.
+    assert_operator ops, :>, 100
+
+    assert_equal model, t.to_h
+    model.each { |key, value| assert_equal value, t.lookup(key) }
+    deleted.each { |key| assert_nil t.lookup(key) }
+  end
+
+  it "cleans up tombstones without growing when entries churn" do
+    t = MemprofilerPprof::TestHooks::ValueTable.new(0)
+    memsize = t.memsize
+    1000.times do |i|
+      refute t.insert(value_table_key(i), i)
+      assert_equal i - 5, t.delete(value_table_key(i - 5)) if i >= 5
+    end
+    expected = (995...1000).to_h { |i| [value_table_key(i), i] }
+    assert_equal expected, t.to_h
+    assert_equal memsize, t.memsize
+  end
+end
+
+describe MemprofilerPprof::TestHooks::Slab do
+  def slab_fill(byte, size)
+    ([byte].pack("C") * size).b
+  end
+
+  it "hands freed objects straight back out" do
+    slab = MemprofilerPprof::TestHooks::Slab.new(24)
+    addrs = 100.times.map { |i| slab.alloc(i) }
+    assert_equal 100, addrs.uniq.size
+    addrs.each { |addr| assert_equal 0, addr % 16 }
+    addrs.each_with_index { |addr, i| assert_equal slab_fill(i, 24), slab.read(addr) }
+    memsize = slab.memsize
+
+    freed = addrs.select.with_index { |_, i| i.even? }
+    freed.each { |addr| slab.free(addr) }
+    reused = freed.map { slab.alloc(255) }
+    assert_equal freed.sort, reused.sort
+    assert_equal memsize, slab.memsize
+    # Re-using the freed objects didn't touch the ones still allocated.
+    addrs.each_with_index { |addr, i| assert_equal slab_fill(i.even? ? 255 : i, 24), slab.read(addr) }
+
+    # Once the free list is used up, objects come from fresh memory again.
+    refute_includes addrs, slab.alloc(0)
+  end
+
+  it "maps more memory only once what it has is used up" do
+    slab = MemprofilerPprof::TestHooks::Slab.new(1000)
+    addrs = [slab.alloc(1)]
+    memsize = slab.memsize
+    addrs << slab.alloc(1) while slab.memsize == memsize
+    grown_memsize = slab.memsize
+
+    addrs.each { |addr| slab.free(addr) }
+    addrs.size.times { slab.alloc(2) }
+    assert_equal grown_memsize, slab.memsize
+
+    # Objects bigger than a whole chunk get a chunk of their own.
+    big_slab = MemprofilerPprof::TestHooks::Slab.new(200_000)
+    big = 3.times.map { |i| big_slab.alloc(i) }
+    big.each_with_index { |addr, i| assert_equal slab_fill(i, 200_000), big_slab.read(addr) }
+  end
+
+  it "refuses addresses it didn't hand out" do
+    slab = MemprofilerPprof::TestHooks::Slab.new(24)
+    addr = slab.alloc(1)
+    assert_raises(ArgumentError) { slab.read(0) }
+    assert_raises(ArgumentError) { slab.free(addr + 8) }
+
+    slab.free(addr)
+    assert_raises(ArgumentError) { slab.read(addr) }
+    assert_raises(ArgumentError) { slab.free(addr) }
+  end
+end
+
+describe MemprofilerPprof::TestHooks::StringTable do
+  it "tells apart strings whose hashes collide" do
+    t = MemprofilerPprof::TestHooks::StringTable.new
+    # Same length, same first few bytes, and prefixes of one another, so that nothing but the full comparison can
+    # tell them apart.
+    strs = ["", "a", "ab", "abcd", "abcde", "abcdf"] + 100.times.map { |i| format("frame_%04d", i) }
+    strs += strs.map { |s| s + "/" * 40 }
+    strs.each { |s| assert t.insert(s, 2) }
+    strs.each { |s| refute t.insert(s, 2) }
+    # Different hashes that land in the same bucket collide too, without being equal.
+    bucket_mates = 20.times.map { |i| ["bucket_mate", 2 + (i + 1) * t.capacity] }
+    bucket_mates.each { |s, h| assert t.insert(s, h) }
+    assert_equal strs.size + bucket_mates.size, t.count
+
+    strs.each { |s| assert t.include?(s, 2), "looking up #{s.inspect}" }
+    bucket_mates.each { |s, h| assert t.include?(s, h) }
+    refute t.include?("frame_0100", 2)
+    refute t.include?("abc", 2)
+    # A string's real hash isn't the one it was inserted with, so it's not found by that.
+    refute t.include?("frame_0001")
+
+    # Entries further along the probe sequence are still found past the gaps deleted ones leave behind.
+    deleted, kept = strs.partition.with_index { |_, i| i.even? }
+    deleted.each { |s| assert t.delete(s, 2) }
+    deleted.each { |s| refute t.delete(s, 2) }
+    kept.each { |s| assert t.include?(s, 2) }
+    deleted.each { |s| refute t.include?(s, 2) }
+    bucket_mates.each { |s, h| assert t.include?(s, h) }
+    expected = (kept + bucket_mates.map(&:first)).sort
+    assert_equal expected, t.to_a.sort
+
+    deleted.each { |s| assert t.insert(s, 2) }
+    strs.each { |s| assert t.include?(s, 2) }
+  end
+
+  it "grows once three quarters full, and cleans up tombstones without growing when entries churn" do
+    t = MemprofilerPprof::TestHooks::StringTable.new
+    capacity = t.capacity
+    strs = []
+    while t.capacity == capacity
+      strs << "string_#{strs.size}"
+      t.insert(strs.last)
+    end
+    assert_equal capacity * 3 / 4 + 1, strs.size
+    assert_equal capacity * 2, t.capacity
+    assert_equal 0, t.tombstones
+    strs.each { |s| assert t.include?(s) }
+
+    t = MemprofilerPprof::TestHooks::StringTable.new
+    memsize = t.memsize
+    10_000.times do |i|
+      assert t.insert("churn_#{i}")
+      assert t.delete("churn_#{i - 5}") if i >= 5
+    end
+    assert_equal capacity, t.capacity
+    assert_equal memsize, t.memsize
+    assert_operator t.tombstones, :<, capacity * 3 / 4
+    assert_equal 5, t.count
+    (9_995...10_000).each { |i| assert t.include?("churn_#{i}") }
+  end
+end
@@ -4,13 +4,15 @@ require "bundler/setup"
 require "ruby_memprofiler_pprof"
 require_relative "pprof_pb"
 require "minitest/autorun"
+require "objspace"
 require "securerandom"
 require "zlib"
 require "timecop"
 
 class DecodedProfileData
   class Sample
-    attr_accessor :backtrace, :line_backtrace, :allocations, :allocation_size, :retained_objects, :retained_size
+    attr_accessor :backtrace, :line_backtrace, :location_ids, :allocations, :allocation_size, :retained_objects,
+      :retained_size
 
     def backtrace_contains?(stack_segment)
       return false if stack_segment.size > backtrace.size
@@ -20,6 +22,11 @@ class DecodedProfileData
         end
       end
     end
+
+    # Number of frames in the backtrace which are in the given function.
+    def count_frames(fn_name)
+      backtrace.count { |fn| fn.include? fn_name }
+    end
   end
 
   attr_reader :samples, :pprof
@@ -41,6 +48,7 @@ class DecodedProfileData
       s = Sample.new
       s.line_backtrace = []
       s.backtrace = []
+      s.location_ids = sample_proto.location_id.to_a
       sample_proto.location_id.map do |loc_id|
         fn = @fn_map[@loc_map[loc_id].line[0].function_id]
         fn_name = @pprof.string_table[fn.name]
@@ -64,8 +72,13 @@ class DecodedProfileData
     @samples.select { |s| s.backtrace_contains?(stack_segment) && s.retained_objects > 0 }
   end
 
-  def total_retained_objects
-    @samples.reduce(0) { |acc, s| acc + s.retained_objects }
+  def total_retained_objects(under: nil)
+    @samples.reduce(0) do |acc, s|
+      if under
+        next acc unless s.backtrace_contains? [under]
+      end
+      acc + s.retained_objects
+    end
   end
 
   def total_retained_size(under: nil)
@@ -87,3 +100,22 @@ class DecodedProfileData
     end
   end
 end
+
+module ProfilingHelpers
+  # Profiles the block with a collector made with the given options (sampling every allocation, unless they say
+  # otherwise) or the one passed in, and returns the decoded profile. The block is given an array to retain its
+  # allocations in.
+  def profile_allocations(collector = nil, **collector_opts)
+    collector ||= MemprofilerPprof::Collector.new(sample_rate: 1.0, **collector_opts)
+    retain = []
+    DecodedProfileData.new(collector.profile { yield retain })
+  end
+
+  # Allocates a String from depth levels of recursion down, for tests that need stacks of a particular depth; its
+  # backtrace has depth + 1 recursive_allocation_func frames.
+  def recursive_allocation_func(depth)
+    (depth == 0) ? SecureRandom.hex(10) : recursive_allocation_func(depth - 1)
+  end
+end
+
+Minitest::Spec.include ProfilingHelpers
@@ -31,9 +31,424 @@ describe MemprofilerPprof::Collector do
     profile_2 = DecodedProfileData.new(profile_2_data)
     profile_3 = DecodedProfileData.new(profile_3_data)
 
-    assert_operator profile_1.heap_samples_including_stack(["leak_into_bucket_1"]).size, :>=, 1000
-    assert_operator profile_2.heap_samples_including_stack(["leak_into_bucket_1"]).size, :>=, 1000
-    assert_operator profile_3.heap_samples_including_stack(["leak_into_bucket_1"]).size, :<, 10
+    assert_operator profile_1.heap_samples_including_stack(["leak_into_bucket_1"]).sum(&:retained_objects), :>=, 1000
+    assert_operator profile_2.heap_samples_including_stack(["leak_into_bucket_1"]).sum(&:retained_objects), :>=, 1000
+    assert_operator profile_3.heap_samples_including_stack(["leak_into_bucket_1"]).sum(&:retained_objects), :<, 10
+  end
+
+  it "records the file each frame is in" do
+    alloc_line = __LINE__ + 2
+    def file_name_allocation_func
+      SecureRandom.hex(20)
+    end
+
+    pprof = profile_allocations do |retain|
+      100.times { retain << file_name_allocation_func }
+    end
+
+    # Just the strings; the method's own call caches are allocated under it too.
+    samples = pprof.heap_samples_including_stack(["file_name_allocation_func", "hex"])
+    assert_operator samples.sum(&:retained_objects), :>=, 100
+    samples.each do |s|
+      frame = s.line_backtrace[s.backtrace.index { |fn| fn.include?("file_name_allocation_func") }]
+      assert frame.start_with?("#{File.expand_path(__FILE__)}:#{alloc_line} in "), frame
+    end
+    # Each string appears in the string table exactly once, however many frames refer to it.
+    assert_equal pprof.pprof.string_table.uniq.size, pprof.pprof.string_table.size
+  end
+
+  it "names functions by their plain labels without pretty_backtraces" do
+    def plain_label_allocation_func
+      SecureRandom.hex(20)
+    end
+
+    pprof = profile_allocations(pretty_backtraces: false) do |retain|
+      100.times { retain << plain_label_allocation_func }
+    end
+
+    samples = pprof.heap_samples_including_stack(["plain_label_allocation_func", "hex"])
+    assert_operator samples.sum(&:retained_objects), :>=, 100
+    samples.each do |s|
+      # Methods written in Ruby and in C alike are named without their class (e.g. not Random::Formatter#hex).
+      caller_index = s.backtrace.index("plain_label_allocation_func")
+      refute_nil caller_index
+      assert_equal "hex", s.backtrace[caller_index - 1]
+      assert_includes s.backtrace, "times"
+      refute(s.backtrace.any? { |fn| fn.match?(/[#.]\w/) }, s.backtrace.inspect)
+    end
+  end
+
+  it "captures backtraces in one pass with the profile_frames backend" do
+    c = MemprofilerPprof::Collector.new(sample_rate: 1.0, capture_backend: :profile_frames)
+    assert_equal :profile_frames, c.capture_backend
+    pprof = profile_allocations(c) do |retain|
+      # The second is deeper than one batch of rb_profile_frames.
+      [5, 300].each { |depth| 50.times { retain << recursive_allocation_func(depth) } }
+    end
+
+    samples = pprof.heap_samples_including_stack(["recursive_allocation_func"])
+    # Every frame of the recursion is captured once, none lost or repeated where one batch ends and the next begins.
+    objects_by_depth = Hash.new(0)
+    samples.each { |s| objects_by_depth[s.count_frames("recursive_allocation_func")] += s.retained_objects }
+    assert_equal [6, 301], objects_by_depth.keys.sort
+    assert_operator objects_by_depth[6], :>=, 50
+    assert_operator objects_by_depth[301], :>=, 50
+    # ...and so are the frames outside it, all the way out past the helper that ran the profile.
+    assert(samples.all? { |s| s.backtrace_contains?(["profile_allocations"]) })
+
+    assert_raises(ArgumentError) { MemprofilerPprof::Collector.new(capture_backend: :nope) }
+  end
+
+  it "records only the allocation site with the allocation_site backend" do
+    site_line = __LINE__ + 2
+    def allocation_site_func
+      Object.new
+    end
+
+    def elided_site_helper(depth)
+      (depth == 0) ? Object.new : elided_site_helper(depth - 1)
+    end
+
+    c = MemprofilerPprof::Collector.new(sample_rate: 1.0, capture_backend: :allocation_site,
+      elide_methods: ["elided_site_"])
+    assert_equal :allocation_site, c.capture_backend
+    caller_line = nil
+    pprof = profile_allocations(c) do |retain|
+      100.times { retain << allocation_site_func }
+      # Behind more elided frames than are looked at in the first go.
+      caller_line = __LINE__ + 1
+      100.times { retain << elided_site_helper(10) }
+    end
+
+    assert(pprof.samples.all? { |s| s.backtrace.size <= 1 })
+    objects_by_site = Hash.new(0)
+    pprof.samples.each { |s| objects_by_site[s.line_backtrace.first[/\A.*:\d+(?= in )/]] += s.retained_objects }
+    assert_operator objects_by_site["#{File.expand_path(__FILE__)}:#{site_line}"], :>=, 100
+    assert_operator objects_by_site["#{File.expand_path(__FILE__)}:#{caller_line}"], :>=, 100
+  end
+
+  it "captures stacks that share outer frames with the one before" do
+    c = MemprofilerPprof::Collector.new(sample_rate: 1.0)
+    pprof = profile_allocations(c) do |retain|
+      # Each stack shares all but its innermost few frames with the one before it, but is a different depth.
+      10.times { [40, 10, 41, 0, 39].each { |depth| retain << recursive_allocation_func(depth) } }
+    end
+
+    samples = pprof.heap_samples_including_stack(["recursive_allocation_func", "hex"])
+    objects_by_depth = Hash.new(0)
+    samples.each { |s| objects_by_depth[s.count_frames("recursive_allocation_func")] += s.retained_objects }
+    assert_equal [1, 11, 40, 41, 42], objects_by_depth.keys.sort
+    objects_by_depth.each_value { |objects| assert_operator objects, :>=, 10 }
+    # Outside the recursion, every stack is made of the very same frames.
+    outer_frames = samples.map do |s|
+      s.location_ids.drop(s.backtrace.rindex { |fn| fn.include?("recursive_allocation_func") } + 1)
+    end
+    assert_equal 1, outer_frames.uniq.size
+    assert c.mark_table_complete?
+  end
+
+  it "only captures the frames that changed since the thread's last backtrace" do
+    # Each of these allocates from a method of its own, so none of their backtraces can be found by fingerprint.
+    leaves = Array.new(100) do |i|
+      name = :"changed_frames_leaf_#{i}"
+      singleton_class.class_eval("def #{name}; String.new; end", "changed_frames_leaf_#{i}.rb", 1)
+      name
+    end
+
+    def changed_frames_at_depth(depth, &blk)
+      (depth == 0) ? yield : changed_frames_at_depth(depth - 1, &blk)
+    end
+
+    frames_captured = {}
+    [10, 210].each do |depth|
+      pprof = profile_allocations(capture_backend: :backtracie) do |retain|
+        changed_frames_at_depth(depth) { leaves.each { |leaf| retain << send(leaf) } }
+      end
+      samples = pprof.heap_samples_including_stack(["changed_frames_leaf_"])
+      assert_operator samples.size, :>=, 90
+      # The frames that weren't captured again are still there.
+      samples.each { |s| assert_equal depth + 1, s.count_frames("changed_frames_at_depth") }
+      frames_captured[depth] = pprof.frames_captured
+    end
+    # Only the first backtrace is captured all the way down; the rest just from the leaf method up, however deep the
+    # recursion beneath it. Capturing every frame of each would take another 200 frames per backtrace at the greater
+    # depth.
+    assert_operator frames_captured[210] - frames_captured[10], :<, 1000
+    assert_operator frames_captured[210], :<, 100 * 210 / 10
+  end
+
+  it "attributes repeated allocations from the same sites to the right stacks" do
+    def repeated_site_func_a
+      SecureRandom.hex(10)
+    end
+
+    def repeated_site_func_b
+      SecureRandom.hex(10)
+    end
+
+    c = MemprofilerPprof::Collector.new(sample_rate: 1.0)
+    pprof = profile_allocations(c) do |retain|
+      501.times do |i|
+        retain << repeated_site_func_a
+        retain << repeated_site_func_b
+        # The sample log is drained at the end of a GC, which is when the fingerprints of these two stacks are
+        # remembered. From then on, allocations from the same sites ought to be found by fingerprint.
+        GC.start if i == 0
+      end
+    end
+
+    a_samples = pprof.heap_samples_including_stack(["repeated_site_func_a", "hex"])
+    b_samples = pprof.heap_samples_including_stack(["repeated_site_func_b", "hex"])
+    assert_operator a_samples.sum(&:retained_objects), :>=, 501
+    assert_operator b_samples.sum(&:retained_objects), :>=, 501
+    assert_operator pprof.samples_found_by_fingerprint, :>=, 1000
+    # A hit refers to the stack it was remembered for, not just any stack.
+    assert a_samples.none? { |s| s.backtrace_contains?(["repeated_site_func_b"]) }
+    assert b_samples.none? { |s| s.backtrace_contains?(["repeated_site_func_a"]) }
+    assert c.mark_table_complete?
+  end
+
+  it "keeps finding stacks by fingerprint when unrelated code gets freed" do
+    def freed_code_site_func
+      SecureRandom.hex(10)
+    end
+
+    c = MemprofilerPprof::Collector.new(sample_rate: 1.0)
+    pprof = profile_allocations(c) do |retain|
+      200.times do
+        # Each GC frees the previous iteration's class and its method, whose addresses could turn up again in some
+        # other backtrace. That mustn't cost us the fingerprints of the stacks that are still around.
+        Class.new { def throwaway_method; end }
+        GC.start
+        retain << freed_code_site_func
+      end
+    end
+
+    samples = pprof.heap_samples_including_stack(["freed_code_site_func", "hex"])
+    assert_operator samples.sum(&:retained_objects), :>=, 200
+    assert_operator pprof.samples_found_by_fingerprint, :>=, 150
+    assert c.mark_table_complete?
+  end
+
+  it "truncates backtraces deeper than max_stack_depth" do
+    allocate = proc { |retain| 50.times { retain << recursive_allocation_func(100) } }
+    full = profile_allocations(&allocate).heap_samples_including_stack(["recursive_allocation_func", "hex"])
+    c = MemprofilerPprof::Collector.new(sample_rate: 1.0, max_stack_depth: 10)
+    assert_equal 10, c.max_stack_depth
+    pprof = profile_allocations(c, &allocate)
+
+    samples = pprof.heap_samples_including_stack(["recursive_allocation_func", "hex"])
+    assert_operator samples.sum(&:retained_objects), :>=, 50
+    # The depth of each untruncated stack, by its innermost ten frames.
+    full_depths = full.to_h { |s| [s.backtrace.first(10), s.backtrace.size] }
+    assert(full_depths.values.all? { |depth| depth > 100 })
+    samples.each do |s|
+      # The innermost ten frames are kept as they were, and the marker comes straight after them, in place of the rest.
+      assert_equal 11, s.backtrace.size
+      full_depth = full_depths[s.backtrace.first(10)]
+      refute_nil full_depth, s.backtrace.inspect
+      truncated = s.backtrace.last[/\A\[truncated (\d+) frames\]\z/, 1]
+      refute_nil truncated, s.backtrace.last
+      # It's counted from the control frames on the stack, a few of which never show up in a backtrace.
+      assert_operator truncated.to_i, :>=, full_depth - 10
+    end
+
+    c.max_stack_depth = nil
+    assert_nil c.max_stack_depth
+    assert_raises(ArgumentError) { MemprofilerPprof::Collector.new(max_stack_depth: 0) }
+  end
+
+  it "folds repeated frames with fold_recursion" do
+    c = MemprofilerPprof::Collector.new(sample_rate: 1.0, fold_recursion: true)
+    assert c.fold_recursion
+    pprof = profile_allocations(c) do |retain|
+      [20, 50].each { |depth| 20.times { retain << recursive_allocation_func(depth) } }
+    end
+
+    objects_by_marker = Hash.new(0)
+    pprof.heap_samples_including_stack(["recursive_allocation_func", "hex"]).each do |s|
+      # The recursion is folded into its first frame, followed by a marker counting the rest.
+      assert_equal 1, s.count_frames("recursive_allocation_func")
+      marker = s.backtrace[s.backtrace.index { |fn| fn.include?("recursive_allocation_func") } + 1]
+      objects_by_marker[marker] += s.retained_objects
+    end
+    markers = ["[previous frame repeated 20 more times]", "[previous frame repeated 50 more times]"]
+    assert_equal markers, objects_by_marker.keys.sort
+    objects_by_marker.each_value { |objects| assert_operator objects, :>=, 20 }
+  end
+
+  it "elides frames matching elide_files and elide_methods" do
+    def elided_wrapper_func
+      elided_inner_allocation_func
+    end
+
+    def elided_inner_allocation_func
+      SecureRandom.hex(10)
+    end
+
+    stdlib_dir = RbConfig::CONFIG["rubylibdir"]
+    c = MemprofilerPprof::Collector.new(sample_rate: 1.0, elide_files: [stdlib_dir], elide_methods: ["elided_wrapper_"])
+    assert_equal ["elided_wrapper_"], c.elide_methods
+    allocate = proc { |retain| 100.times { retain << elided_wrapper_func } }
+    # Both from the same call site, so that the frames outside the block are the same too.
+    full, elided = [nil, c].map { |collector| profile_allocations(collector, &allocate) }
+
+    full_samples = full.heap_samples_including_stack(["elided_inner_allocation_func"])
+    assert(full_samples.all? { |s| s.backtrace_contains?(["elided_wrapper_func", "elided_inner_allocation_func"]) })
+    # Each backtrace is what it would have been without eliding anything, less exactly the frames that match.
+    expected = full_samples.map do |s|
+      s.line_backtrace.reject { |l| l.start_with?(stdlib_dir) || l.include?("elided_wrapper_func") }
+    end
+    samples = elided.heap_samples_including_stack(["elided_inner_allocation_func"])
+    assert_operator samples.sum(&:retained_objects), :>=, 100
+    samples.each do |s|
+      assert_includes expected, s.line_backtrace
+      refute s.backtrace_contains?(["elided_wrapper_func"])
+    end
+
+    assert_raises(TypeError) { MemprofilerPprof::Collector.new(elide_files: "nope") }
+  end
+
+  it "emits one sample per stack, however many objects share it" do
+    def aggregated_allocation_func
+      Object.new
+    end
+
+    pprof = profile_allocations do |retain|
+      1000.times { retain << aggregated_allocation_func }
+    end
+
+    # All thousand objects came from the same stack, so they're one sample.
+    samples = pprof.samples_including_stack(["aggregated_allocation_func", "new"])
+    assert_equal 1, samples.size
+    assert_operator samples.first.retained_objects, :>=, 1000
+    assert_operator samples.first.retained_size, :>=, samples.first.retained_objects * 40
+    # Nor does any other stack get more than one sample.
+    stacks = pprof.samples.map(&:location_ids)
+    assert_equal stacks.uniq.size, stacks.size
+  end
+
+  it "flushes per-stack counts without visiting samples with counts_only" do
+    def counted_allocation_func
+      SecureRandom.hex(5000)
+    end
+
+    c = MemprofilerPprof::Collector.new(sample_rate: 1.0)
+    retain = []
+    c.start!
+    1000.times { retain << counted_allocation_func }
+    GC.start
+    # No full flush has visited these samples yet, so their sizes come from when the sample log was drained.
+    counts_profile_data = c.flush(counts_only: true)
+    full_profile_data = c.flush
+    retain.fill(nil, 500)
+    GC.start
+    after_free_profile_data = c.flush(counts_only: true)
+    c.stop!
+
+    counts = DecodedProfileData.new(counts_profile_data).heap_samples_including_stack(["counted_allocation_func"])
+    full = DecodedProfileData.new(full_profile_data).heap_samples_including_stack(["counted_allocation_func"])
+    after_free = DecodedProfileData.new(after_free_profile_data)
+      .heap_samples_including_stack(["counted_allocation_func"])
+    assert_operator counts.sum(&:retained_objects), :>=, 1000
+    assert_operator counts.sum(&:retained_size), :>=, 1000 * 10000
+    # Measuring every sample again in a full flush finds the same objects and sizes.
+    assert_equal counts.sum(&:retained_objects), full.sum(&:retained_objects)
+    assert_equal counts.sum(&:retained_size), full.sum(&:retained_size)
+    # Freed samples take their bytes with them. (The GC scans the machine stack conservatively, so the odd string can
+    # outlive its last reference.)
+    freed = counts.sum(&:retained_objects) - after_free.sum(&:retained_objects)
+    assert_includes 495..500, freed
+    assert_operator after_free.sum(&:retained_size), :>=, 500 * 10000
+    assert_operator after_free.sum(&:retained_size), :<=, counts.sum(&:retained_size) - freed * 10000
+  end
+
+  it "keeps function IDs stable from one flush to the next" do
+    def stable_allocation_func
+      Object.new
+    end
+
+    c = MemprofilerPprof::Collector.new(sample_rate: 1.0)
+    retain = []
+    c.start!
+    100.times { retain << stable_allocation_func }
+    profiles = 3.times.map { DecodedProfileData.new(c.flush).pprof }
+    c.stop!
+
+    functions = profiles.map do |pprof|
+      pprof.function.find { |fn| pprof.string_table[fn.name].include?("stable_allocation_func") }
+    end
+    refute_nil functions[0]
+    assert_equal 1, functions.map(&:id).uniq.size
+    names = profiles.zip(functions).map { |pprof, fn| pprof.string_table[fn.name] }
+    assert_equal 1, names.uniq.size
+  end
+
+  it "only puts the strings each profile uses in its string table" do
+    def first_flush_allocation_func
+      Object.new
+    end
+
+    def second_flush_allocation_func
+      Object.new
+    end
+
+    def allocate_into(retain, count)
+      count.times { retain << yield }
+    end
+
+    # The first call from each call site allocates its call cache, which would be sampled under these stacks and then
+    # outlive the objects we're freeing; get those out of the way first.
+    allocate_into([], 1) { first_flush_allocation_func }
+    allocate_into([], 1) { second_flush_allocation_func }
+
+    c = MemprofilerPprof::Collector.new(sample_rate: 1.0)
+    retain = []
+    c.start!
+    allocate_into(retain, 100) { first_flush_allocation_func }
+    first = DecodedProfileData.new(c.flush).pprof
+    retain.clear
+    GC.start
+    allocate_into(retain, 100) { second_flush_allocation_func }
+    second = DecodedProfileData.new(c.flush).pprof
+    c.stop!
+
+    assert(first.string_table.any? { |s| s.include?("first_flush_allocation_func") })
+    assert(second.string_table.any? { |s| s.include?("second_flush_allocation_func") })
+    assert(second.string_table.none? { |s| s.include?("first_flush_allocation_func") })
+    [first, second].each do |pprof|
+      assert_equal "", pprof.string_table[0]
+      assert_equal pprof.string_table.size, pprof.string_table.uniq.size
+      # Every string in the table is referred to by something in the profile.
+      used = [0]
+      pprof.sample_type.each { |vt| used.push(vt.type, vt.unit) }
+      pprof.function.each { |fn| used.push(fn.name, fn.system_name, fn.filename) }
+      all_indexes = (0...pprof.string_table.size).to_a
+      assert_equal all_indexes, used.uniq.sort
+    end
+  end
+
+  it "keeps location IDs stable from one flush to the next, and unique within each profile" do
+    def stable_location_allocation_func
+      Object.new
+    end
+
+    c = MemprofilerPprof::Collector.new(sample_rate: 1.0)
+    retain = []
+    c.start!
+    100.times { retain << stable_location_allocation_func }
+    profiles = 3.times.map { DecodedProfileData.new(c.flush).pprof }
+    c.stop!
+
+    location_ids = profiles.map do |pprof|
+      assert_equal pprof.location.size, pprof.location.map(&:id).uniq.size
+      function_ids = pprof.function.map(&:id)
+      pprof.location.each { |loc| loc.line.each { |line| assert_includes function_ids, line.function_id } }
+
+      fn = pprof.function.find { |f| pprof.string_table[f.name].include?("stable_location_allocation_func") }
+      pprof.location.find { |loc| loc.line.any? { |line| line.function_id == fn.id } }.id
+    end
+    assert_equal 1, location_ids.uniq.size
   end
 
   it "captures allocation sizes" do
@@ -86,6 +501,33 @@ describe MemprofilerPprof::Collector do
     end
   end
 
+  it "names frames correctly across flushes as methods come and go" do
+    c = MemprofilerPprof::Collector.new(sample_rate: 1.0)
+    retain = {}
+    c.start!
+    12.times do |i|
+      Object.class_eval("def churned_allocation_func_#{i}; Object.new; end", __FILE__, __LINE__)
+      retain[i] = Array.new(10) { send("churned_allocation_func_#{i}") }
+      if i >= 3
+        retain.delete(i - 3)
+        Object.send(:remove_method, "churned_allocation_func_#{i - 3}")
+      end
+      GC.start
+      GC.compact if ::GC.respond_to?(:compact) && i.even?
+
+      pprof = DecodedProfileData.new(c.flush)
+      retain.each_key do |j|
+        samples = pprof.heap_samples_including_stack(["churned_allocation_func_#{j}"])
+        assert_operator samples.sum(&:retained_objects), :>=, 10
+      end
+      # The removed method's iseq can outlive it for as long as a cached fingerprint refers to it, along with the
+      # odd internal object Ruby allocated from inside it (e.g. a call cache), but the objects it returned are gone.
+      gone = pprof.heap_samples_including_stack(["churned_allocation_func_#{i - 3}"])
+      assert_operator gone.sum(&:retained_objects), :<, 10 if i >= 3
+    end
+    c.stop!
+  end
+
   it "respects max heap samples" do
     c = MemprofilerPprof::Collector.new(sample_rate: 1.0, max_heap_samples: 20)
     retain = []
@@ -96,4 +538,89 @@ describe MemprofilerPprof::Collector do
     pprof = DecodedProfileData.new(profile_data)
     assert_operator pprof.dropped_samples_heap_bufsize, :>=, 80
   end
+
+  it "drops samples when the sample log fills up before it can be drained" do
+    c = MemprofilerPprof::Collector.new(sample_rate: 1.0)
+    pprof = profile_allocations(c) do |retain|
+      # String#split allocates all of its substrings without reaching a safe point, where the postponed job that
+      # drains the sample log could run; the log starts out with room for 1024 samples.
+      retain.concat(("x " * 5000).split(" "))
+    end
+
+    logged = pprof.heap_samples_including_stack(["split"]).sum(&:retained_objects)
+    assert_operator logged, :>, 0
+    assert_operator pprof.dropped_samples_log_full, :>=, 5000 - 1024
+    assert_operator logged + pprof.dropped_samples_log_full, :>=, 5000
+
+    # The log gets grown to fit them once it's drained, so the same burst of allocations doesn't lose any again.
+    pprof = profile_allocations(c) do |retain|
+      retain.concat(("x " * 5000).split(" "))
+    end
+    assert_equal 0, pprof.dropped_samples_log_full
+    assert_operator pprof.heap_samples_including_stack(["split"]).sum(&:retained_objects), :>=, 5000
+
+    # Allocations that leave room for the log to be drained don't lose anything.
+    pprof = profile_allocations(c) do |retain|
+      5000.times { retain << Object.new }
+    end
+    assert_equal 0, pprof.dropped_samples_log_full
+    assert_operator pprof.total_retained_objects, :>=, 5000
+  end
+
+  it "samples allocations at the configured rate" do
+    def sampled_allocation_func
+      Object.new
+    end
+
+    pprof = profile_allocations(sample_rate: 0.1, max_heap_samples: 100000) do |retain|
+      20000.times { retain << sampled_allocation_func }
+    end
+
+    sampled = pprof.heap_samples_including_stack(["sampled_allocation_func"]).sum(&:retained_objects)
+    # Expected value is 2000, with a standard deviation of ~42.
+    assert_operator sampled, :>, 1700
+    assert_operator sampled, :<, 2300
+  end
+
+  it "keeps samples and stacks of all depths in its own memory" do
+    c = MemprofilerPprof::Collector.new(sample_rate: 1.0, huge_pages: true)
+    pprof = profile_allocations(c) do |retain|
+      # Shallow, medium and (deeper than the biggest stack size class) very deep stacks.
+      [1, 100, 1500].each { |depth| 50.times { retain << recursive_allocation_func(depth) } }
+      # The slabs map their memory in chunks of at least 64KiB.
+      assert_operator ObjectSpace.memsize_of(c), :>=, 64 * 1024
+    end
+
+    assert_operator pprof.heap_samples_including_stack(["recursive_allocation_func"]).sum(&:retained_objects), :>=, 150
+  end
+
+  it "keeps the mark table in step with the live frames" do
+    # Each of these methods is a distinct frame, from a file of its own, whose name has to be marked. They don't call
+    # anything, so the objects they allocate are the only ones whose stacks go through them.
+    mark_table_methods = 200.times.map do |i|
+      name = :"mark_table_allocation_func_#{i}"
+      singleton_class.class_eval("def #{name}; [#{i}]; end", "mark_table_#{i}.rb", 1)
+      name
+    end
+
+    c = MemprofilerPprof::Collector.new(sample_rate: 1.0)
+    c.start!
+    retain = mark_table_methods.map { |name| send(name) }
+    c.flush
+    size_with_retained = c.mark_table_size
+    assert c.mark_table_complete?
+
+    retain.clear
+    GC.start
+    assert c.mark_table_complete?
+    GC.compact if GC.respond_to?(:compact)
+    assert c.mark_table_complete?
+
+    # Stopping lets go of the fingerprint cache's stacks, after which flushing prunes the VALUEs which only the freed
+    # samples' frames needed.
+    c.stop!
+    c.flush
+    assert c.mark_table_complete?
+    assert_operator c.mark_table_size, :<, size_with_retained
+  end
 end